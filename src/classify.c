@@ -0,0 +1,249 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  classify.c
+**      Before handing an image to spice, we make a cheap guess at what
+**  sort of content it holds.  Text and user interface elements have few
+**  colors and hard edges, and compress best losslessly.  Photographs have
+**  many colors and soft transitions, and are good candidates for lossy
+**  compression.  Photographic content that changes at a high rate is
+**  most likely video.
+**--------------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "classify.h"
+
+/* We look at a sparse grid of pixels spread over the whole image; enough
+   to get a useful answer without touching most of it */
+#define MIN_SAMPLE_STEP             4
+#define MAX_SAMPLES                 1024
+#define MIN_SAMPLES                 64
+
+/* Color counting uses a small open addressed hash table */
+#define COLOR_TABLE_SIZE            256
+#define UI_MAX_COLORS               48
+
+/* A strong edge is a jump in intensity between horizontally adjacent
+   samples; text and widgets are full of them */
+#define STRONG_EDGE_DELTA           96
+#define UI_MIN_EDGE_PERCENT         25
+
+/* Changes closer together than this are treated as part of one frame */
+#define MIN_FRAME_USEC              (G_USEC_PER_SEC / 60)
+
+void classifier_init(classifier_t *c)
+{
+    memset(c, 0, sizeof(*c));
+}
+
+static int cell_rate(classify_cell_t *cell, gint64 now)
+{
+    /* Stale windows mean the area has gone quiet */
+    if (now - cell->window_start > 2 * G_USEC_PER_SEC)
+        return 0;
+    return cell->rate;
+}
+
+static void cell_note_change(classify_cell_t *cell, gint64 now)
+{
+    gint64 elapsed;
+
+    if (now - cell->last_change < MIN_FRAME_USEC)
+        return;
+    cell->last_change = now;
+
+    elapsed = now - cell->window_start;
+    if (elapsed >= G_USEC_PER_SEC) {
+        cell->rate = (elapsed > 2 * G_USEC_PER_SEC) ? 0 : (cell->count * G_USEC_PER_SEC) / elapsed;
+        cell->count = 0;
+        cell->window_start = now;
+
+        if (cell->rate < CLASSIFY_VIDEO_RATE)
+            cell->video_since = 0;
+        else if (!cell->video_since)
+            cell->video_since = now;
+    }
+    cell->count++;
+}
+
+static void grid_bounds(unsigned int screen_w, unsigned int screen_h, int x, int y, int w, int h,
+                        int *left, int *top, int *right, int *bottom)
+{
+    *left = CLAMP((x * CLASSIFY_GRID) / (int) screen_w, 0, CLASSIFY_GRID - 1);
+    *right = CLAMP(((x + w - 1) * CLASSIFY_GRID) / (int) screen_w, 0, CLASSIFY_GRID - 1);
+    *top = CLAMP((y * CLASSIFY_GRID) / (int) screen_h, 0, CLASSIFY_GRID - 1);
+    *bottom = CLAMP(((y + h - 1) * CLASSIFY_GRID) / (int) screen_h, 0, CLASSIFY_GRID - 1);
+}
+
+/* Record a change to the given area at time 'now', and return the highest
+   change rate, in changes per second, of the area touched */
+int classifier_note_change(classifier_t *c, unsigned int screen_w, unsigned int screen_h,
+                           int x, int y, int w, int h, gint64 now)
+{
+    int cx, cy;
+    int left, right, top, bottom;
+    int rate = 0;
+
+    if (screen_w == 0 || screen_h == 0 || w <= 0 || h <= 0)
+        return 0;
+
+    grid_bounds(screen_w, screen_h, x, y, w, h, &left, &top, &right, &bottom);
+    for (cy = top; cy <= bottom; cy++)
+        for (cx = left; cx <= right; cx++) {
+            classify_cell_t *cell = &c->cells[cy][cx];
+            cell_note_change(cell, now);
+            rate = MAX(rate, cell_rate(cell, now));
+        }
+
+    return rate;
+}
+
+/* Returns the lowest change rate, in changes per second, of the area;
+   unlike classifier_note_change, this records nothing */
+int classifier_min_rate(classifier_t *c, unsigned int screen_w, unsigned int screen_h,
+                        int x, int y, int w, int h, gint64 now)
+{
+    int cx, cy;
+    int left, right, top, bottom;
+    int rate = -1;
+
+    if (screen_w == 0 || screen_h == 0 || w <= 0 || h <= 0)
+        return 0;
+
+    grid_bounds(screen_w, screen_h, x, y, w, h, &left, &top, &right, &bottom);
+    for (cy = top; cy <= bottom; cy++)
+        for (cx = left; cx <= right; cx++) {
+            int cell = cell_rate(&c->cells[cy][cx], now);
+            if (rate == -1 || cell < rate)
+                rate = cell;
+        }
+
+    return rate;
+}
+
+/* Returns TRUE if any part of the area has been changing at video rates
+   for at least 'usec' microseconds */
+gboolean classifier_sustained_video(classifier_t *c, unsigned int screen_w, unsigned int screen_h,
+                                    int x, int y, int w, int h, gint64 usec, gint64 now)
+{
+    int cx, cy;
+    int left, right, top, bottom;
+
+    if (screen_w == 0 || screen_h == 0 || w <= 0 || h <= 0)
+        return FALSE;
+
+    grid_bounds(screen_w, screen_h, x, y, w, h, &left, &top, &right, &bottom);
+
+    for (cy = top; cy <= bottom; cy++)
+        for (cx = left; cx <= right; cx++) {
+            classify_cell_t *cell = &c->cells[cy][cx];
+            if (cell->video_since && cell_rate(cell, now) >= CLASSIFY_VIDEO_RATE &&
+                now - cell->video_since >= usec)
+                return TRUE;
+        }
+
+    return FALSE;
+}
+
+static int intensity(uint32_t pixel)
+{
+    return ((pixel >> 16) & 0xff) + ((pixel >> 8) & 0xff) + (pixel & 0xff);
+}
+
+/* Returns TRUE if the color was not already in the table */
+static gboolean add_color(uint32_t *table, gboolean *used, uint32_t color)
+{
+    unsigned int i = ((color * 2654435761u) >> 24) % COLOR_TABLE_SIZE;
+
+    while (used[i]) {
+        if (table[i] == color)
+            return FALSE;
+        i = (i + 1) % COLOR_TABLE_SIZE;
+    }
+
+    used[i] = TRUE;
+    table[i] = color;
+    return TRUE;
+}
+
+content_type_t classify_image(shm_image_t *shmi, int top, int h, int change_rate)
+{
+    uint32_t table[COLOR_TABLE_SIZE];
+    gboolean used[COLOR_TABLE_SIZE];
+    int colors = 0;
+    int samples = 0;
+    int pairs = 0;
+    int edges = 0;
+    int step = MIN_SAMPLE_STEP;
+    gint64 area = (gint64) shmi->w * h;
+    int x, y;
+
+    memset(used, 0, sizeof(used));
+
+    /* The same step across and down keeps us near MAX_SAMPLES however
+       large the image, so a toolbar above a photo does not fill our quota */
+    while ((gint64) step * step * MAX_SAMPLES < area)
+        step++;
+
+    for (y = top; y < top + h && samples < MAX_SAMPLES; y += step) {
+        uint32_t *row = ((uint32_t *) shmi->segment.shmaddr) + y * shmi->w;
+        for (x = 0; x + 1 < shmi->w && samples < MAX_SAMPLES; x += step) {
+            uint32_t pixel = row[x] & 0xffffff;
+
+            samples++;
+            if (colors < UI_MAX_COLORS && add_color(table, used, pixel))
+                colors++;
+
+            pairs++;
+            if (abs(intensity(pixel) - intensity(row[x + 1])) >= STRONG_EDGE_DELTA)
+                edges++;
+        }
+    }
+
+    /* Small areas are almost always widgets, cursors, or text */
+    if (samples < MIN_SAMPLES || colors < UI_MAX_COLORS)
+        return CONTENT_UI;
+
+    if (pairs && (edges * 100) / pairs >= UI_MIN_EDGE_PERCENT)
+        return CONTENT_UI;
+
+    if (change_rate >= CLASSIFY_VIDEO_RATE)
+        return CONTENT_VIDEO;
+
+    return CONTENT_PHOTO;
+}
+
+const char *classify_name(content_type_t type)
+{
+    switch (type) {
+    case CONTENT_UI:
+        return "ui";
+    case CONTENT_PHOTO:
+        return "photo";
+    case CONTENT_VIDEO:
+        return "video";
+    }
+    return "unknown";
+}
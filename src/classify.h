@@ -0,0 +1,71 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CLASSIFY_H_
+#define CLASSIFY_H_
+
+#include <glib.h>
+
+#include "display.h"
+
+/*----------------------------------------------------------------------------
+**  Definitions and simple types
+**--------------------------------------------------------------------------*/
+typedef enum {
+    CONTENT_UI,
+    CONTENT_PHOTO,
+    CONTENT_VIDEO,
+} content_type_t;
+
+/* We track change frequency on a coarse grid laid over the screen */
+#define CLASSIFY_GRID               16
+
+/* Photographic content that changes this often (per second) is considered video */
+#define CLASSIFY_VIDEO_RATE         10
+
+/*----------------------------------------------------------------------------
+**  Structure definitions
+**--------------------------------------------------------------------------*/
+typedef struct {
+    gint64 window_start;
+    gint64 last_change;
+    int count;
+    int rate;
+    gint64 video_since;
+} classify_cell_t;
+
+typedef struct {
+    classify_cell_t cells[CLASSIFY_GRID][CLASSIFY_GRID];
+} classifier_t;
+
+/*----------------------------------------------------------------------------
+**  Prototypes
+**--------------------------------------------------------------------------*/
+void classifier_init(classifier_t *c);
+int classifier_note_change(classifier_t *c, unsigned int screen_w, unsigned int screen_h,
+                           int x, int y, int w, int h, gint64 now);
+int classifier_min_rate(classifier_t *c, unsigned int screen_w, unsigned int screen_h,
+                        int x, int y, int w, int h, gint64 now);
+gboolean classifier_sustained_video(classifier_t *c, unsigned int screen_w, unsigned int screen_h,
+                                    int x, int y, int w, int h, gint64 usec, gint64 now);
+content_type_t classify_image(shm_image_t *shmi, int top, int h, int change_rate);
+const char *classify_name(content_type_t type);
+
+#endif
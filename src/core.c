@@ -0,0 +1,664 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  core.c
+**      This file implements the SpiceCoreInterface; the timers and file
+**  watches the spice server uses for its network connections, and the
+**  thread that runs them.  There are two backends.  The glib backend runs
+**  a GMainLoop on a context of its own.  The epoll backend keeps every
+**  watch registered with a single epoll descriptor for its lifetime, so
+**  the frequent changes of write interest spice makes while sending are
+**  a single epoll_ctl each, and uses a timerfd for each timer.
+**--------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <glib.h>
+#include <spice.h>
+
+#include "x11spice.h"
+#include "core.h"
+
+#define CORE_MAX_EVENTS             32
+
+/*----------------------------------------------------------------------------
+** The spice core interface gives us no way to pass a data pointer to the
+**  timer and watch callbacks, so the core they belong to is kept here.
+----------------------------------------------------------------------------*/
+static core_t *active_core;
+
+typedef enum { ITEM_WAKE, ITEM_TIMER, ITEM_WATCH } core_item_type_t;
+
+/* What an epoll registration points at */
+typedef struct core_item_struct {
+    core_item_type_t type;
+    int removed;
+    struct core_item_struct *next_dead;
+} core_item_t;
+
+struct SpiceTimer {
+    core_item_t item;
+    SpiceTimerFunc func;
+    void *opaque;
+    GSource *source;
+    int fd;
+};
+
+struct SpiceWatch {
+    core_item_t item;
+    void *opaque;
+    SpiceWatchFunc func;
+    GSource *source;
+    GIOChannel *channel;
+    int fd;
+    int event_mask;
+};
+
+typedef struct {
+    GSourceFunc func;
+    gpointer data;
+} core_invoke_t;
+
+static core_item_t wake_item = { ITEM_WAKE, 0, NULL };
+
+/*----------------------------------------------------------------------------
+**  glib backend
+**--------------------------------------------------------------------------*/
+static SpiceTimer *glib_timer_add(SpiceTimerFunc func, void *opaque)
+{
+    SpiceTimer *timer = (SpiceTimer *) calloc(1, sizeof(SpiceTimer));
+
+    timer->func = func;
+    timer->opaque = opaque;
+    g_atomic_int_inc(&active_core->stats.allocations);
+
+    return timer;
+}
+
+static gboolean glib_timer_func(gpointer user_data)
+{
+    SpiceTimer *timer = user_data;
+
+    g_atomic_int_inc(&active_core->stats.dispatches);
+    timer->func(timer->opaque);
+    /* timer might be free after func(), don't touch */
+
+    return FALSE;
+}
+
+static void glib_timer_cancel(SpiceTimer *timer)
+{
+    if (timer->source) {
+        g_source_destroy(timer->source);
+        g_source_unref(timer->source);
+        timer->source = NULL;
+        g_atomic_int_inc(&active_core->stats.registrations);
+    }
+}
+
+static void glib_timer_start(SpiceTimer *timer, uint32_t ms)
+{
+    glib_timer_cancel(timer);
+
+    timer->source = g_timeout_source_new(ms);
+
+    g_source_set_callback(timer->source, glib_timer_func, timer, NULL);
+
+    g_source_attach(timer->source, active_core->context);
+
+    g_atomic_int_inc(&active_core->stats.allocations);
+    g_atomic_int_inc(&active_core->stats.registrations);
+}
+
+static void glib_timer_remove(SpiceTimer *timer)
+{
+    glib_timer_cancel(timer);
+    free(timer);
+}
+
+static GIOCondition spice_event_to_giocondition(int event_mask)
+{
+    GIOCondition condition = 0;
+
+    if (event_mask & SPICE_WATCH_EVENT_READ)
+        condition |= G_IO_IN;
+    if (event_mask & SPICE_WATCH_EVENT_WRITE)
+        condition |= G_IO_OUT;
+
+    return condition;
+}
+
+static int giocondition_to_spice_event(GIOCondition condition)
+{
+    int event = 0;
+
+    if (condition & G_IO_IN)
+        event |= SPICE_WATCH_EVENT_READ;
+    if (condition & G_IO_OUT)
+        event |= SPICE_WATCH_EVENT_WRITE;
+
+    return event;
+}
+
+static gboolean glib_watch_func(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+    SpiceWatch *watch = data;
+    int fd = g_io_channel_unix_get_fd(source);
+
+    g_atomic_int_inc(&active_core->stats.dispatches);
+    watch->func(fd, giocondition_to_spice_event(condition), watch->opaque);
+
+    return TRUE;
+}
+
+static void glib_watch_update_mask(SpiceWatch *watch, int event_mask)
+{
+    if (watch->source) {
+        g_source_destroy(watch->source);
+        g_source_unref(watch->source);
+        watch->source = NULL;
+        g_atomic_int_inc(&active_core->stats.registrations);
+    }
+
+    if (!event_mask)
+        return;
+
+    watch->source = g_io_create_watch(watch->channel, spice_event_to_giocondition(event_mask));
+    g_source_set_callback(watch->source, (GSourceFunc) glib_watch_func, watch, NULL);
+    g_source_attach(watch->source, active_core->context);
+
+    g_atomic_int_inc(&active_core->stats.allocations);
+    g_atomic_int_inc(&active_core->stats.registrations);
+}
+
+static SpiceWatch *glib_watch_add(int fd, int event_mask, SpiceWatchFunc func, void *opaque)
+{
+    SpiceWatch *watch;
+
+    watch = calloc(1, sizeof(SpiceWatch));
+    watch->channel = g_io_channel_unix_new(fd);
+    watch->fd = fd;
+    watch->func = func;
+    watch->opaque = opaque;
+    g_atomic_int_inc(&active_core->stats.allocations);
+
+    glib_watch_update_mask(watch, event_mask);
+
+    return watch;
+}
+
+static void glib_watch_remove(SpiceWatch *watch)
+{
+    glib_watch_update_mask(watch, 0);
+
+    g_io_channel_unref(watch->channel);
+    free(watch);
+}
+
+/* Count passes through the glib loop, to compare with epoll_wait */
+static gint glib_poll(GPollFD *ufds, guint nfds, gint timeout)
+{
+    if (active_core->flush_func)
+        active_core->flush_func(active_core->flush_data);
+
+    g_atomic_int_inc(&active_core->stats.wakeups);
+    return g_poll(ufds, nfds, timeout);
+}
+
+static void *glib_run(void *opaque)
+{
+    core_t *core = (core_t *) opaque;
+
+    g_main_context_push_thread_default(core->context);
+    g_main_loop_run(core->loop);
+    g_main_context_pop_thread_default(core->context);
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------
+**  epoll backend
+**      Items may be removed by a callback while other events for them
+**  are still waiting in the current batch, so removal only marks them;
+**  they are freed once the batch has been handled.
+**--------------------------------------------------------------------------*/
+static void epoll_bury(core_item_t *item)
+{
+    item->removed = TRUE;
+
+    g_mutex_lock(&active_core->dead_lock);
+    item->next_dead = active_core->dead;
+    active_core->dead = item;
+    g_mutex_unlock(&active_core->dead_lock);
+}
+
+static void epoll_free_dead(core_t *core)
+{
+    core_item_t *item;
+
+    g_mutex_lock(&core->dead_lock);
+    item = core->dead;
+    core->dead = NULL;
+    g_mutex_unlock(&core->dead_lock);
+
+    while (item) {
+        core_item_t *next = item->next_dead;
+        free(item);
+        item = next;
+    }
+}
+
+static SpiceTimer *epoll_timer_add(SpiceTimerFunc func, void *opaque)
+{
+    struct epoll_event ev = { };
+    SpiceTimer *timer;
+
+    timer = calloc(1, sizeof(SpiceTimer));
+    if (!timer)
+        return NULL;
+
+    timer->item.type = ITEM_TIMER;
+    timer->func = func;
+    timer->opaque = opaque;
+
+    timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer->fd == -1) {
+        g_warning("Cannot create timerfd; errno %d", errno);
+        free(timer);
+        return NULL;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = timer;
+    epoll_ctl(active_core->epoll_fd, EPOLL_CTL_ADD, timer->fd, &ev);
+
+    g_atomic_int_inc(&active_core->stats.allocations);
+    g_atomic_int_inc(&active_core->stats.registrations);
+
+    return timer;
+}
+
+static void epoll_timer_set(SpiceTimer *timer, uint32_t ms)
+{
+    struct itimerspec spec = { };
+
+    if (ms) {
+        spec.it_value.tv_sec = ms / 1000;
+        spec.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    } else
+        /* A zero value disarms a timerfd; we want it to fire right away */
+        spec.it_value.tv_nsec = 1;
+
+    timerfd_settime(timer->fd, 0, &spec, NULL);
+}
+
+static void epoll_timer_start(SpiceTimer *timer, uint32_t ms)
+{
+    epoll_timer_set(timer, ms);
+}
+
+static void epoll_timer_cancel(SpiceTimer *timer)
+{
+    struct itimerspec spec = { };
+    timerfd_settime(timer->fd, 0, &spec, NULL);
+}
+
+static void epoll_timer_remove(SpiceTimer *timer)
+{
+    epoll_ctl(active_core->epoll_fd, EPOLL_CTL_DEL, timer->fd, NULL);
+    close(timer->fd);
+    g_atomic_int_inc(&active_core->stats.registrations);
+
+    epoll_bury(&timer->item);
+}
+
+static uint32_t spice_event_to_epoll(int event_mask)
+{
+    uint32_t events = 0;
+
+    if (event_mask & SPICE_WATCH_EVENT_READ)
+        events |= EPOLLIN;
+    if (event_mask & SPICE_WATCH_EVENT_WRITE)
+        events |= EPOLLOUT;
+
+    /* With no interest, we still hear about hangups; edge triggering
+       keeps that from firing on every pass */
+    if (!events)
+        events = EPOLLET;
+
+    return events;
+}
+
+static void epoll_watch_update_mask(SpiceWatch *watch, int event_mask)
+{
+    struct epoll_event ev = { };
+
+    if (watch->event_mask == event_mask)
+        return;
+
+    watch->event_mask = event_mask;
+    ev.events = spice_event_to_epoll(event_mask);
+    ev.data.ptr = watch;
+    epoll_ctl(active_core->epoll_fd, EPOLL_CTL_MOD, watch->fd, &ev);
+
+    g_atomic_int_inc(&active_core->stats.registrations);
+}
+
+static SpiceWatch *epoll_watch_add(int fd, int event_mask, SpiceWatchFunc func, void *opaque)
+{
+    struct epoll_event ev = { };
+    SpiceWatch *watch;
+
+    watch = calloc(1, sizeof(SpiceWatch));
+    if (!watch)
+        return NULL;
+
+    watch->item.type = ITEM_WATCH;
+    watch->fd = fd;
+    watch->func = func;
+    watch->opaque = opaque;
+    watch->event_mask = event_mask;
+
+    ev.events = spice_event_to_epoll(event_mask);
+    ev.data.ptr = watch;
+    if (epoll_ctl(active_core->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        g_warning("Cannot watch fd %d; errno %d", fd, errno);
+        free(watch);
+        return NULL;
+    }
+
+    g_atomic_int_inc(&active_core->stats.allocations);
+    g_atomic_int_inc(&active_core->stats.registrations);
+
+    return watch;
+}
+
+static void epoll_watch_remove(SpiceWatch *watch)
+{
+    epoll_ctl(active_core->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+    g_atomic_int_inc(&active_core->stats.registrations);
+
+    epoll_bury(&watch->item);
+}
+
+static void epoll_drain_invokes(core_t *core)
+{
+    core_invoke_t *invoke;
+
+    while ((invoke = g_async_queue_try_pop(core->invokes))) {
+        invoke->func(invoke->data);
+        free(invoke);
+    }
+}
+
+static void epoll_run_invokes(core_t *core)
+{
+    uint64_t count;
+
+    if (read(core->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        g_warning("Cannot read wake fd; errno %d", errno);
+
+    epoll_drain_invokes(core);
+}
+
+static void epoll_dispatch(core_t *core, struct epoll_event *ev)
+{
+    core_item_t *item = (core_item_t *) ev->data.ptr;
+    SpiceTimer *timer;
+    SpiceWatch *watch;
+    uint64_t expirations;
+    int events;
+
+    if (item->removed)
+        return;
+
+    switch (item->type) {
+    case ITEM_WAKE:
+        epoll_run_invokes(core);
+        break;
+
+    case ITEM_TIMER:
+        timer = (SpiceTimer *) item;
+        if (read(timer->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+            break;
+        g_atomic_int_inc(&core->stats.dispatches);
+        timer->func(timer->opaque);
+        break;
+
+    case ITEM_WATCH:
+        watch = (SpiceWatch *) item;
+        if (!watch->event_mask)
+            break;
+
+        events = 0;
+        if (ev->events & EPOLLIN)
+            events |= SPICE_WATCH_EVENT_READ;
+        if (ev->events & EPOLLOUT)
+            events |= SPICE_WATCH_EVENT_WRITE;
+        /* Let spice find the error when it next reads or writes */
+        if (ev->events & (EPOLLERR | EPOLLHUP))
+            events |= watch->event_mask;
+
+        g_atomic_int_inc(&core->stats.dispatches);
+        watch->func(watch->fd, events & watch->event_mask, watch->opaque);
+        break;
+    }
+}
+
+static void *epoll_run(void *opaque)
+{
+    core_t *core = (core_t *) opaque;
+    struct epoll_event events[CORE_MAX_EVENTS];
+    int i, n;
+
+    while (!g_atomic_int_get(&core->quit)) {
+        if (core->flush_func)
+            core->flush_func(core->flush_data);
+
+        n = epoll_wait(core->epoll_fd, events, CORE_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            g_warning("epoll_wait failed; errno %d", errno);
+            break;
+        }
+
+        g_atomic_int_inc(&core->stats.wakeups);
+        for (i = 0; i < n; i++)
+            epoll_dispatch(core, &events[i]);
+
+        epoll_free_dead(core);
+    }
+
+    return NULL;
+}
+
+static void epoll_wake(core_t *core)
+{
+    uint64_t one = 1;
+
+    if (write(core->wake_fd, &one, sizeof(one)) < 0)
+        g_warning("Cannot wake spice core; errno %d", errno);
+}
+
+/*----------------------------------------------------------------------------
+**  Common entry points
+**--------------------------------------------------------------------------*/
+int core_create(core_t *core, core_backend_t backend)
+{
+    struct epoll_event ev = { };
+
+    memset(core, 0, sizeof(*core));
+    core->backend = backend;
+    core->epoll_fd = core->wake_fd = -1;
+
+    core->iface.base.major_version = SPICE_INTERFACE_CORE_MAJOR;
+    core->iface.base.minor_version = SPICE_INTERFACE_CORE_MINOR;
+
+    if (backend == CORE_EPOLL) {
+        core->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        core->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (core->epoll_fd == -1 || core->wake_fd == -1) {
+            g_warning("Cannot create epoll core; errno %d", errno);
+            core_destroy(core);
+            return X11SPICE_ERR_SPICE_INIT_FAILED;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wake_item;
+        epoll_ctl(core->epoll_fd, EPOLL_CTL_ADD, core->wake_fd, &ev);
+
+        core->invokes = g_async_queue_new();
+        g_mutex_init(&core->dead_lock);
+
+        core->iface.timer_add = epoll_timer_add;
+        core->iface.timer_start = epoll_timer_start;
+        core->iface.timer_cancel = epoll_timer_cancel;
+        core->iface.timer_remove = epoll_timer_remove;
+        core->iface.watch_add = epoll_watch_add;
+        core->iface.watch_update_mask = epoll_watch_update_mask;
+        core->iface.watch_remove = epoll_watch_remove;
+    } else {
+        core->context = g_main_context_new();
+        core->loop = g_main_loop_new(core->context, FALSE);
+        g_main_context_set_poll_func(core->context, glib_poll);
+
+        core->iface.timer_add = glib_timer_add;
+        core->iface.timer_start = glib_timer_start;
+        core->iface.timer_cancel = glib_timer_cancel;
+        core->iface.timer_remove = glib_timer_remove;
+        core->iface.watch_add = glib_watch_add;
+        core->iface.watch_update_mask = glib_watch_update_mask;
+        core->iface.watch_remove = glib_watch_remove;
+    }
+
+    active_core = core;
+    return 0;
+}
+
+/* Start the thread that runs the timers and watches */
+int core_start(core_t *core)
+{
+    if (pthread_create(&core->thread, NULL,
+                       core->backend == CORE_EPOLL ? epoll_run : glib_run, core))
+        return X11SPICE_ERR_SPICE_INIT_FAILED;
+
+    core->running = TRUE;
+    return 0;
+}
+
+void core_stop(core_t *core)
+{
+    void *err;
+
+    if (!core->running)
+        return;
+
+    if (core->backend == CORE_EPOLL) {
+        g_atomic_int_set(&core->quit, TRUE);
+        epoll_wake(core);
+    } else
+        g_main_loop_quit(core->loop);
+
+    pthread_join(core->thread, &err);
+    core->running = FALSE;
+
+    /* Anything the loop did not get to is run here, as core_invoke
+       would now do itself */
+    if (core->backend == CORE_EPOLL)
+        epoll_drain_invokes(core);
+}
+
+void core_destroy(core_t *core)
+{
+    core_stop(core);
+
+    if (core->backend == CORE_EPOLL) {
+        if (core->invokes) {
+            epoll_drain_invokes(core);
+            epoll_free_dead(core);
+            g_async_queue_unref(core->invokes);
+            g_mutex_clear(&core->dead_lock);
+            core->invokes = NULL;
+        }
+        if (core->wake_fd != -1)
+            close(core->wake_fd);
+        if (core->epoll_fd != -1)
+            close(core->epoll_fd);
+        core->wake_fd = core->epoll_fd = -1;
+    } else {
+        if (core->loop)
+            g_main_loop_unref(core->loop);
+        if (core->context)
+            g_main_context_unref(core->context);
+        core->loop = NULL;
+        core->context = NULL;
+    }
+
+    if (active_core == core)
+        active_core = NULL;
+}
+
+/* Run func on the core thread; it is called at once if that is us */
+void core_invoke(core_t *core, GSourceFunc func, gpointer data)
+{
+    core_invoke_t *invoke;
+
+    if (core->backend != CORE_EPOLL) {
+        g_main_context_invoke(core->context, func, data);
+        return;
+    }
+
+    if (!core->running || pthread_equal(pthread_self(), core->thread)) {
+        func(data);
+        return;
+    }
+
+    invoke = malloc(sizeof(*invoke));
+    if (!invoke)
+        return;
+    invoke->func = func;
+    invoke->data = data;
+    g_async_queue_push(core->invokes, invoke);
+    epoll_wake(core);
+}
+
+/* Work batched up by callbacks, such as input injection, is pushed out
+   here; once per pass through the loop.  Set before core_start. */
+void core_set_flush_func(core_t *core, core_flush_func_t func, void *data)
+{
+    core->flush_func = func;
+    core->flush_data = data;
+}
+
+void core_get_stats(core_t *core, core_stats_t *stats)
+{
+    stats->allocations = g_atomic_int_get(&core->stats.allocations);
+    stats->registrations = g_atomic_int_get(&core->stats.registrations);
+    stats->wakeups = g_atomic_int_get(&core->stats.wakeups);
+    stats->dispatches = g_atomic_int_get(&core->stats.dispatches);
+}
@@ -0,0 +1,80 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORE_H_
+#define CORE_H_
+
+#include <pthread.h>
+#include <glib.h>
+#include <spice.h>
+
+#include "options.h"
+
+/*----------------------------------------------------------------------------
+**  Structure definitions
+**--------------------------------------------------------------------------*/
+typedef struct {
+    gint allocations;           /* Timer, watch and source allocations */
+    gint registrations;         /* Changes to the set of polled descriptors */
+    gint wakeups;               /* Passes through the loop */
+    gint dispatches;            /* Timer and watch callbacks */
+} core_stats_t;
+
+typedef void (*core_flush_func_t)(void *data);
+
+typedef struct {
+    core_backend_t backend;
+    SpiceCoreInterface iface;
+
+    /* glib backend */
+    GMainContext *context;
+    GMainLoop *loop;
+
+    /* epoll backend */
+    int epoll_fd;
+    int wake_fd;
+    GAsyncQueue *invokes;
+    GMutex dead_lock;
+    void *dead;
+    int quit;
+
+    /* Called each time the loop is about to sleep */
+    core_flush_func_t flush_func;
+    void *flush_data;
+
+    pthread_t thread;
+    int running;
+
+    core_stats_t stats;
+} core_t;
+
+/*----------------------------------------------------------------------------
+**  Prototypes
+**--------------------------------------------------------------------------*/
+int core_create(core_t *core, core_backend_t backend);
+int core_start(core_t *core);
+void core_stop(core_t *core);
+void core_destroy(core_t *core);
+
+void core_invoke(core_t *core, GSourceFunc func, gpointer data);
+void core_set_flush_func(core_t *core, core_flush_func_t func, void *data);
+void core_get_stats(core_t *core, core_stats_t *stats);
+
+#endif
@@ -38,6 +38,7 @@
 #include <xcb/xcb.h>
 #include <xcb/xcb_aux.h>
 #include <xcb/xkb.h>
+#include <xcb/randr.h>
 #include <pixman.h>
 #include <errno.h>
 
@@ -46,6 +47,8 @@
 #include "display.h"
 #include "session.h"
 #include "scan.h"
+#include "trace.h"
+#include "record.h"
 
 
 static xcb_screen_t *screen_of_display(xcb_connection_t *c, int screen)
@@ -64,6 +67,9 @@ static unsigned int bits_per_pixel(display_t *d)
 {
     xcb_format_iterator_t fmt;
 
+    if (d->source)
+        return 32;
+
     for (fmt = xcb_setup_pixmap_formats_iterator(xcb_get_setup(d->c));
          fmt.rem; xcb_format_next(&fmt))
         if (fmt.data->depth == d->depth)
@@ -73,40 +79,123 @@ static unsigned int bits_per_pixel(display_t *d)
 }
 
 
-static void handle_cursor_notify(display_t *display,
-                                 xcb_xfixes_cursor_notify_event_t *cev G_GNUC_UNUSED)
+static uint64_t hash_cursor_image(int w, int h, int xhot, int yhot,
+                                  uint32_t *imgdata, int imglen)
+{
+    /* 64 bit FNV-1a, salted with the shape geometry */
+    uint64_t hash = 14695981039346656037ULL;
+    int i;
+
+    hash = (hash ^ w) * 1099511628211ULL;
+    hash = (hash ^ h) * 1099511628211ULL;
+    hash = (hash ^ xhot) * 1099511628211ULL;
+    hash = (hash ^ yhot) * 1099511628211ULL;
+    for (i = 0; i < imglen; i++)
+        hash = (hash ^ imgdata[i]) * 1099511628211ULL;
+
+    /* Spice treats a unique id of 0 as 'do not cache' */
+    return hash ? hash : 1;
+}
+
+static cursor_shape_t *find_cursor_shape(display_t *d, uint32_t serial)
+{
+    int i;
+
+    for (i = 0; i < MAX_CURSOR_SHAPES; i++)
+        if (d->cursor_shapes[i].imgdata && d->cursor_shapes[i].serial == serial)
+            return &d->cursor_shapes[i];
+
+    return NULL;
+}
+
+static cursor_shape_t *fetch_cursor_shape(display_t *d, uint32_t serial)
 {
     xcb_xfixes_get_cursor_image_cookie_t icookie;
     xcb_xfixes_get_cursor_image_reply_t *ir;
     xcb_generic_error_t *error;
+    cursor_shape_t *shape;
     int imglen;
     uint32_t *imgdata;
 
-    if (display->session->options.debug_draws >= DEBUG_DRAWS_BASIC) {
-        display_debug("Cursor Notify [seq %d|subtype %d|serial %u]\n",
-                      cev->sequence, cev->subtype, cev->cursor_serial);
-    }
-
-    icookie = xcb_xfixes_get_cursor_image(display->c);
+    icookie = xcb_xfixes_get_cursor_image(d->c);
 
-    ir = xcb_xfixes_get_cursor_image_reply(display->c, icookie, &error);
+    ir = xcb_xfixes_get_cursor_image_reply(d->c, icookie, &error);
     if (error) {
         g_warning("Could not get cursor_image_reply; type %d; code %d; major %d; minor %d\n",
                   error->response_type, error->error_code, error->major_code, error->minor_code);
-        return;
+        return NULL;
     }
 
     if (!ir)
-        return;
+        return NULL;
 
     imglen = xcb_xfixes_get_cursor_image_cursor_image_length(ir);
     imgdata = xcb_xfixes_get_cursor_image_cursor_image(ir);
 
-    session_push_cursor_image(display->session,
-                              ir->x, ir->y, ir->width, ir->height, ir->xhot, ir->yhot,
-                              imglen * sizeof(*imgdata), (uint8_t *) imgdata);
+    /* Replace the oldest entry; cursor sets are small and change rarely */
+    shape = &d->cursor_shapes[d->next_cursor_shape];
+    d->next_cursor_shape = (d->next_cursor_shape + 1) % MAX_CURSOR_SHAPES;
+
+    free(shape->imgdata);
+    shape->imgdata = malloc(imglen * sizeof(*imgdata));
+    if (!shape->imgdata) {
+        free(ir);
+        return NULL;
+    }
+
+    /* The image reply may be for a newer cursor than the one notified */
+    shape->serial = ir->cursor_serial ? ir->cursor_serial : serial;
+    shape->w = ir->width;
+    shape->h = ir->height;
+    shape->xhot = ir->xhot;
+    shape->yhot = ir->yhot;
+    shape->imglen = imglen * sizeof(*imgdata);
+    memcpy(shape->imgdata, imgdata, shape->imglen);
+    shape->unique = hash_cursor_image(ir->width, ir->height, ir->xhot, ir->yhot,
+                                      imgdata, imglen);
+
+    g_atomic_int_set(&d->cursor_x, ir->x);
+    g_atomic_int_set(&d->cursor_y, ir->y);
 
     free(ir);
+    return shape;
+}
+
+static void free_cursor_shapes(display_t *d)
+{
+    int i;
+
+    for (i = 0; i < MAX_CURSOR_SHAPES; i++) {
+        free(d->cursor_shapes[i].imgdata);
+        d->cursor_shapes[i].imgdata = NULL;
+    }
+}
+
+static void handle_cursor_notify(display_t *display, xcb_xfixes_cursor_notify_event_t *cev)
+{
+    cursor_shape_t *shape;
+    int cached = 1;
+
+    shape = find_cursor_shape(display, cev->cursor_serial);
+    if (!shape) {
+        shape = fetch_cursor_shape(display, cev->cursor_serial);
+        cached = 0;
+    }
+
+    if (display->session->options.debug_draws >= DEBUG_DRAWS_BASIC) {
+        display_debug("Cursor Notify [seq %d|subtype %d|serial %u|%s]\n",
+                      cev->sequence, cev->subtype, cev->cursor_serial,
+                      cached ? "cached" : "fetched");
+    }
+
+    if (!shape)
+        return;
+
+    session_push_cursor_image(display->session,
+                              g_atomic_int_get(&display->cursor_x) - shape->xhot,
+                              g_atomic_int_get(&display->cursor_y) - shape->yhot,
+                              shape->w, shape->h, shape->xhot, shape->yhot,
+                              shape->unique, shape->imglen, shape->imgdata);
 }
 
 static void handle_damage_notify(display_t *display, xcb_damage_notify_event_t *dev,
@@ -115,6 +204,10 @@ static void handle_damage_notify(display_t *display, xcb_damage_notify_event_t *
     int i, n;
     pixman_box16_t *p;
 
+    /* Latency is measured from the first event of a batch */
+    if (!display->damage_time)
+        display->damage_time = g_get_monotonic_time();
+
     pixman_region_union_rect(damage_region, damage_region,
                              dev->area.x, dev->area.y, dev->area.width, dev->area.height);
 
@@ -127,6 +220,7 @@ static void handle_damage_notify(display_t *display, xcb_damage_notify_event_t *
                         XCB_XFIXES_REGION_NONE, XCB_XFIXES_REGION_NONE);
 
     p = pixman_region_rectangles(damage_region, &n);
+    trace_instant(TRACE_DAMAGE, n);
 
     /* Compositing window managers such as mutter have a bad habit of sending
        whole screen updates, which ends up being harmful to user experience.
@@ -147,13 +241,14 @@ static void handle_damage_notify(display_t *display, xcb_damage_notify_event_t *
 
     if (display_trust_damage(display)) {
         for (i = 0; i < n; i++)
-            scanner_push(&display->session->scanner, DAMAGE_SCAN_REPORT,
-                         p[i].x1, p[i].y1, p[i].x2 - p[i].x1, p[i].y2 - p[i].y1);
+            session_push_scan(display->session, DAMAGE_SCAN_REPORT,
+                              p[i].x1, p[i].y1, p[i].x2 - p[i].x1, p[i].y2 - p[i].y1);
     } else {
-        scanner_push(&display->session->scanner, FULLSCREEN_SCAN_REQUEST, 0, 0, 0, 0);
+        session_push_scan(display->session, FULLSCREEN_SCAN_REQUEST, 0, 0, 0, 0);
     }
 
     pixman_region_clear(damage_region);
+    display->damage_time = 0;
 }
 
 static void handle_configure_notify(display_t *display, xcb_configure_notify_event_t *cev)
@@ -175,15 +270,57 @@ static void handle_configure_notify(display_t *display, xcb_configure_notify_eve
     session_handle_resize(display->session);
 }
 
+static void handle_randr_notify(display_t *display, xcb_generic_event_t *ev)
+{
+    if (display->session->options.debug_draws >= DEBUG_DRAWS_BASIC)
+        display_debug("%s: RandR event %d\n", __func__,
+                      ev->response_type - display->randr_ext->first_event);
+
+    /* The size change, if any, arrives as a ConfigureNotify on the root;
+       all we need to track here is the monitor layout */
+    session_handle_resize(display->session);
+}
+
+/* The LEDs spice tracks, by their XKB indicator names */
+static const struct {
+    const char *name;
+    int spice_flag;
+} led_names[NUM_LEDS] = {
+    { "Caps Lock", SPICE_KEYBOARD_MODIFIER_FLAGS_CAPS_LOCK },
+    { "Num Lock", SPICE_KEYBOARD_MODIFIER_FLAGS_NUM_LOCK },
+    { "Scroll Lock", SPICE_KEYBOARD_MODIFIER_FLAGS_SCROLL_LOCK },
+};
+
+static void handle_indicator_notify(display_t *display,
+                                    xcb_xkb_indicator_state_notify_event_t *iev)
+{
+    int leds = 0;
+    int i;
+
+    for (i = 0; i < NUM_LEDS; i++)
+        if (display->led_index[i] >= 0 && (iev->state & (1u << display->led_index[i])))
+            leds |= led_names[i].spice_flag;
+
+    if (leds == g_atomic_int_get(&display->leds))
+        return;
+
+    g_atomic_int_set(&display->leds, leds);
+    session_handle_leds(display->session);
+}
+
 static void *handle_xevents(void *opaque)
 {
     display_t *display = (display_t *) opaque;
     xcb_generic_event_t *ev = NULL;
     pixman_region16_t damage_region;
+    gint64 cpu_seen = 0;
 
     pixman_region_init(&damage_region);
+    trace_thread_name("x events");
 
     while ((ev = xcb_wait_for_event(display->c))) {
+        gint64 start = trace_begin();
+
         if (ev->response_type == display->xfixes_ext->first_event + XCB_XFIXES_CURSOR_NOTIFY)
             handle_cursor_notify(display, (xcb_xfixes_cursor_notify_event_t *) ev);
 
@@ -193,11 +330,25 @@ static void *handle_xevents(void *opaque)
         else if (ev->response_type == XCB_CONFIGURE_NOTIFY)
             handle_configure_notify(display, (xcb_configure_notify_event_t *) ev);
 
+        else if (display->xkb_ext && ev->response_type == display->xkb_ext->first_event &&
+                 ((xcb_xkb_indicator_state_notify_event_t *) ev)->xkbType ==
+                 XCB_XKB_INDICATOR_STATE_NOTIFY)
+            handle_indicator_notify(display, (xcb_xkb_indicator_state_notify_event_t *) ev);
+
+        else if (display->randr_ext &&
+                 (ev->response_type == display->randr_ext->first_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY ||
+                  ev->response_type == display->randr_ext->first_event + XCB_RANDR_NOTIFY))
+            handle_randr_notify(display, ev);
+
         else
             g_debug("Unexpected X event %d", ev->response_type);
 
+        trace_end(TRACE_X_EVENT, start, ev->response_type);
         free(ev);
 
+        if (display->session)
+            governor_charge(&display->session->governor, &cpu_seen);
+
         if (display->session && !session_alive(display->session))
             break;
     }
@@ -228,15 +379,187 @@ static int register_for_events(display_t *d)
     return 0;
 }
 
+/* Look up the LEDs once, then let XKB tell us when they change.  The
+   requests are all sent before we wait on any reply. */
+static void register_for_leds(display_t *d)
+{
+    xcb_intern_atom_cookie_t atom_cookies[NUM_LEDS];
+    xcb_intern_atom_reply_t *atom_reply;
+    xcb_xkb_get_named_indicator_cookie_t indicator_cookies[NUM_LEDS];
+    xcb_xkb_get_named_indicator_reply_t *indicator_reply;
+    int leds = 0;
+    int i;
+
+    for (i = 0; i < NUM_LEDS; i++) {
+        d->led_index[i] = -1;
+        atom_cookies[i] = xcb_intern_atom(d->c, 0, strlen(led_names[i].name), led_names[i].name);
+    }
+
+    for (i = 0; i < NUM_LEDS; i++) {
+        atom_reply = xcb_intern_atom_reply(d->c, atom_cookies[i], NULL);
+        indicator_cookies[i] = xcb_xkb_get_named_indicator(d->c, XCB_XKB_ID_USE_CORE_KBD,
+                                                           XCB_XKB_LED_CLASS_DFLT_XI_CLASS,
+                                                           XCB_XKB_ID_DFLT_XI_ID,
+                                                           atom_reply ? atom_reply->atom : XCB_NONE);
+        free(atom_reply);
+    }
+
+    for (i = 0; i < NUM_LEDS; i++) {
+        indicator_reply = xcb_xkb_get_named_indicator_reply(d->c, indicator_cookies[i], NULL);
+        if (!indicator_reply)
+            continue;
+        if (indicator_reply->found) {
+            d->led_index[i] = indicator_reply->ndx;
+            if (indicator_reply->on)
+                leds |= led_names[i].spice_flag;
+        }
+        free(indicator_reply);
+    }
+    g_atomic_int_set(&d->leds, leds);
+
+    d->xkb_ext = xcb_get_extension_data(d->c, &xcb_xkb_id);
+    xcb_xkb_select_events(d->c, XCB_XKB_ID_USE_CORE_KBD,
+                          XCB_XKB_EVENT_TYPE_INDICATOR_STATE_NOTIFY, 0,
+                          XCB_XKB_EVENT_TYPE_INDICATOR_STATE_NOTIFY, 0, 0, NULL);
+}
+
+/* RandR is optional; without it, or if it does not report any active
+   monitors, we treat the whole screen as a single head */
+static void register_for_randr(display_t *d)
+{
+    xcb_randr_query_version_cookie_t vcookie;
+    xcb_randr_query_version_reply_t *version;
+    xcb_void_cookie_t cookie;
+    xcb_generic_error_t *error;
+
+    d->randr_ext = xcb_get_extension_data(d->c, &xcb_randr_id);
+    if (!d->randr_ext || !d->randr_ext->present) {
+        g_debug("RandR not available; assuming a single monitor");
+        d->randr_ext = NULL;
+        return;
+    }
+
+    vcookie = xcb_randr_query_version(d->c, XCB_RANDR_MAJOR_VERSION, XCB_RANDR_MINOR_VERSION);
+    version = xcb_randr_query_version_reply(d->c, vcookie, &error);
+    if (error) {
+        g_warning("Could not query RandR; type %d; code %d; major %d; minor %d",
+                  error->response_type, error->error_code, error->major_code, error->minor_code);
+        free(error);
+        d->randr_ext = NULL;
+        return;
+    }
+    free(version);
+
+    cookie = xcb_randr_select_input_checked(d->c, d->root,
+                                            XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE |
+                                            XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE);
+    error = xcb_request_check(d->c, cookie);
+    if (error) {
+        g_warning("Could not select RandR input; type %d; code %d; major %d; minor %d",
+                  error->response_type, error->error_code, error->major_code, error->minor_code);
+        free(error);
+    }
+}
+
+static int read_randr_heads(display_t *d, head_t *heads)
+{
+    xcb_randr_get_screen_resources_current_cookie_t rcookie;
+    xcb_randr_get_screen_resources_current_reply_t *resources;
+    xcb_randr_crtc_t *crtcs;
+    xcb_generic_error_t *error;
+    int num_crtcs;
+    int count = 0;
+    int i, j;
+
+    rcookie = xcb_randr_get_screen_resources_current(d->c, d->root);
+    resources = xcb_randr_get_screen_resources_current_reply(d->c, rcookie, &error);
+    if (error) {
+        g_warning("Could not get RandR resources; type %d; code %d; major %d; minor %d",
+                  error->response_type, error->error_code, error->major_code, error->minor_code);
+        free(error);
+        return 0;
+    }
+
+    crtcs = xcb_randr_get_screen_resources_current_crtcs(resources);
+    num_crtcs = xcb_randr_get_screen_resources_current_crtcs_length(resources);
+
+    for (i = 0; i < num_crtcs && count < MAX_HEADS; i++) {
+        xcb_randr_get_crtc_info_cookie_t ccookie;
+        xcb_randr_get_crtc_info_reply_t *crtc;
+        head_t head;
+
+        ccookie = xcb_randr_get_crtc_info(d->c, crtcs[i], resources->config_timestamp);
+        crtc = xcb_randr_get_crtc_info_reply(d->c, ccookie, &error);
+        if (error) {
+            free(error);
+            continue;
+        }
+
+        if (crtc->mode == XCB_NONE || crtc->num_outputs == 0 || crtc->width == 0 ||
+            crtc->height == 0) {
+            free(crtc);
+            continue;
+        }
+
+        /* Clip to the screen; during a resize the crtc can briefly
+           extend past the root window */
+        head.x = MAX(crtc->x, 0);
+        head.y = MAX(crtc->y, 0);
+        head.w = MIN(crtc->x + crtc->width, (int) d->width) - head.x;
+        head.h = MIN(crtc->y + crtc->height, (int) d->height) - head.y;
+        free(crtc);
+
+        if ((int) head.w <= 0 || (int) head.h <= 0)
+            continue;
+
+        /* Cloned outputs show the same pixels; only export them once */
+        for (j = 0; j < count; j++)
+            if (memcmp(&heads[j], &head, sizeof(head)) == 0)
+                break;
+        if (j == count)
+            heads[count++] = head;
+    }
+
+    free(resources);
+    return count;
+}
+
+/* Refresh the monitor layout.  Returns 1 if it changed */
+int display_query_heads(display_t *d)
+{
+    head_t heads[MAX_HEADS];
+    int count = 0;
+    int i;
+
+    if (d->randr_ext)
+        count = read_randr_heads(d, heads);
+
+    if (count == 0) {
+        heads[0].x = heads[0].y = 0;
+        heads[0].w = d->width;
+        heads[0].h = d->height;
+        count = 1;
+    }
+
+    if (count == d->num_heads && memcmp(heads, d->heads, sizeof(*heads) * count) == 0)
+        return 0;
+
+    memcpy(d->heads, heads, sizeof(*heads) * count);
+    d->num_heads = count;
+
+    for (i = 0; i < count; i++)
+        g_debug("head %d: %dx%d @ %dx%d", i, d->heads[i].w, d->heads[i].h,
+                d->heads[i].x, d->heads[i].y);
+
+    return 1;
+}
+
 static void shm_segment_destroy(display_t *d, shm_segment_t *segment)
 {
     if (segment->shmid == -1) {
         return;
     }
 
-    xcb_shm_detach(d->c, segment->shmseg);
-    segment->shmseg = -1;
-
     shmdt(segment->shmaddr);
     segment->shmaddr = NULL;
 
@@ -258,6 +581,7 @@ static int shm_cache_get(display_t *d, size_t size, shm_segment_t *segment)
     cache_total++;
 #endif
 
+    metrics_add(METRIC_SHM_CACHE_LOOKUPS, 1);
     g_mutex_lock(&d->shm_cache_mutex);
 
     /* Check the cache for a segment of size 'size' or bigger.
@@ -292,6 +616,7 @@ static int shm_cache_get(display_t *d, size_t size, shm_segment_t *segment)
         entry_to_use->shmid = -1;
 
         ret = 1;
+        metrics_add(METRIC_SHM_CACHE_HITS, 1);
 
 #if defined(DEBUG_SHM_CACHE)
         cache_hits++;
@@ -368,6 +693,17 @@ static void shm_cache_destroy(display_t *d)
     g_mutex_unlock(&d->shm_cache_mutex);
 }
 
+static void display_disconnect(display_t *d)
+{
+    if (d->pointer_c)
+        xcb_disconnect(d->pointer_c);
+    if (d->input_c)
+        xcb_disconnect(d->input_c);
+    if (d->c)
+        xcb_disconnect(d->c);
+    d->pointer_c = d->input_c = d->c = NULL;
+}
+
 int display_open(display_t *d, session_t *session)
 {
     int scr;
@@ -388,14 +724,28 @@ int display_open(display_t *d, session_t *session)
     if (!d->c || xcb_connection_has_error(d->c)) {
         fprintf(stderr, "Error:  could not open display %s\n",
                 session->options.display ? session->options.display : "");
-        return X11SPICE_ERR_NODISPLAY;
+        rc = X11SPICE_ERR_NODISPLAY;
+        goto fail;
+    }
+
+    /* Injected input and pointer polling get connections of their own,
+       each used by one thread, so a large image reply never sits in front
+       of a key press.  Each scanner opens its own for captures. */
+    d->input_c = xcb_connect(session->options.display, NULL);
+    d->pointer_c = xcb_connect(session->options.display, NULL);
+    if (xcb_connection_has_error(d->input_c) || xcb_connection_has_error(d->pointer_c)) {
+        fprintf(stderr, "Error:  could not open extra connections to display %s\n",
+                session->options.display ? session->options.display : "");
+        rc = X11SPICE_ERR_NODISPLAY;
+        goto fail;
     }
 
     screen = screen_of_display(d->c, scr);
     if (!screen) {
         fprintf(stderr, "Error:  could not get screen for display %s\n",
                 session->options.display ? session->options.display : "");
-        return X11SPICE_ERR_NODISPLAY;
+        rc = X11SPICE_ERR_NODISPLAY;
+        goto fail;
     }
     d->root = screen->root;
     d->width = screen->width_in_pixels;
@@ -406,7 +756,8 @@ int display_open(display_t *d, session_t *session)
     if (!d->damage_ext) {
         fprintf(stderr, "Error:  XDAMAGE not found on display %s\n",
                 session->options.display ? session->options.display : "");
-        return X11SPICE_ERR_NODAMAGE;
+        rc = X11SPICE_ERR_NODAMAGE;
+        goto fail;
     }
 
     if (session->options.full_screen_fps <= 0) {
@@ -417,7 +768,8 @@ int display_open(display_t *d, session_t *session)
             fprintf(stderr,
                     "Error:  Could not query damage; type %d; code %d; major %d; minor %d\n",
                     error->response_type, error->error_code, error->major_code, error->minor_code);
-            return X11SPICE_ERR_NODAMAGE;
+            rc = X11SPICE_ERR_NODAMAGE;
+            goto fail;
         }
         free(damage_version);
 
@@ -430,7 +782,8 @@ int display_open(display_t *d, session_t *session)
             fprintf(stderr,
                     "Error:  Could not create damage; type %d; code %d; major %d; minor %d\n",
                     error->response_type, error->error_code, error->major_code, error->minor_code);
-            return X11SPICE_ERR_NODAMAGE;
+            rc = X11SPICE_ERR_NODAMAGE;
+            goto fail;
         }
     }
 
@@ -438,14 +791,16 @@ int display_open(display_t *d, session_t *session)
     if (!d->shm_ext) {
         fprintf(stderr, "Error:  XSHM not found on display %s\n",
                 session->options.display ? session->options.display : "");
-        return X11SPICE_ERR_NOSHM;
+        rc = X11SPICE_ERR_NOSHM;
+        goto fail;
     }
 
     d->xfixes_ext = xcb_get_extension_data(d->c, &xcb_xfixes_id);
     if (!d->xfixes_ext) {
         fprintf(stderr, "Error:  XFIXES not found on display %s\n",
                 session->options.display ? session->options.display : "");
-        return X11SPICE_ERR_NOXFIXES;
+        rc = X11SPICE_ERR_NOXFIXES;
+        goto fail;
     }
 
     xcb_xfixes_query_version(d->c, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
@@ -458,7 +813,8 @@ int display_open(display_t *d, session_t *session)
         fprintf(stderr,
                 "Error:  Could not select cursor input; type %d; code %d; major %d; minor %d\n",
                 error->response_type, error->error_code, error->major_code, error->minor_code);
-        return X11SPICE_ERR_NOXFIXES;
+        rc = X11SPICE_ERR_NOXFIXES;
+        goto fail;
     }
 
     use_cookie = xcb_xkb_use_extension(d->c, XCB_XKB_MAJOR_VERSION, XCB_XKB_MINOR_VERSION);
@@ -466,33 +822,74 @@ int display_open(display_t *d, session_t *session)
     if (error) {
         fprintf(stderr, "Error: could not get use reply; type %d; code %d; major %d; minor %d\n",
                 error->response_type, error->error_code, error->major_code, error->minor_code);
-        return X11SPICE_ERR_NO_XKB;
+        rc = X11SPICE_ERR_NO_XKB;
+        goto fail;
     }
     free(use_reply);
 
 
     rc = register_for_events(d);
     if (rc)
-        return rc;
+        goto fail;
+
+    register_for_leds(d);
+    register_for_randr(d);
+    display_query_heads(d);
 
     g_mutex_init(&d->shm_cache_mutex);
     for (i = 0; i < G_N_ELEMENTS(d->shm_cache); i++) {
         d->shm_cache[i].shmid = -1;
     }
+    for (i = 0; i < G_N_ELEMENTS(d->mirror_locks); i++)
+        g_rw_lock_init(&d->mirror_locks[i]);
 
     rc = display_create_screen_images(d);
+    if (rc) {
+        display_close(d);
+        return rc;
+    }
 
     g_message("Display %s opened", session->options.display ? session->options.display : "");
 
     return rc;
+
+fail:
+    display_disconnect(d);
+    return rc;
+}
+
+/* A display with no X server behind it; screen content comes from 'source',
+   and there is one head covering the whole screen */
+int display_open_source(display_t *d, session_t *session, display_source_t *source,
+                        unsigned int w, unsigned int h)
+{
+    int i;
+
+    d->session = session;
+    d->source = source;
+    d->width = w;
+    d->height = h;
+    d->depth = 24;
+
+    d->num_heads = 1;
+    d->heads[0].x = d->heads[0].y = 0;
+    d->heads[0].w = w;
+    d->heads[0].h = h;
+
+    g_mutex_init(&d->shm_cache_mutex);
+    for (i = 0; i < G_N_ELEMENTS(d->shm_cache); i++) {
+        d->shm_cache[i].shmid = -1;
+    }
+    for (i = 0; i < G_N_ELEMENTS(d->mirror_locks); i++)
+        g_rw_lock_init(&d->mirror_locks[i]);
+
+    return display_create_screen_images(d);
 }
 
 shm_image_t *create_shm_image(display_t *d, unsigned int w, unsigned int h)
 {
     shm_image_t *shmi;
     size_t imgsize;
-    xcb_void_cookie_t cookie;
-    xcb_generic_error_t *error;
 
     shmi = calloc(1, sizeof(*shmi));
     if (!shmi)
@@ -522,60 +919,141 @@ shm_image_t *create_shm_image(display_t *d, unsigned int w, unsigned int h)
     shmctl(shmi->segment.shmid, IPC_RMID, NULL);
     shmi->segment.size = imgsize;
 
-    shmi->segment.shmseg = xcb_generate_id(d->c);
-    cookie = xcb_shm_attach_checked(d->c, shmi->segment.shmseg, shmi->segment.shmid, 0);
-    error = xcb_request_check(d->c, cookie);
+    return shmi;
+}
+
+/* An X shm segment is attached per connection, so a segment that is read
+   into over and over is attached to the connection of the one thread that
+   reads it, until it is detached or destroyed.  Segments in the cache, or
+   held by spice, are never attached. */
+int attach_shm_image(display_t *d, xcb_connection_t *c, shm_image_t *shmi)
+{
+    xcb_void_cookie_t cookie;
+    xcb_generic_error_t *error;
+
+    if (d->source)
+        return 0;
+
+    shmi->segment.shmseg = xcb_generate_id(c);
+    cookie = xcb_shm_attach_checked(c, shmi->segment.shmseg, shmi->segment.shmid, 0);
+    error = xcb_request_check(c, cookie);
     if (error) {
         g_warning("Could not attach; type %d; code %d; major %d; minor %d\n",
                   error->response_type, error->error_code, error->major_code, error->minor_code);
-        return NULL;
+        free(error);
+        return X11SPICE_ERR_NOSHM;
     }
 
-    return shmi;
+    shmi->segment.attached = c;
+    return 0;
+}
+
+void detach_shm_image(shm_image_t *shmi)
+{
+    if (shmi->segment.attached) {
+        xcb_shm_detach(shmi->segment.attached, shmi->segment.shmseg);
+        shmi->segment.attached = NULL;
+    }
 }
 
-int read_shm_image(display_t *d, shm_image_t *shmi, int x, int y)
+/* Read the screen at x, y into shmi over the caller's own connection 'c'.
+   An image that is not attached is attached for just this read; the
+   attach is checked once the image reply is in, so it costs no extra
+   round trip. */
+int read_shm_image(display_t *d, xcb_connection_t *c, shm_image_t *shmi, int x, int y)
 {
     xcb_shm_get_image_cookie_t cookie;
+    xcb_void_cookie_t attach_cookie = { 0 };
     xcb_generic_error_t *e;
+    xcb_generic_error_t *attach_error = NULL;
     xcb_shm_get_image_reply_t *reply;
+    xcb_shm_seg_t shmseg = shmi->segment.shmseg;
 
-    cookie = xcb_shm_get_image(d->c, d->root, x, y, shmi->w, shmi->h,
-                               ~0, XCB_IMAGE_FORMAT_Z_PIXMAP, shmi->segment.shmseg, 0);
+    if (d->source) {
+        if (d->source->read_image(d->source->data, shmi, x, y))
+            return -1;
+        metrics_add(METRIC_BYTES_CAPTURED, (guint64) shmi->bytes_per_line * shmi->h);
+        return 0;
+    }
+
+    if (shmi->segment.attached && shmi->segment.attached != c) {
+        g_warning("shm segment read over a connection it is not attached to");
+        return -1;
+    }
+
+    if (!shmi->segment.attached) {
+        shmseg = xcb_generate_id(c);
+        attach_cookie = xcb_shm_attach_checked(c, shmseg, shmi->segment.shmid, 0);
+    }
+
+    cookie = xcb_shm_get_image(c, d->root, x, y, shmi->w, shmi->h,
+                               ~0, XCB_IMAGE_FORMAT_Z_PIXMAP, shmseg, 0);
+
+    reply = xcb_shm_get_image_reply(c, cookie, &e);
+
+    if (!shmi->segment.attached) {
+        attach_error = xcb_request_check(c, attach_cookie);
+        if (attach_error)
+            free(attach_error);
+        else
+            xcb_shm_detach(c, shmseg);
+    }
 
-    reply = xcb_shm_get_image_reply(d->c, cookie, &e);
     if (e) {
         g_warning("xcb_shm_get_image from %dx%d into size %dx%d failed", x, y, shmi->w, shmi->h);
+        free(e);
         return -1;
     }
     free(reply);
 
+    metrics_add(METRIC_BYTES_CAPTURED, (guint64) shmi->bytes_per_line * shmi->h);
+    record_capture(shmi->segment.shmaddr, shmi->bytes_per_line, x, y, shmi->w, shmi->h);
     return 0;
 }
 
-int display_find_changed_tiles(display_t *d, int row, bool *tiles, int tiles_across)
+/* Read 'scanline' from the screen at x, row and compare it to what we have
+   recorded in fullscreen.  The scanline is split into tiles_across tiles. */
+static GRWLock *mirror_band(display_t *d, int row)
+{
+    return &d->mirror_locks[(row / MIRROR_BAND_ROWS) % MIRROR_BANDS];
+}
+
+int display_find_changed_tiles(display_t *d, xcb_connection_t *c, shm_image_t *scanline,
+                               int x, int row, bool *tiles, int tiles_across)
 {
     int ret;
     int len;
     int i;
 
     memset(tiles, 0, sizeof(*tiles) * tiles_across);
-    ret = read_shm_image(d, d->scanline, 0, row);
+    if (x + scanline->w > d->fullscreen->w || row >= d->fullscreen->h)
+        return 0;
+
+    /* The round trip is made without any lock; only the compare
+       against the mirror needs one */
+    ret = read_shm_image(d, c, scanline, x, row);
     if (ret == 0) {
-        uint32_t *old = ((uint32_t *) d->fullscreen->segment.shmaddr) + row * d->fullscreen->w;
-        uint32_t *new = ((uint32_t *) d->scanline->segment.shmaddr);
-        if (memcmp(old, new, sizeof(*old) * d->scanline->w) == 0)
+        uint32_t *old = ((uint32_t *) d->fullscreen->segment.shmaddr) +
+            row * d->fullscreen->w + x;
+        uint32_t *new = ((uint32_t *) scanline->segment.shmaddr);
+        GRWLock *band = mirror_band(d, row);
+
+        g_rw_lock_reader_lock(band);
+        if (memcmp(old, new, sizeof(*old) * scanline->w) == 0) {
+            g_rw_lock_reader_unlock(band);
             return 0;
+        }
 
-        len = d->scanline->w / tiles_across;
+        len = scanline->w / tiles_across;
         for (i = 0; i < tiles_across; i++, old += len, new += len) {
             if (i == tiles_across - 1)
-                len = d->scanline->w - (i * len);
+                len = scanline->w - (i * len);
             if (memcmp(old, new, sizeof(*old) * len)) {
                 ret++;
                 tiles[i] = true;
             }
         }
+        g_rw_lock_reader_unlock(band);
     }
     if (d->session->options.debug_draws >= DEBUG_DRAWS_DETAIL) {
         fprintf(stderr, "%d: ", row);
@@ -588,10 +1066,48 @@ int display_find_changed_tiles(display_t *d, int row, bool *tiles, int tiles_acr
     return ret;
 }
 
+/* Compare a row against a single color.  The work is done in fixed size chunks
+   with no early exit inside a chunk, which lets the compiler vectorize the
+   inner loop, while still letting us bail out quickly on busy content. */
+#define SOLID_CHUNK_PIXELS          16
+static bool row_is_solid(const uint32_t *p, unsigned int w, uint32_t color)
+{
+    unsigned int i, j;
+    uint32_t diff = 0;
+
+    for (i = 0; i + SOLID_CHUNK_PIXELS <= w; i += SOLID_CHUNK_PIXELS) {
+        for (j = 0; j < SOLID_CHUNK_PIXELS; j++)
+            diff |= p[i + j] ^ color;
+        if (diff)
+            return false;
+    }
+
+    for (; i < w; i++)
+        diff |= p[i] ^ color;
+
+    return diff == 0;
+}
+
+/* Check whether the w x h area at x, y of an shm image is all one color.
+   The color of its first pixel is returned in 'color'. */
+bool display_area_is_solid(shm_image_t *shmi, int x, int y, int w, int h, uint32_t *color)
+{
+    uint32_t *p = ((uint32_t *) shmi->segment.shmaddr) + y * shmi->w + x;
+    int i;
+
+    *color = *p;
+    for (i = 0; i < h; i++, p += shmi->w)
+        if (!row_is_solid(p, w, *color))
+            return false;
+
+    return true;
+}
+
 void display_copy_image_into_fullscreen(display_t *d, shm_image_t *shmi, int x, int y)
 {
     uint32_t *to = ((uint32_t *) d->fullscreen->segment.shmaddr) + (y * d->fullscreen->w) + x;
     uint32_t *from = ((uint32_t *) shmi->segment.shmaddr);
+    GRWLock *band = NULL;
     int i;
 
     /* Ignore invalid draws.  This can happen if the screen is resized after a scan
@@ -602,13 +1118,24 @@ void display_copy_image_into_fullscreen(display_t *d, shm_image_t *shmi, int x,
         return;
 
     for (i = 0; i < shmi->h; i++) {
+        if (mirror_band(d, y + i) != band) {
+            if (band)
+                g_rw_lock_writer_unlock(band);
+            band = mirror_band(d, y + i);
+            g_rw_lock_writer_lock(band);
+        }
         memcpy(to, from, sizeof(*to) * shmi->w);
         from += shmi->w;
         to += d->fullscreen->w;
     }
+    if (band)
+        g_rw_lock_writer_unlock(band);
 }
 
-int display_scan_whole_screen(display_t *d, int num_vertical_tiles, int num_horizontal_tiles,
+/* Compare the area of the screen covered by 'head' against fullscreen.
+   Tiles are relative to the head. */
+int display_scan_whole_screen(display_t *d, xcb_connection_t *c, head_t *head,
+                              int num_vertical_tiles, int num_horizontal_tiles,
                               bool tiles[][num_horizontal_tiles], int *tiles_changed_in_row)
 {
     int ret;
@@ -619,42 +1146,46 @@ int display_scan_whole_screen(display_t *d, int num_vertical_tiles, int num_hori
     memset(tiles, 0, sizeof(**tiles) * num_vertical_tiles * num_horizontal_tiles);
     memset(tiles_changed_in_row, 0, sizeof(*tiles_changed_in_row) * num_vertical_tiles);
 
-    fullscreen_new = create_shm_image(d, 0, 0);
+    /* If we're in the middle of a screen resize, just bail */
+    if (head->x + head->w > d->fullscreen->w || head->y + head->h > d->fullscreen->h)
+        return 0;
+
+    fullscreen_new = create_shm_image(d, head->w, head->h);
     if (!fullscreen_new)
         return 0;
 
-    ret = read_shm_image(d, fullscreen_new, 0, 0);
+    ret = read_shm_image(d, c, fullscreen_new, head->x, head->y);
     if (ret == 0) {
-        if (d->fullscreen->h != fullscreen_new->h || d->fullscreen->w != fullscreen_new->w) {
-            /* If we're in the middle of a screen resize, just bail */
-            destroy_shm_image(d, fullscreen_new);
-            return 0;
-        }
-
         for (v_tile = 0; v_tile < num_vertical_tiles; v_tile++) {
             /* Note that integer math and multiplying first is important;
                especially in the case where our screen height is not a
                multiple of 32 */
-            int ystart = (v_tile * d->fullscreen->h) / num_vertical_tiles;
-            int yend = ((v_tile + 1) * d->fullscreen->h) / num_vertical_tiles;
-            for (y = ystart; y < yend && y < d->fullscreen->h; y++) {
+            int ystart = (v_tile * fullscreen_new->h) / num_vertical_tiles;
+            int yend = ((v_tile + 1) * fullscreen_new->h) / num_vertical_tiles;
+            for (y = ystart; y < yend && y < fullscreen_new->h; y++) {
                 uint32_t *old = ((uint32_t *) d->fullscreen->segment.shmaddr) +
-                    (y * d->fullscreen->w);
+                    ((head->y + y) * d->fullscreen->w) + head->x;
                 uint32_t *new = ((uint32_t *) fullscreen_new->segment.shmaddr) +
                     (y * fullscreen_new->w);
-                if (memcmp(old, new, sizeof(*old) * d->fullscreen->w) == 0)
+                GRWLock *band = mirror_band(d, head->y + y);
+
+                g_rw_lock_reader_lock(band);
+                if (memcmp(old, new, sizeof(*old) * fullscreen_new->w) == 0) {
+                    g_rw_lock_reader_unlock(band);
                     continue;
+                }
 
-                len = d->fullscreen->w / num_horizontal_tiles;
+                len = fullscreen_new->w / num_horizontal_tiles;
                 for (h_tile = 0; h_tile < num_horizontal_tiles; h_tile++, old += len, new += len) {
                     if (h_tile == num_horizontal_tiles - 1)
-                        len = d->fullscreen->w - (h_tile * len);
+                        len = fullscreen_new->w - (h_tile * len);
                     if (memcmp(old, new, sizeof(*old) * len)) {
                         ret++;
                         tiles[v_tile][h_tile] = true;
                         tiles_changed_in_row[v_tile]++;
                     }
                 }
+                g_rw_lock_reader_unlock(band);
             }
             if (d->session->options.debug_draws >= DEBUG_DRAWS_DETAIL) {
                 fprintf(stderr, "%d: ", v_tile);
@@ -685,12 +1216,11 @@ int display_scan_whole_screen(display_t *d, int num_vertical_tiles, int num_hori
 
 void destroy_shm_image(display_t *d, shm_image_t *shmi)
 {
+    detach_shm_image(shmi);
     if (!shm_cache_add(d, &shmi->segment)) {
         /* Could not add to cache, destroy this segment */
         shm_segment_destroy(d, &shmi->segment);
     }
-    if (shmi->drawable_ptr)
-        free(shmi->drawable_ptr);
     free(shmi);
 }
 
@@ -710,18 +1240,115 @@ int display_create_screen_images(display_t *d)
         return X11SPICE_ERR_NOSHM;
     }
 
-    d->scanline = create_shm_image(d, 0, 1);
-    if (!d->scanline) {
-        destroy_shm_image(d, d->primary);
-        d->primary = NULL;
-        destroy_shm_image(d, d->fullscreen);
-        d->fullscreen = NULL;
-        return X11SPICE_ERR_NOSHM;
+    return 0;
+}
+
+/* Copy the area common to both images from 'from' into 'to', and clear
+   the rest of 'to'.  The primary is handed to spice with a negative
+   stride, so its rows are stored bottom up. */
+static void copy_screen_image(shm_image_t *to, shm_image_t *from, bool bottom_up)
+{
+    unsigned int w = MIN(to->w, from->w);
+    unsigned int h = MIN(to->h, from->h);
+    unsigned int y;
+
+    for (y = 0; y < to->h; y++) {
+        uint8_t *dst = (uint8_t *) to->segment.shmaddr +
+            (bottom_up ? to->h - 1 - y : y) * to->bytes_per_line;
+
+        if (y < h) {
+            uint8_t *src = (uint8_t *) from->segment.shmaddr +
+                (bottom_up ? from->h - 1 - y : y) * from->bytes_per_line;
+            memcpy(dst, src, w * sizeof(uint32_t));
+            memset(dst + w * sizeof(uint32_t), 0, to->bytes_per_line - w * sizeof(uint32_t));
+        } else
+            memset(dst, 0, to->bytes_per_line);
+    }
+}
+
+/* Lay 'shmi' out again, in its own segment, as a w x h image, keeping
+   the area common to the old and new sizes and clearing the rest.  Rows
+   keep their order in memory, so moving those that go down first, lowest
+   first, and then those that go up, highest first, never overwrites a
+   row before it has been moved. */
+static void resize_screen_image_in_place(shm_image_t *shmi, unsigned int w, unsigned int h,
+                                         bool bottom_up)
+{
+    uint8_t *base = (uint8_t *) shmi->segment.shmaddr;
+    unsigned int old_bpl = shmi->bytes_per_line;
+    unsigned int new_bpl = w * sizeof(uint32_t);
+    unsigned int common_w = MIN(w, shmi->w) * sizeof(uint32_t);
+    unsigned int common_h = MIN(h, shmi->h);
+    unsigned int i;
+    unsigned int y;
+    int pass;
+
+    for (pass = 0; pass < 2; pass++)
+        for (i = 0; i < common_h; i++) {
+            /* i counts rows in memory order; ascending on the first pass */
+            unsigned int k = pass == 0 ? i : common_h - 1 - i;
+            size_t from, to;
+
+            y = bottom_up ? common_h - 1 - k : k;
+            from = (size_t) (bottom_up ? shmi->h - 1 - y : y) * old_bpl;
+            to = (size_t) (bottom_up ? h - 1 - y : y) * new_bpl;
+            if ((pass == 0 && to <= from) || (pass == 1 && to > from))
+                memmove(base + to, base + from, common_w);
+        }
+
+    for (y = 0; y < h; y++) {
+        uint8_t *row = base + (size_t) (bottom_up ? h - 1 - y : y) * new_bpl;
+
+        if (y < common_h)
+            memset(row + common_w, 0, new_bpl - common_w);
+        else
+            memset(row, 0, new_bpl);
     }
 
+    shmi->w = w;
+    shmi->h = h;
+    shmi->bytes_per_line = new_bpl;
+}
+
+/* Bring one screen image to the current screen size.  If its segment is
+   big enough, as it is whenever the screen shrinks, the rows are moved in
+   place; otherwise a new image is made and the old one given back. */
+static int resize_screen_image(display_t *d, shm_image_t **shmi, bool bottom_up)
+{
+    shm_image_t *resized;
+    size_t size = (size_t) d->width * d->height * sizeof(uint32_t);
+
+    if ((*shmi)->segment.size >= size) {
+        resize_screen_image_in_place(*shmi, d->width, d->height, bottom_up);
+        return 0;
+    }
+
+    resized = create_shm_image(d, 0, 0);
+    if (!resized)
+        return X11SPICE_ERR_NOSHM;
+
+    copy_screen_image(resized, *shmi, bottom_up);
+    destroy_shm_image(d, *shmi);
+    *shmi = resized;
     return 0;
 }
 
+/* Bring the screen images to the current screen size, keeping the
+   content of the area the old and new sizes share, so it need not be
+   captured or sent again.  Only a screen that grows needs new segments,
+   and they are made one image at a time.  The caller must make sure
+   spice is no longer using the old primary. */
+int display_resize_screen_images(display_t *d)
+{
+    int rc;
+
+    rc = resize_screen_image(d, &d->primary, true);
+    if (rc == 0)
+        rc = resize_screen_image(d, &d->fullscreen, false);
+
+    return rc;
+}
+
 void display_destroy_screen_images(display_t *d)
 {
     if (d->primary) {
@@ -733,11 +1360,6 @@ void display_destroy_screen_images(display_t *d)
         destroy_shm_image(d, d->fullscreen);
         d->fullscreen = NULL;
     }
-
-    if (d->scanline) {
-        destroy_shm_image(d, d->scanline);
-        d->scanline = NULL;
-    }
 }
 
 int display_start_event_thread(display_t *d)
@@ -755,13 +1377,21 @@ void display_stop_event_thread(display_t *d)
 
 void display_close(display_t *d)
 {
+    unsigned int i;
+
+    free_cursor_shapes(d);
     shm_cache_destroy(d);
     g_mutex_clear(&d->shm_cache_mutex);
+    for (i = 0; i < G_N_ELEMENTS(d->mirror_locks); i++)
+        g_rw_lock_clear(&d->mirror_locks[i]);
+    display_destroy_screen_images(d);
+    if (d->source)
+        return;
+
     if (d->session->options.full_screen_fps <= 0) {
         xcb_damage_destroy(d->c, d->damage);
     }
-    display_destroy_screen_images(d);
-    xcb_disconnect(d->c);
+    display_disconnect(d);
 }
 
 int display_trust_damage(display_t *d)
@@ -36,6 +36,7 @@ typedef struct {
     int shmid;  /* if shmid is -1: the shm_segment_t is "empty", other members are undefined */
     size_t size;
     xcb_shm_seg_t shmseg;
+    xcb_connection_t *attached; /* Holds shmseg, if the segment is attached */
     void *shmaddr;
 } shm_segment_t;
 
@@ -47,8 +48,50 @@ typedef struct {
     void *drawable_ptr;
 } shm_image_t;
 
+/* A monitor, as reported by RandR, in root window coordinates */
 typedef struct {
-    xcb_connection_t *c;
+    int x;
+    int y;
+    unsigned int w;
+    unsigned int h;
+} head_t;
+
+#define MAX_HEADS                   16
+
+/* Caps, Num and Scroll Lock are the LEDs spice knows about */
+#define NUM_LEDS                    3
+
+/* A cursor shape we have fetched, keyed by its XFixes serial.  The unique
+   id comes from the content, so the spice client can cache the shape. */
+typedef struct {
+    uint32_t serial;
+    uint64_t unique;
+    int w;
+    int h;
+    int xhot;
+    int yhot;
+    int imglen;
+    uint8_t *imgdata;
+} cursor_shape_t;
+
+#define MAX_CURSOR_SHAPES           32
+
+/* The fullscreen mirror is guarded in bands of rows, so a scanner
+   comparing one part of the screen does not wait on a copy into another */
+#define MIRROR_BAND_ROWS            64
+#define MIRROR_BANDS                16
+
+/* Supplies screen content in place of the X server; the replay driver
+   uses one to run the scanners from a recording */
+typedef struct {
+    int (*read_image)(void *data, shm_image_t *shmi, int x, int y);
+    void *data;
+} display_source_t;
+
+typedef struct {
+    xcb_connection_t *c;            /* Setup, and events on the event thread */
+    xcb_connection_t *input_c;      /* XTEST, from the spice core thread */
+    xcb_connection_t *pointer_c;    /* Pointer queries, from the pointer tracker */
     xcb_window_t root;
     unsigned int width;
     unsigned int height;
@@ -56,15 +99,29 @@ typedef struct {
 
     const xcb_query_extension_reply_t *damage_ext;
     xcb_damage_damage_t damage;
+    gint64 damage_time;         /* Arrival of the damage being handled */
     unsigned int fullscreen_damage_count;
 
     const xcb_query_extension_reply_t *shm_ext;
 
     const xcb_query_extension_reply_t *xfixes_ext;
 
+    const xcb_query_extension_reply_t *xkb_ext;
+    int led_index[NUM_LEDS];    /* XKB indicator index, or -1 */
+    gint leds;                  /* In spice's keyboard modifier flags */
+
+    const xcb_query_extension_reply_t *randr_ext;
+    int num_heads;
+    head_t heads[MAX_HEADS];
+
+    cursor_shape_t cursor_shapes[MAX_CURSOR_SHAPES];
+    int next_cursor_shape;
+    gint cursor_x;
+    gint cursor_y;
+
     shm_image_t *primary;
     shm_image_t *fullscreen;
-    shm_image_t *scanline;
+    GRWLock mirror_locks[MIRROR_BANDS];
 
     /* The SHM cache holds up to 10 segments, this provides a good cache
        hit rate while keeping memory usage reasonable.  */
@@ -73,6 +130,8 @@ typedef struct {
 
     pthread_t event_thread;
     struct session_struct *session;
+
+    display_source_t *source;   /* NULL when reading from X */
 } display_t;
 
 /* Levels for debug-draws */
@@ -87,18 +146,27 @@ enum {
 **  Prototypes
 **--------------------------------------------------------------------------*/
 int display_open(display_t *d, struct session_struct *session);
+int display_open_source(display_t *d, struct session_struct *session,
+                        display_source_t *source, unsigned int w, unsigned int h);
 void display_close(display_t *display);
 int display_create_screen_images(display_t *d);
 void display_destroy_screen_images(display_t *d);
+int display_resize_screen_images(display_t *d);
 int display_start_event_thread(display_t *d);
 void display_stop_event_thread(display_t *d);
-int display_find_changed_tiles(display_t *d, int row, bool *tiles, int tiles_across);
+int display_query_heads(display_t *d);
+int display_find_changed_tiles(display_t *d, xcb_connection_t *c, shm_image_t *scanline,
+                               int x, int row, bool *tiles, int tiles_across);
 void display_copy_image_into_fullscreen(display_t *d, shm_image_t *shmi, int x, int y);
-int display_scan_whole_screen(display_t *d, int num_vertical_tiles, int num_horizontal_tiles,
+bool display_area_is_solid(shm_image_t *shmi, int x, int y, int w, int h, uint32_t *color);
+int display_scan_whole_screen(display_t *d, xcb_connection_t *c, head_t *head,
+                              int num_vertical_tiles, int num_horizontal_tiles,
                               bool tiles[][num_horizontal_tiles], int *tiles_changed_in_row);
 
 shm_image_t *create_shm_image(display_t *d, unsigned int w, unsigned int h);
-int read_shm_image(display_t *d, shm_image_t *shmi, int x, int y);
+int attach_shm_image(display_t *d, xcb_connection_t *c, shm_image_t *shmi);
+void detach_shm_image(shm_image_t *shmi);
+int read_shm_image(display_t *d, xcb_connection_t *c, shm_image_t *shmi, int x, int y);
 void destroy_shm_image(display_t *d, shm_image_t *shmi);
 
 int display_trust_damage(display_t *d);
@@ -0,0 +1,134 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  governor.c
+**      Keeps the CPU used by the scanner and X event threads within a
+**  budget.  Each governed thread charges the CPU time it has used, from
+**  its own CLOCK_THREAD_CPUTIME_ID, as it goes.  Once a window has passed,
+**  we compare the total against the budget and move the throttle level
+**  up or down a step; the scanners read the level to decide how hard to
+**  work.
+**--------------------------------------------------------------------------*/
+
+#include <time.h>
+#include <glib.h>
+
+#include "governor.h"
+
+/* We only ease off throttling once use is well under the budget, so we
+   do not flap between two levels */
+#define GOVERNOR_RELAX_PERCENT      75
+
+void governor_init(governor_t *g, int budget)
+{
+    g->budget = budget > 0 ? budget : 0;
+    g_mutex_init(&g->lock);
+    g->window_start = 0;
+    g->window_cpu_ns = 0;
+    g->level = 0;
+    g->cpu_percent = 0;
+}
+
+void governor_destroy(governor_t *g)
+{
+    g_mutex_clear(&g->lock);
+}
+
+static void set_level(governor_t *g, int level, int percent)
+{
+    int old = g_atomic_int_get(&g->level);
+
+    if (level == old)
+        return;
+
+    g_atomic_int_set(&g->level, level);
+    if (old == 0)
+        g_message("CPU use of %d%% is over the budget of %d%%; throttling scanning", percent,
+                  g->budget);
+    else if (level == 0)
+        g_message("CPU use of %d%% is within the budget of %d%%; no longer throttling", percent,
+                  g->budget);
+    else
+        g_debug("CPU use %d%%, budget %d%%; throttle level %d", percent, g->budget, level);
+}
+
+/* Add cpu_ns of CPU time used as of 'now' */
+void governor_account(governor_t *g, gint64 cpu_ns, gint64 now)
+{
+    gint64 elapsed;
+    int percent;
+    int level;
+
+    if (g->budget == 0)
+        return;
+
+    g_mutex_lock(&g->lock);
+
+    if (g->window_start == 0)
+        g->window_start = now;
+    g->window_cpu_ns += cpu_ns;
+
+    elapsed = now - g->window_start;
+    if (elapsed >= GOVERNOR_PERIOD_USEC) {
+        percent = (int) (g->window_cpu_ns / 10 / elapsed);
+        g_atomic_int_set(&g->cpu_percent, percent);
+
+        level = g_atomic_int_get(&g->level);
+        if (percent > g->budget && level < GOVERNOR_MAX_LEVEL)
+            level++;
+        else if (percent < g->budget * GOVERNOR_RELAX_PERCENT / 100 && level > 0)
+            level--;
+        set_level(g, level, percent);
+
+        g->window_start = now;
+        g->window_cpu_ns = 0;
+    }
+
+    g_mutex_unlock(&g->lock);
+}
+
+/* Charge the CPU the calling thread has used since it last called us;
+   cpu_seen is the thread's own, and should start at 0 */
+void governor_charge(governor_t *g, gint64 *cpu_seen)
+{
+    struct timespec ts;
+    gint64 cpu;
+
+    if (g->budget == 0)
+        return;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    cpu = (gint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    if (*cpu_seen)
+        governor_account(g, cpu - *cpu_seen, g_get_monotonic_time());
+    *cpu_seen = cpu;
+}
+
+int governor_level(governor_t *g)
+{
+    return g_atomic_int_get(&g->level);
+}
+
+int governor_cpu_percent(governor_t *g)
+{
+    return g_atomic_int_get(&g->cpu_percent);
+}
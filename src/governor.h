@@ -0,0 +1,61 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GOVERNOR_H_
+#define GOVERNOR_H_
+
+#include <glib.h>
+
+/*----------------------------------------------------------------------------
+**  Definitions and simple types
+**--------------------------------------------------------------------------*/
+
+/* CPU use is judged over windows of this length */
+#define GOVERNOR_PERIOD_USEC        G_USEC_PER_SEC
+
+/* Each level halves the scan rate; 0 is full speed */
+#define GOVERNOR_MAX_LEVEL          4
+
+/* Each level adds this much to the minimum time between full screen scans */
+#define GOVERNOR_FULL_SCAN_USEC     (G_USEC_PER_SEC / 4)
+
+/*----------------------------------------------------------------------------
+**  Structure definitions
+**--------------------------------------------------------------------------*/
+typedef struct {
+    int budget;                 /* Percent of one core; 0 for no limit */
+    GMutex lock;
+    gint64 window_start;
+    gint64 window_cpu_ns;
+    gint level;
+    gint cpu_percent;           /* Over the last full window */
+} governor_t;
+
+/*----------------------------------------------------------------------------
+**  Prototypes
+**--------------------------------------------------------------------------*/
+void governor_init(governor_t *g, int budget);
+void governor_destroy(governor_t *g);
+void governor_charge(governor_t *g, gint64 *cpu_seen);
+void governor_account(governor_t *g, gint64 cpu_ns, gint64 now);
+int governor_level(governor_t *g);
+int governor_cpu_percent(governor_t *g);
+
+#endif
@@ -28,6 +28,7 @@
 #include "gui.h"
 #include "session.h"
 #include "x11spice.h"
+#include "trace.h"
 
 gui_t *cached_gui;
 void gui_sigterm(void)
@@ -37,7 +38,22 @@ void gui_sigterm(void)
     cached_gui = NULL;
 }
 
-void gui_remote_connected(gui_t *gui, const char *details)
+/* Connection notices come from the spice core thread, so they are
+   passed to the gtk main loop to be shown */
+typedef struct {
+    gui_t *gui;
+    int connected;
+    char *details;
+    guint source_id;
+} gui_status_t;
+
+static void free_status(gui_status_t *status)
+{
+    g_free(status->details);
+    g_free(status);
+}
+
+static void show_remote_connected(gui_t *gui, const char *details)
 {
     gtk_label_set_text(GTK_LABEL(gui->status_label), "Connection established");
     gtk_widget_set_tooltip_text(gui->status_label, details);
@@ -48,12 +64,55 @@ void gui_remote_connected(gui_t *gui, const char *details)
     }
 }
 
-void gui_remote_disconnected(gui_t *gui)
+static void show_remote_disconnected(gui_t *gui)
 {
     gtk_label_set_text(GTK_LABEL(gui->status_label), "Waiting for connection");
     gtk_widget_set_sensitive(gui->disconnect_button, FALSE);
 }
 
+static gboolean show_status(gpointer data)
+{
+    gui_status_t *status = (gui_status_t *) data;
+    gint64 start = trace_begin();
+
+    g_mutex_lock(&status->gui->pending_lock);
+    status->gui->pending = g_slist_remove(status->gui->pending, status);
+    g_mutex_unlock(&status->gui->pending_lock);
+
+    if (status->connected)
+        show_remote_connected(status->gui, status->details);
+    else
+        show_remote_disconnected(status->gui);
+    trace_end(TRACE_GUI_STATUS, start, status->connected);
+
+    free_status(status);
+    return FALSE;
+}
+
+static void post_status(gui_t *gui, int connected, const char *details)
+{
+    gui_status_t *status = g_new0(gui_status_t, 1);
+
+    status->gui = gui;
+    status->connected = connected;
+    status->details = g_strdup(details);
+
+    g_mutex_lock(&gui->pending_lock);
+    status->source_id = g_idle_add(show_status, status);
+    gui->pending = g_slist_prepend(gui->pending, status);
+    g_mutex_unlock(&gui->pending_lock);
+}
+
+void gui_remote_connected(gui_t *gui, const char *details)
+{
+    post_status(gui, TRUE, details);
+}
+
+void gui_remote_disconnected(gui_t *gui)
+{
+    post_status(gui, FALSE, NULL);
+}
+
 void gui_disconnect_clicked(GtkWidget *widget G_GNUC_UNUSED, gpointer data)
 {
     gui_t *gui = (gui_t *) data;
@@ -73,6 +132,8 @@ int gui_create(gui_t *gui, session_t *session, int argc, char *argv[])
         return X11SPICE_ERR_GTK_FAILED;
 
     gui->session = session;
+    g_mutex_init(&gui->pending_lock);
+    gui->pending = NULL;
     gui->window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     g_signal_connect(gui->window, "destroy", G_CALLBACK(gui_sigterm), NULL);
 
@@ -85,7 +146,7 @@ int gui_create(gui_t *gui, session_t *session, int argc, char *argv[])
     gui->disconnect_button = gtk_button_new_from_stock(GTK_STOCK_DISCONNECT);
     gtk_container_add(GTK_CONTAINER(gui->button_box), gui->disconnect_button);
     g_signal_connect(gui->disconnect_button, "clicked", G_CALLBACK(gui_disconnect_clicked), gui);
-    gui_remote_disconnected(gui);
+    show_remote_disconnected(gui);
 
     gui->quit_button = gtk_button_new_from_stock(GTK_STOCK_QUIT);
     gtk_container_add(GTK_CONTAINER(gui->button_box), gui->quit_button);
@@ -113,14 +174,29 @@ int gui_create(gui_t *gui, session_t *session, int argc, char *argv[])
 void gui_run(gui_t *gui)
 {
     cached_gui = gui;
+    trace_thread_name("gui");
     gtk_main();
     cached_gui = NULL;
 }
 
 void gui_destroy(gui_t *gui)
 {
+    GSList *p;
+
     /* gtk destroys these windows on exit */
     gui->window = NULL;
+
+    /* A disconnect at shutdown is posted after gtk_main has returned */
+    g_mutex_lock(&gui->pending_lock);
+    for (p = gui->pending; p; p = p->next) {
+        gui_status_t *status = (gui_status_t *) p->data;
+        g_source_remove(status->source_id);
+        free_status(status);
+    }
+    g_slist_free(gui->pending);
+    gui->pending = NULL;
+    g_mutex_unlock(&gui->pending_lock);
+    g_mutex_clear(&gui->pending_lock);
 }
 
 void gui_report_error(gui_t *gui, const char *message)
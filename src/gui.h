@@ -36,6 +36,10 @@ typedef struct {
     GtkWidget *status_label;
     struct session_struct *session;
     int timeout_id;
+
+    /* Status posts not yet shown; freed by gui_destroy if gtk never runs them */
+    GMutex pending_lock;
+    GSList *pending;
 } gui_t;
 
 /*----------------------------------------------------------------------------
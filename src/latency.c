@@ -0,0 +1,134 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  latency.c
+**      Histograms of how long screen updates spend in each stage of our
+**  pipeline, from X damage through capture to spice releasing the draw
+**  command.  Each update carries a latency_stamps_t; when spice releases
+**  it, every stage transition is recorded.  Recording is an atomic add
+**  into a fixed bucket, so any thread may record without a lock, and the
+**  cost is low enough to leave on all the time.
+**--------------------------------------------------------------------------*/
+
+#include <string.h>
+#include <glib.h>
+
+#include "latency.h"
+
+static const char *histogram_names[LATENCY_STAGES] = {
+    "damage to release",
+    "damage to queued",
+    "queue wait",
+    "capture",
+    "classify and build",
+    "spice pickup",
+    "spice hold",
+};
+
+static int bucket_of(gint64 us)
+{
+    int magnitude;
+
+    if (us < LATENCY_SUB_BUCKETS)
+        return us < 0 ? 0 : (int) us;
+
+    /* Keep the top bits of the value; 4 of them for 16 sub buckets */
+    magnitude = 63 - __builtin_clzll((guint64) us);
+    if (magnitude - 3 >= LATENCY_MAGNITUDES)
+        return LATENCY_BUCKETS - 1;
+
+    return (magnitude - 3) * LATENCY_SUB_BUCKETS + (int) (us >> (magnitude - 4))
+        - LATENCY_SUB_BUCKETS;
+}
+
+/* The smallest value that lands in a bucket */
+static gint64 value_of(int bucket)
+{
+    int magnitude;
+
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+
+    magnitude = bucket / LATENCY_SUB_BUCKETS + 3;
+    return (gint64) (bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS) << (magnitude - 4);
+}
+
+void latency_init(latency_t *l)
+{
+    memset(l, 0, sizeof(*l));
+}
+
+void latency_record(latency_histogram_t *h, gint64 us)
+{
+    g_atomic_int_inc(&h->counts[bucket_of(us)]);
+    g_atomic_int_inc(&h->total);
+}
+
+void latency_record_stamps(latency_t *l, latency_stamps_t *stamps)
+{
+    int i;
+
+    for (i = 1; i < LATENCY_STAGES; i++)
+        if (stamps->at[i - 1] && stamps->at[i])
+            latency_record(&l->hist[i], stamps->at[i] - stamps->at[i - 1]);
+
+    if (stamps->at[LATENCY_DAMAGE] && stamps->at[LATENCY_RELEASED])
+        latency_record(&l->hist[0], stamps->at[LATENCY_RELEASED] - stamps->at[LATENCY_DAMAGE]);
+}
+
+/* Counts move under us while we read; the answer is approximate */
+gint64 latency_percentile(latency_histogram_t *h, double percent)
+{
+    gint64 total = g_atomic_int_get(&h->total);
+    gint64 seen = 0;
+    int i;
+
+    if (total == 0)
+        return 0;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += g_atomic_int_get(&h->counts[i]);
+        if (seen * 100.0 >= total * percent)
+            return value_of(i);
+    }
+
+    return value_of(LATENCY_BUCKETS - 1);
+}
+
+void latency_log(latency_t *l)
+{
+    latency_histogram_t *h;
+    int i;
+
+    for (i = 0; i < LATENCY_STAGES; i++) {
+        h = &l->hist[i];
+        if (g_atomic_int_get(&h->total) == 0)
+            continue;
+
+        g_message("latency %-18s %8d samples; p50 %" G_GINT64_FORMAT " us, p90 %"
+                  G_GINT64_FORMAT " us, p99 %" G_GINT64_FORMAT " us, p99.9 %"
+                  G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us",
+                  histogram_names[i], g_atomic_int_get(&h->total),
+                  latency_percentile(h, 50), latency_percentile(h, 90),
+                  latency_percentile(h, 99), latency_percentile(h, 99.9),
+                  latency_percentile(h, 100));
+    }
+}
@@ -0,0 +1,76 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <glib.h>
+
+/*----------------------------------------------------------------------------
+**  Definitions and simple types
+**--------------------------------------------------------------------------*/
+
+/* Where a screen update is on its way from X damage to the client */
+typedef enum {
+    LATENCY_DAMAGE,
+    LATENCY_QUEUED,
+    LATENCY_CAPTURE_START,
+    LATENCY_CAPTURE_DONE,
+    LATENCY_DRAWABLE_QUEUED,
+    LATENCY_POPPED,
+    LATENCY_RELEASED,
+    LATENCY_STAGES
+} latency_stage_t;
+
+/* Buckets are log-linear, as in HdrHistogram: each power of two of
+   microseconds is split into LATENCY_SUB_BUCKETS, giving about 6% precision */
+#define LATENCY_SUB_BUCKETS         16
+#define LATENCY_MAGNITUDES          32
+#define LATENCY_BUCKETS             (LATENCY_MAGNITUDES * LATENCY_SUB_BUCKETS)
+
+/*----------------------------------------------------------------------------
+**  Structure definitions
+**--------------------------------------------------------------------------*/
+
+/* Monotonic times in microseconds; 0 if the stage was not seen */
+typedef struct {
+    gint64 at[LATENCY_STAGES];
+} latency_stamps_t;
+
+typedef struct {
+    gint counts[LATENCY_BUCKETS];
+    gint total;
+} latency_histogram_t;
+
+/* Histogram 0 is damage to release; histogram n is stage n-1 to stage n */
+typedef struct {
+    latency_histogram_t hist[LATENCY_STAGES];
+} latency_t;
+
+/*----------------------------------------------------------------------------
+**  Prototypes
+**--------------------------------------------------------------------------*/
+void latency_init(latency_t *l);
+void latency_record(latency_histogram_t *h, gint64 us);
+void latency_record_stamps(latency_t *l, latency_stamps_t *stamps);
+gint64 latency_percentile(latency_histogram_t *h, double percent);
+void latency_log(latency_t *l);
+
+#endif
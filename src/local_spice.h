@@ -25,6 +25,8 @@
 
 #include "options.h"
 #include "display.h"
+#include "core.h"
+#include "latency.h"
 
 struct session_struct;
 
@@ -36,6 +38,8 @@ typedef struct {
     SpiceCoreInterface *core;
     QXLInstance display_sin;
 
+    core_t core_loop;
+
     int width;
     int height;
 
@@ -50,21 +54,27 @@ typedef struct {
     struct session_struct *session;
 } spice_t;
 
-typedef enum { RELEASE_SHMI, RELEASE_MEMORY } release_type_t;
+typedef enum { RELEASE_SHMI, RELEASE_MEMORY, RELEASE_DRAWABLE } release_type_t;
 
 typedef struct {
     release_type_t type;
     void *data;
     spice_t *s;
+    latency_stamps_t stamps;
 } spice_release_t;
 
 /*----------------------------------------------------------------------------
 **  Prototypes
 **--------------------------------------------------------------------------*/
 int spice_start(spice_t *s, options_t *options, shm_image_t *primary);
+int spice_start_core(spice_t *s);
+void spice_stop_core(spice_t *s);
 void spice_end(spice_t *s);
-int spice_create_primary(spice_t *s, int w, int h, int bytes_per_line, void *shmaddr);
+void spice_invoke(spice_t *s, GSourceFunc func, gpointer data);
+int spice_create_primary(spice_t *s, int w, int h, int bytes_per_line, void *shmaddr,
+                         int keep_data);
 void spice_destroy_primary(spice_t *s);
+int spice_send_monitors_config(spice_t *s, int num_heads, head_t *heads);
 
 spice_release_t *spice_create_release(spice_t *s, release_type_t type, void *data);
 void spice_free_release(spice_release_t *r);
@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <glib-unix.h>
 
 #include "x11spice.h"
 #include "options.h"
@@ -37,6 +38,8 @@
 #include "agent.h"
 #include "gui.h"
 #include "session.h"
+#include "trace.h"
+#include "record.h"
 
 
 static void sigterm_handler(int arg G_GNUC_UNUSED)
@@ -51,6 +54,22 @@ static void handle_sigterm(void)
     sigaction(SIGTERM, &act, NULL);
 }
 
+static gboolean report_latency(gpointer data)
+{
+    session_t *session = (session_t *) data;
+
+    latency_log(&session->latency);
+    return TRUE;
+}
+
+/* Both run from the gui main loop */
+static void handle_latency_reports(session_t *session)
+{
+    g_unix_signal_add(SIGUSR1, report_latency, session);
+    if (session->options.latency_report > 0)
+        g_timeout_add_seconds(session->options.latency_report, report_latency, session);
+}
+
 int main(int argc, char *argv[])
 {
     int rc;
@@ -62,6 +81,8 @@ int main(int argc, char *argv[])
     int gui_created = 0;
     int session_created = 0;
     int session_started = 0;
+    int trace_opened = 0;
+    int recording = 0;
 
     /*------------------------------------------------------------------------
     **  Parse arguments
@@ -87,6 +108,11 @@ int main(int argc, char *argv[])
         goto exit;
     display_opened = 1;
 
+    if (session.options.record_file &&
+        record_open(session.options.record_file, session.display.width,
+                    session.display.height) == 0)
+        recording = 1;
+
     /*------------------------------------------------------------------------
     **  Initialize the GUI
     **----------------------------------------------------------------------*/
@@ -105,6 +131,12 @@ int main(int argc, char *argv[])
         goto exit;
     }
 
+    /*------------------------------------------------------------------------
+    **  Tracing must be on before the threads we trace start
+    **----------------------------------------------------------------------*/
+    if (session.options.trace_file && trace_open(session.options.trace_file) == 0)
+        trace_opened = 1;
+
     /*------------------------------------------------------------------------
     **  Start up a spice server
     **----------------------------------------------------------------------*/
@@ -123,7 +155,15 @@ int main(int argc, char *argv[])
         goto exit;
     session_started = 1;
 
+    /*------------------------------------------------------------------------
+    **  Only now can clients reach us; hand the spice server to its thread
+    **----------------------------------------------------------------------*/
+    rc = spice_start_core(&session.spice);
+    if (rc)
+        goto exit;
+
     handle_sigterm();
+    handle_latency_reports(&session);
 
     /*------------------------------------------------------------------------
     **  The spice server (prior to November 2016) can call exit() prior to
@@ -143,20 +183,29 @@ exit:
     if (session_started)
         session_end(&session);
 
+    if (recording)
+        record_close();
+
     if (spice_started) {
+        spice_stop_core(&session.spice);
         agent_stop(&session.agent);
         spice_end(&session.spice);
     }
 
+    if (trace_opened)
+        trace_close();
+
     if (gui_created)
         gui_destroy(&session.gui);
 
-    if (display_opened)
-        display_close(&session.display);
-
+    /* Draws still queued hold shm images; they must be released while
+       the display can still detach them */
     if (session_created)
         session_destroy(&session);
 
+    if (display_opened)
+        display_close(&session.display);
+
     options_free(&session.options);
 
     return rc;
@@ -0,0 +1,274 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  metrics.c
+**      Counters for monitoring, and a Unix socket that serves them.  Every
+**  thread that counts gets its own block of counters, found through a
+**  GPrivate, so the hot paths only do a plain add to memory no other
+**  thread writes.  Blocks are linked into a registry the first time a
+**  thread counts; a snapshot walks the registry and sums them.  When a
+**  thread exits, its counts are folded into a retired block.
+**
+**  Each connection to the socket gets one snapshot, one 'name value'
+**  line per metric, and is then closed.
+**--------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <glib.h>
+
+#include "x11spice.h"
+#include "metrics.h"
+
+typedef struct metrics_thread_struct {
+    guint64 counts[METRIC_COUNTERS];    /* Only accessed with relaxed atomics */
+    struct metrics_thread_struct *next;
+} metrics_thread_t;
+
+static const char *metric_names[METRIC_COUNTERS] = {
+    "scan_cycles_total",
+    "tiles_changed_total",
+    "fullscreen_scans_total",
+    "bytes_captured_total",
+    "drawables_queued_total",
+    "bytes_pushed_total",
+    "drawables_released_total",
+    "shm_cache_lookups_total",
+    "shm_cache_hits_total",
+    "input_events_total",
+    "input_batches_total",
+    "input_motions_coalesced_total",
+    "input_latency_us_total",
+};
+
+static void metrics_thread_exit(gpointer data);
+
+static GPrivate thread_counts = G_PRIVATE_INIT(metrics_thread_exit);
+
+static GMutex registry_lock;
+static metrics_thread_t *registry;
+static guint64 retired[METRIC_COUNTERS];
+
+static void metrics_thread_exit(gpointer data)
+{
+    metrics_thread_t *t = (metrics_thread_t *) data;
+    metrics_thread_t **p;
+    int i;
+
+    g_mutex_lock(&registry_lock);
+    for (p = &registry; *p; p = &(*p)->next)
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    for (i = 0; i < METRIC_COUNTERS; i++)
+        retired[i] += __atomic_load_n(&t->counts[i], __ATOMIC_RELAXED);
+    g_mutex_unlock(&registry_lock);
+
+    g_free(t);
+}
+
+static metrics_thread_t *metrics_thread(void)
+{
+    metrics_thread_t *t = g_private_get(&thread_counts);
+
+    if (G_UNLIKELY(!t)) {
+        t = g_new0(metrics_thread_t, 1);
+        g_private_set(&thread_counts, t);
+
+        g_mutex_lock(&registry_lock);
+        t->next = registry;
+        registry = t;
+        g_mutex_unlock(&registry_lock);
+    }
+
+    return t;
+}
+
+/* Only the owning thread writes its block, so a relaxed load and store
+   is enough; it costs no more than a plain add, but a snapshot never sees
+   half a count on a 32 bit target.  It may see one a moment old, which is
+   fine for monitoring. */
+void metrics_add(metric_t m, guint64 n)
+{
+    metrics_thread_t *t = metrics_thread();
+    guint64 count = __atomic_load_n(&t->counts[m], __ATOMIC_RELAXED);
+
+    __atomic_store_n(&t->counts[m], count + n, __ATOMIC_RELAXED);
+}
+
+guint64 metrics_total(metric_t m)
+{
+    metrics_thread_t *t;
+    guint64 total;
+
+    g_mutex_lock(&registry_lock);
+    total = retired[m];
+    for (t = registry; t; t = t->next)
+        total += __atomic_load_n(&t->counts[m], __ATOMIC_RELAXED);
+    g_mutex_unlock(&registry_lock);
+
+    return total;
+}
+
+void metrics_snapshot(GString *out, metrics_gauge_func_t gauges, void *data)
+{
+    int i;
+
+    for (i = 0; i < METRIC_COUNTERS; i++)
+        g_string_append_printf(out, "%s %" G_GUINT64_FORMAT "\n", metric_names[i],
+                               metrics_total(i));
+    if (gauges)
+        gauges(out, data);
+}
+
+static void serve_client(metrics_server_t *m, int fd)
+{
+    GString *out = g_string_new(NULL);
+    gsize sent = 0;
+    ssize_t rc;
+
+    metrics_snapshot(out, m->gauges, m->gauge_data);
+    while (sent < out->len) {
+        rc = send(fd, out->str + sent, out->len - sent, MSG_NOSIGNAL);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            break;
+        sent += rc;
+    }
+
+    g_string_free(out, TRUE);
+}
+
+static void *metrics_serve(void *opaque)
+{
+    metrics_server_t *m = (metrics_server_t *) opaque;
+    int fd;
+
+    /* metrics_server_stop shuts the socket down, which ends the accept */
+    while (1) {
+        fd = accept(m->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        serve_client(m, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/* Only remove what is a socket; a mistyped path must not cost the user a file */
+static void unlink_socket(const char *path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+}
+
+int metrics_server_start(metrics_server_t *m, const char *path,
+                         metrics_gauge_func_t gauges, void *data)
+{
+    struct sockaddr_un addr;
+    mode_t old_mask;
+    int rc;
+
+    memset(m, 0, sizeof(*m));
+    m->fd = -1;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        g_warning("Metrics socket path %s is too long", path);
+        return X11SPICE_ERR_BADARGS;
+    }
+
+    m->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m->fd < 0) {
+        g_warning("Could not create metrics socket: %s", strerror(errno));
+        return X11SPICE_ERR_NO_SOCKET;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* A socket left by an earlier run would make bind fail */
+    unlink_socket(path);
+
+    /* Only our own user may read the numbers */
+    old_mask = umask(0077);
+    rc = bind(m->fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(old_mask);
+    if (rc) {
+        g_warning("Could not bind metrics socket %s: %s", path, strerror(errno));
+        close(m->fd);
+        m->fd = -1;
+        return X11SPICE_ERR_BIND;
+    }
+
+    m->path = g_strdup(path);
+    if (listen(m->fd, 4)) {
+        g_warning("Could not listen for metrics on %s: %s", path, strerror(errno));
+        metrics_server_stop(m);
+        return X11SPICE_ERR_LISTEN;
+    }
+
+    m->gauges = gauges;
+    m->gauge_data = data;
+
+    rc = pthread_create(&m->thread, NULL, metrics_serve, m);
+    if (rc) {
+        metrics_server_stop(m);
+        return rc;
+    }
+    m->started = TRUE;
+
+    g_message("Serving metrics on %s", path);
+    return 0;
+}
+
+void metrics_server_stop(metrics_server_t *m)
+{
+    /* Never got as far as binding; nothing to undo */
+    if (!m->path)
+        return;
+
+    shutdown(m->fd, SHUT_RDWR);
+
+    if (m->started)
+        pthread_join(m->thread, NULL);
+    m->started = FALSE;
+
+    close(m->fd);
+    m->fd = -1;
+
+    unlink_socket(m->path);
+    g_free(m->path);
+    m->path = NULL;
+}
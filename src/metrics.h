@@ -0,0 +1,75 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <pthread.h>
+#include <glib.h>
+
+/*----------------------------------------------------------------------------
+**  Definitions and simple types
+**--------------------------------------------------------------------------*/
+
+/* Counters only ever go up; each thread keeps its own copy */
+typedef enum {
+    METRIC_SCAN_CYCLES,
+    METRIC_TILES_CHANGED,
+    METRIC_FULLSCREEN_SCANS,
+    METRIC_BYTES_CAPTURED,
+    METRIC_DRAWABLES_QUEUED,
+    METRIC_BYTES_PUSHED,
+    METRIC_DRAWABLES_RELEASED,
+    METRIC_SHM_CACHE_LOOKUPS,
+    METRIC_SHM_CACHE_HITS,
+    METRIC_INPUT_EVENTS,
+    METRIC_INPUT_BATCHES,
+    METRIC_INPUT_COALESCED,
+    METRIC_INPUT_LATENCY_US,
+    METRIC_COUNTERS
+} metric_t;
+
+/* Called for each snapshot to append values that are read, not counted */
+typedef void (*metrics_gauge_func_t)(GString *out, void *data);
+
+/*----------------------------------------------------------------------------
+**  Structure definitions
+**--------------------------------------------------------------------------*/
+typedef struct {
+    char *path;
+    int fd;
+    pthread_t thread;
+    int started;
+    metrics_gauge_func_t gauges;
+    void *gauge_data;
+} metrics_server_t;
+
+/*----------------------------------------------------------------------------
+**  Prototypes
+**--------------------------------------------------------------------------*/
+void metrics_add(metric_t m, guint64 n);
+guint64 metrics_total(metric_t m);
+void metrics_snapshot(GString *out, metrics_gauge_func_t gauges, void *data);
+
+int metrics_server_start(metrics_server_t *m, const char *path,
+                         metrics_gauge_func_t gauges, void *data);
+void metrics_server_stop(metrics_server_t *m);
+
+#endif
@@ -81,6 +81,9 @@ void options_free(options_t *options)
     str_replace(&options->on_disconnect, NULL);
     str_replace(&options->user_config_file, NULL);
     str_replace(&options->codecs, NULL);
+    str_replace(&options->metrics_socket, NULL);
+    str_replace(&options->trace_file, NULL);
+    str_replace(&options->record_file, NULL);
 }
 
 
@@ -349,6 +352,8 @@ static void options_from_config(options_t *options)
     GKeyFile *userkey = g_key_file_new();
     GKeyFile *systemkey = NULL;
     char *trust_damage = NULL;
+    char *streaming_video = NULL;
+    char *core_backend = NULL;
     int config_file_given = options->user_config_file ? TRUE : FALSE;
 
     if (!config_file_given) {
@@ -397,8 +402,36 @@ static void options_from_config(options_t *options)
     g_free(trust_damage);
 
     options->full_screen_fps = int_option(userkey, systemkey, "spice", "full-screen-fps");
+
+    options->latency_report = int_option(userkey, systemkey, "spice", "latency-report");
+    string_option(&options->metrics_socket, userkey, systemkey, "spice", "metrics-socket");
+    options->cpu_budget = int_option(userkey, systemkey, "spice", "cpu-budget");
+    options->cursor_fps = int_option(userkey, systemkey, "spice", "cursor-fps");
+    if (options->cursor_fps == 0)
+        options->cursor_fps = DEFAULT_CURSOR_FPS;
+
+    string_option(&streaming_video, userkey, systemkey, "spice", "streaming-video");
+    options->streaming_video = STREAMING_DEFAULT;
+    if (g_strcmp0(streaming_video, "off") == 0)
+        options->streaming_video = STREAMING_OFF;
+    if (g_strcmp0(streaming_video, "all") == 0)
+        options->streaming_video = STREAMING_ALL;
+    if (g_strcmp0(streaming_video, "filter") == 0)
+        options->streaming_video = STREAMING_FILTER;
+    if (g_strcmp0(streaming_video, "detect") == 0)
+        options->streaming_video = STREAMING_DETECT;
+    g_free(streaming_video);
+
+    string_option(&core_backend, userkey, systemkey, "spice", "core-backend");
+    options->core_backend = CORE_GLIB;
+    if (g_strcmp0(core_backend, "epoll") == 0)
+        options->core_backend = CORE_EPOLL;
+    g_free(core_backend);
+
     string_option(&options->codecs, userkey, systemkey, "spice", "codecs");
     options->debug_draws = int_option(userkey, systemkey, "spice", "debug-draws");
+    string_option(&options->trace_file, userkey, systemkey, "spice", "trace-file");
+    string_option(&options->record_file, userkey, systemkey, "spice", "record-file");
 
 #if defined(HAVE_LIBAUDIT_H)
     /* Pick an arbitrary default in the user range.  CodeWeavers was founed in 1996, so 1196 it is... */
@@ -25,6 +25,7 @@
 **  constants
 **--------------------------------------------------------------------------*/
 #define DEFAULT_PASSWORD_LENGTH     8
+#define DEFAULT_CURSOR_FPS          30
 
 /*----------------------------------------------------------------------------
 **  Structure definitions
@@ -41,6 +42,12 @@ typedef struct {
 
 typedef enum { AUTO_TRUST, ALWAYS_TRUST, NEVER_TRUST } damage_trust_t;
 
+typedef enum { STREAMING_DEFAULT, STREAMING_OFF, STREAMING_ALL, STREAMING_FILTER,
+    STREAMING_DETECT
+} streaming_video_t;
+
+typedef enum { CORE_GLIB, CORE_EPOLL } core_backend_t;
+
 typedef struct {
     /* Both config and command line arguments */
     long timeout;
@@ -67,7 +74,15 @@ typedef struct {
     int audit_message_type;
     damage_trust_t trust_damage;
     int full_screen_fps;
+    int cursor_fps;
+    int latency_report;
+    char *metrics_socket;
+    int cpu_budget;
+    streaming_video_t streaming_video;
+    core_backend_t core_backend;
     int debug_draws;
+    char *trace_file;
+    char *record_file;
 
     /* file names of config files */
     char *user_config_file;
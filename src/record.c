@@ -0,0 +1,270 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  record.c
+**      Recordings of what a session saw, so the scanner can be tuned and
+**  benchmarked offline.  We log the scan reports handed to the scanners,
+**  the cursor updates, and the screen content we capture.  A capture is
+**  compared against a shadow copy of the screen, and only the rows that
+**  changed are written, so the periodic scans cost nothing when the
+**  screen is still.  The file is a gzip stream of record_event_t headers,
+**  each followed by its data, in native byte order.
+**
+**  Recording serializes the capturing threads on one lock, and costs a
+**  compare and a compress per capture; it is not meant to be left on.
+**--------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <glib.h>
+
+#include "x11spice.h"
+#include "record.h"
+
+/* Fast compression; screen content compresses well even so */
+#define RECORD_GZ_MODE              "wb1"
+#define RECORD_MAGIC_LEN            32
+
+/* Checked without the lock, so sessions that are not recording never take it */
+static gint recording;
+
+static GMutex record_lock;
+static gzFile record_fp;
+static gint64 record_epoch;
+
+static uint32_t *shadow;
+static int shadow_w;
+static int shadow_h;
+
+/* Record lock must be held */
+static void write_event(record_type_t type, uint32_t detail, int x, int y, int w, int h,
+                        const void *data, uint32_t len)
+{
+    record_event_t e;
+
+    memset(&e, 0, sizeof(e));
+    e.type = type;
+    e.detail = detail;
+    e.time = g_get_monotonic_time() - record_epoch;
+    e.x = x;
+    e.y = y;
+    e.w = w;
+    e.h = h;
+    e.len = len;
+
+    gzwrite(record_fp, &e, sizeof(e));
+    if (len)
+        gzwrite(record_fp, data, len);
+}
+
+/* Record lock must be held */
+static void resize_shadow(int w, int h)
+{
+    g_free(shadow);
+    shadow = g_new0(uint32_t, (gsize) w * h);
+    shadow_w = w;
+    shadow_h = h;
+}
+
+int record_open(const char *path, int w, int h)
+{
+    char magic[RECORD_MAGIC_LEN] = RECORD_MAGIC;
+
+    g_mutex_lock(&record_lock);
+    record_fp = gzopen(path, RECORD_GZ_MODE);
+    if (!record_fp) {
+        g_mutex_unlock(&record_lock);
+        g_warning("Could not open recording %s", path);
+        return X11SPICE_ERR_OPEN;
+    }
+
+    gzwrite(record_fp, magic, sizeof(magic));
+    record_epoch = g_get_monotonic_time();
+    resize_shadow(w, h);
+    write_event(RECORD_SCREEN, 0, 0, 0, w, h, NULL, 0);
+    g_atomic_int_set(&recording, TRUE);
+    g_mutex_unlock(&record_lock);
+
+    g_message("Recording to %s", path);
+    return 0;
+}
+
+void record_close(void)
+{
+    g_mutex_lock(&record_lock);
+    g_atomic_int_set(&recording, FALSE);
+    if (record_fp)
+        gzclose(record_fp);
+    record_fp = NULL;
+    g_free(shadow);
+    shadow = NULL;
+    shadow_w = shadow_h = 0;
+    g_mutex_unlock(&record_lock);
+}
+
+void record_screen(int w, int h)
+{
+    if (!g_atomic_int_get(&recording))
+        return;
+
+    g_mutex_lock(&record_lock);
+    if (record_fp) {
+        resize_shadow(w, h);
+        write_event(RECORD_SCREEN, 0, 0, 0, w, h, NULL, 0);
+    }
+    g_mutex_unlock(&record_lock);
+}
+
+void record_scan(int type, int x, int y, int w, int h)
+{
+    if (!g_atomic_int_get(&recording))
+        return;
+
+    g_mutex_lock(&record_lock);
+    if (record_fp)
+        write_event(RECORD_SCAN, type, x, y, w, h, NULL, 0);
+    g_mutex_unlock(&record_lock);
+}
+
+/* Write the rows of a capture that differ from what we have recorded so far */
+void record_capture(const uint8_t *pixels, int bytes_per_line, int x, int y, int w, int h)
+{
+    int first = -1;
+    int last = -1;
+    int row;
+    size_t row_len;
+    uint8_t *data;
+
+    if (!g_atomic_int_get(&recording))
+        return;
+
+    g_mutex_lock(&record_lock);
+    if (!record_fp || x < 0 || y < 0 || x + w > shadow_w || y + h > shadow_h) {
+        g_mutex_unlock(&record_lock);
+        return;
+    }
+
+    row_len = w * sizeof(uint32_t);
+    for (row = 0; row < h; row++) {
+        uint32_t *old = shadow + (size_t) (y + row) * shadow_w + x;
+        const uint8_t *new = pixels + (size_t) row * bytes_per_line;
+
+        if (memcmp(old, new, row_len) == 0)
+            continue;
+        memcpy(old, new, row_len);
+        if (first < 0)
+            first = row;
+        last = row;
+    }
+
+    if (first >= 0) {
+        data = g_malloc(row_len * (last - first + 1));
+        for (row = first; row <= last; row++)
+            memcpy(data + row_len * (row - first),
+                   shadow + (size_t) (y + row) * shadow_w + x, row_len);
+        write_event(RECORD_PIXELS, 0, x, y + first, w, last - first + 1,
+                    data, row_len * (last - first + 1));
+        g_free(data);
+    }
+    g_mutex_unlock(&record_lock);
+}
+
+void record_cursor_image(int x, int y, int w, int h, int xhot, int yhot,
+                         int imglen, const uint8_t *imgdata)
+{
+    if (!g_atomic_int_get(&recording))
+        return;
+
+    g_mutex_lock(&record_lock);
+    if (record_fp)
+        write_event(RECORD_CURSOR_IMAGE, (xhot << 16) | (yhot & 0xffff), x, y, w, h,
+                    imgdata, imglen);
+    g_mutex_unlock(&record_lock);
+}
+
+void record_cursor_move(int x, int y)
+{
+    if (!g_atomic_int_get(&recording))
+        return;
+
+    g_mutex_lock(&record_lock);
+    if (record_fp)
+        write_event(RECORD_CURSOR_MOVE, 0, x, y, 0, 0, NULL, 0);
+    g_mutex_unlock(&record_lock);
+}
+
+int record_reader_open(record_reader_t *r, const char *path)
+{
+    char magic[RECORD_MAGIC_LEN];
+
+    memset(r, 0, sizeof(*r));
+    r->fp = gzopen(path, "rb");
+    if (!r->fp) {
+        g_warning("Could not open recording %s", path);
+        return X11SPICE_ERR_OPEN;
+    }
+
+    if (gzread(r->fp, magic, sizeof(magic)) != sizeof(magic) ||
+        strncmp(magic, RECORD_MAGIC, sizeof(magic)) != 0) {
+        g_warning("%s is not an x11spice recording", path);
+        record_reader_close(r);
+        return X11SPICE_ERR_PARSE;
+    }
+
+    return 0;
+}
+
+/* Read the next event into r->event, and its data into r->data.
+   Returns FALSE at the end of the recording. */
+int record_reader_next(record_reader_t *r)
+{
+    int rc;
+
+    rc = gzread(r->fp, &r->event, sizeof(r->event));
+    if (rc == 0)
+        return FALSE;
+    if (rc != sizeof(r->event)) {
+        g_warning("Recording is truncated");
+        return FALSE;
+    }
+
+    if (r->event.len > r->data_size) {
+        r->data = g_realloc(r->data, r->event.len);
+        r->data_size = r->event.len;
+    }
+    if (r->event.len && gzread(r->fp, r->data, r->event.len) != (int) r->event.len) {
+        g_warning("Recording is truncated");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void record_reader_close(record_reader_t *r)
+{
+    if (r->fp)
+        gzclose(r->fp);
+    r->fp = NULL;
+    g_free(r->data);
+    r->data = NULL;
+    r->data_size = 0;
+}
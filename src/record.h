@@ -0,0 +1,82 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RECORD_H_
+#define RECORD_H_
+
+#include <stdint.h>
+#include <glib.h>
+#include <zlib.h>
+
+/*----------------------------------------------------------------------------
+**  Definitions and simple types
+**--------------------------------------------------------------------------*/
+#define RECORD_MAGIC                "x11spice-recording-1"
+
+typedef enum {
+    RECORD_SCREEN,              /* w and h are the new screen size */
+    RECORD_SCAN,                /* detail is the scan_type_t */
+    RECORD_PIXELS,              /* Screen content of the area, 4 bytes a pixel */
+    RECORD_CURSOR_IMAGE,        /* detail packs the hot spot; data is the image */
+    RECORD_CURSOR_MOVE,         /* x and y only */
+} record_type_t;
+
+/*----------------------------------------------------------------------------
+**  Structure definitions
+**--------------------------------------------------------------------------*/
+
+/* Every event starts with this; 'len' bytes of data follow it */
+typedef struct {
+    uint32_t type;
+    uint32_t detail;
+    int64_t time;               /* Microseconds since recording started */
+    int32_t x;
+    int32_t y;
+    int32_t w;
+    int32_t h;
+    uint32_t len;
+    uint32_t pad;
+} record_event_t;
+
+typedef struct {
+    gzFile fp;
+    record_event_t event;
+    uint8_t *data;
+    uint32_t data_size;
+} record_reader_t;
+
+/*----------------------------------------------------------------------------
+**  Prototypes
+**--------------------------------------------------------------------------*/
+int record_open(const char *path, int w, int h);
+void record_close(void);
+
+void record_screen(int w, int h);
+void record_scan(int type, int x, int y, int w, int h);
+void record_capture(const uint8_t *pixels, int bytes_per_line, int x, int y, int w, int h);
+void record_cursor_image(int x, int y, int w, int h, int xhot, int yhot,
+                         int imglen, const uint8_t *imgdata);
+void record_cursor_move(int x, int y);
+
+int record_reader_open(record_reader_t *r, const char *path);
+int record_reader_next(record_reader_t *r);
+void record_reader_close(record_reader_t *r);
+
+#endif
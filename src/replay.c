@@ -0,0 +1,402 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  replay.c
+**      Feeds a recording made with the record-file option back through the
+**  scanner, with no X server and no spice server, and reports what it
+**  cost and what it produced.  The scanner is stepped on this thread, on
+**  the recording's clock, so a given recording and build always scan,
+**  diff and draw the same way.
+**
+**  The screen content captured after a scan report is what the capture
+**  for that report read when it was recorded, so it is applied to our
+**  screen before the scanner is given the report.  Periodic scans run
+**  between reports at the intervals the scanner asks for.
+**--------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "x11spice.h"
+#include "session.h"
+#include "scan.h"
+#include "record.h"
+
+/* Recording times start at 0, which the scanner takes to mean 'real clock' */
+#define REPLAY_EPOCH                G_USEC_PER_SEC
+
+typedef struct {
+    record_event_t event;
+    uint8_t *data;
+} replay_event_t;
+
+typedef struct {
+    uint32_t *pixels;
+    int w;
+    int h;
+} replay_screen_t;
+
+typedef struct {
+    guint64 scan_reports;
+    guint64 periodic_scans;
+    guint64 image_draws;
+    guint64 fill_draws;
+    guint64 image_bytes;
+    guint64 cursor_commands;
+    gint64 scanner_cpu_ns;
+} replay_stats_t;
+
+typedef struct {
+    session_t *session;
+    replay_stats_t *stats;
+    gint stop;
+} replay_drain_t;
+
+static int read_screen(void *data, shm_image_t *shmi, int x, int y)
+{
+    replay_screen_t *screen = (replay_screen_t *) data;
+    unsigned int row;
+
+    if (x < 0 || y < 0 || x + shmi->w > screen->w || y + shmi->h > screen->h)
+        return -1;
+
+    for (row = 0; row < shmi->h; row++)
+        memcpy((uint8_t *) shmi->segment.shmaddr + row * shmi->bytes_per_line,
+               screen->pixels + (size_t) (y + row) * screen->w + x, shmi->w * sizeof(uint32_t));
+
+    return 0;
+}
+
+static void resize_screen(replay_screen_t *screen, int w, int h)
+{
+    g_free(screen->pixels);
+    screen->pixels = g_new0(uint32_t, (gsize) w * h);
+    screen->w = w;
+    screen->h = h;
+}
+
+static void apply_pixels(replay_screen_t *screen, replay_event_t *e)
+{
+    int row;
+
+    if (e->event.x < 0 || e->event.y < 0 ||
+        e->event.x + e->event.w > screen->w || e->event.y + e->event.h > screen->h ||
+        e->event.len != (uint32_t) e->event.w * e->event.h * sizeof(uint32_t))
+        return;
+
+    for (row = 0; row < e->event.h; row++)
+        memcpy(screen->pixels + (size_t) (e->event.y + row) * screen->w + e->event.x,
+               e->data + (size_t) row * e->event.w * sizeof(uint32_t),
+               e->event.w * sizeof(uint32_t));
+}
+
+/* Stands in for the spice worker, taking draw commands as they are queued */
+static void *drain_draws(void *opaque)
+{
+    replay_drain_t *drain = (replay_drain_t *) opaque;
+    QXLDrawable *drawable;
+
+    while (TRUE) {
+        drawable = session_pop_draw(drain->session);
+        if (!drawable) {
+            if (g_atomic_int_get(&drain->stop) && session_draw_waiting(drain->session) == 0)
+                break;
+            g_usleep(100);
+            continue;
+        }
+
+        if (drawable->type == QXL_DRAW_FILL)
+            drain->stats->fill_draws++;
+        else {
+            drain->stats->image_draws++;
+            drain->stats->image_bytes += (guint64) (drawable->bbox.right - drawable->bbox.left) *
+                (drawable->bbox.bottom - drawable->bbox.top) * sizeof(uint32_t);
+        }
+
+        session_command_released(drain->session, TRUE);
+        spice_free_release((spice_release_t *) (uintptr_t) drawable->release_info.id);
+    }
+
+    return NULL;
+}
+
+static void drain_cursors(session_t *session, replay_stats_t *stats)
+{
+    QXLCursorCmd *cursor;
+
+    while ((cursor = session_pop_cursor(session))) {
+        stats->cursor_commands++;
+        session_command_released(session, FALSE);
+        spice_free_release((spice_release_t *) (uintptr_t) cursor->release_info.id);
+    }
+}
+
+static gint64 thread_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (gint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void step(scanner_t *scanner, scan_report_t *r, int video_due, replay_stats_t *stats)
+{
+    gint64 start = thread_cpu_ns();
+
+    scanner_step(scanner, r, video_due);
+    stats->scanner_cpu_ns += thread_cpu_ns() - start;
+}
+
+static GPtrArray *load_recording(const char *path)
+{
+    record_reader_t reader;
+    GPtrArray *events;
+    replay_event_t *e;
+
+    if (record_reader_open(&reader, path))
+        return NULL;
+
+    events = g_ptr_array_new();
+    while (record_reader_next(&reader)) {
+        e = g_new0(replay_event_t, 1);
+        e->event = reader.event;
+        if (reader.event.len)
+            e->data = g_memdup(reader.data, reader.event.len);
+        g_ptr_array_add(events, e);
+    }
+    record_reader_close(&reader);
+
+    if (events->len == 0 || ((replay_event_t *) events->pdata[0])->event.type != RECORD_SCREEN) {
+        fprintf(stderr, "Error: %s does not start with a screen size\n", path);
+        g_ptr_array_free(events, TRUE);
+        return NULL;
+    }
+
+    return events;
+}
+
+static void free_recording(GPtrArray *events)
+{
+    guint i;
+
+    for (i = 0; i < events->len; i++) {
+        replay_event_t *e = (replay_event_t *) events->pdata[i];
+        g_free(e->data);
+        g_free(e);
+    }
+    g_ptr_array_free(events, TRUE);
+}
+
+static int start_scanner(session_t *session)
+{
+    scanner_t *scanner = &session->scanners[0];
+
+    scanner->session = session;
+    scanner->draw_ring = &session->draw_rings[0];
+    session->num_scanners = 1;
+    return scanner_init(scanner, &session->display.heads[0]);
+}
+
+static int resize(session_t *session, replay_screen_t *screen, int w, int h)
+{
+    display_t *d = &session->display;
+
+    scanner_destroy(&session->scanners[0]);
+    session->num_scanners = 0;
+
+    resize_screen(screen, w, h);
+    d->width = d->heads[0].w = w;
+    d->height = d->heads[0].h = h;
+    if (display_resize_screen_images(d))
+        return X11SPICE_ERR_NOSHM;
+
+    return start_scanner(session);
+}
+
+static int replay(session_t *session, replay_screen_t *screen, GPtrArray *events,
+                  replay_stats_t *stats)
+{
+    scanner_t *scanner = &session->scanners[0];
+    gint64 next_tick;
+    gint64 now;
+    guint applied = 0;
+    guint i;
+    int video_due;
+    int rc;
+
+    now = REPLAY_EPOCH;
+    scanner->clock = now;
+    next_tick = now + scanner_next_timeout(scanner, &video_due);
+
+    for (i = 1; i < events->len; i++) {
+        replay_event_t *e = (replay_event_t *) events->pdata[i];
+        scan_report_t *r;
+
+        /* The passes the scanner would have made on its own by now */
+        while (next_tick <= REPLAY_EPOCH + e->event.time) {
+            scanner->clock = next_tick;
+            step(scanner, NULL, video_due, stats);
+            if (!video_due)
+                stats->periodic_scans++;
+            next_tick += scanner_next_timeout(scanner, &video_due);
+        }
+        now = REPLAY_EPOCH + e->event.time;
+        scanner->clock = now;
+
+        switch (e->event.type) {
+        case RECORD_SCREEN:
+            if (e->event.w != screen->w || e->event.h != screen->h) {
+                rc = resize(session, screen, e->event.w, e->event.h);
+                if (rc)
+                    return rc;
+                scanner->clock = now;
+            }
+            break;
+
+        case RECORD_PIXELS:
+            if (i >= applied)
+                apply_pixels(screen, e);
+            break;
+
+        case RECORD_SCAN:
+            /* Captures made after this report are what it would read */
+            for (applied = MAX(applied, i + 1); applied < events->len; applied++) {
+                replay_event_t *next = (replay_event_t *) events->pdata[applied];
+                if (next->event.type == RECORD_SCAN || next->event.type == RECORD_SCREEN)
+                    break;
+                if (next->event.type == RECORD_PIXELS)
+                    apply_pixels(screen, next);
+            }
+
+            session_push_scan(session, e->event.detail, e->event.x, e->event.y,
+                              e->event.w, e->event.h);
+            while ((r = g_async_queue_try_pop(scanner->queue))) {
+                stats->scan_reports++;
+                step(scanner, r, 0, stats);
+            }
+            break;
+
+        case RECORD_CURSOR_IMAGE:
+            session_push_cursor_image(session, e->event.x, e->event.y, e->event.w, e->event.h,
+                                      e->event.detail >> 16, e->event.detail & 0xffff,
+                                      0, e->event.len, e->data);
+            drain_cursors(session, stats);
+            break;
+
+        case RECORD_CURSOR_MOVE:
+            session_push_cursor_move(session, e->event.x, e->event.y);
+            drain_cursors(session, stats);
+            break;
+        }
+
+        /* As in the scanner thread, a report restarts the wait */
+        if (e->event.type == RECORD_SCAN)
+            next_tick = now + scanner_next_timeout(scanner, &video_due);
+    }
+
+    return 0;
+}
+
+static void report(const char *path, GPtrArray *events, replay_stats_t *stats, gint64 wall_us)
+{
+    replay_event_t *last = (replay_event_t *) events->pdata[events->len - 1];
+
+    printf("recording        %s\n", path);
+    printf("events           %u over %.3f s\n", events->len,
+           (double) last->event.time / G_USEC_PER_SEC);
+    printf("scan reports     %" G_GUINT64_FORMAT "\n", stats->scan_reports);
+    printf("periodic scans   %" G_GUINT64_FORMAT "\n", stats->periodic_scans);
+    printf("image draws      %" G_GUINT64_FORMAT "\n", stats->image_draws);
+    printf("fill draws       %" G_GUINT64_FORMAT "\n", stats->fill_draws);
+    printf("image bytes      %" G_GUINT64_FORMAT "\n", stats->image_bytes);
+    printf("captured bytes   %" G_GUINT64_FORMAT "\n", metrics_total(METRIC_BYTES_CAPTURED));
+    printf("cursor commands  %" G_GUINT64_FORMAT "\n", stats->cursor_commands);
+    printf("scanner cpu      %.3f ms\n", stats->scanner_cpu_ns / 1000000.0);
+    printf("wall time        %.3f ms\n", wall_us / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    session_t session = { };
+    replay_screen_t screen = { };
+    display_source_t source = {.read_image = read_screen,.data = &screen };
+    replay_stats_t stats = { };
+    replay_drain_t drain = {.session = &session,.stats = &stats };
+    pthread_t drain_thread;
+    GPtrArray *events;
+    replay_event_t *first;
+    gint64 wall;
+    int rc;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s recording\n", argv[0]);
+        return X11SPICE_ERR_BADARGS;
+    }
+
+    events = load_recording(argv[1]);
+    if (!events)
+        return X11SPICE_ERR_PARSE;
+    first = (replay_event_t *) events->pdata[0];
+
+    options_init(&session.options);
+    rc = session_create(&session);
+    if (rc)
+        return rc;
+
+    resize_screen(&screen, first->event.w, first->event.h);
+    rc = display_open_source(&session.display, &session, &source, screen.w, screen.h);
+    if (rc)
+        return rc;
+
+    session.spice.session = &session;
+    session.running = TRUE;
+    rc = start_scanner(&session);
+    if (rc)
+        return rc;
+
+    rc = pthread_create(&drain_thread, NULL, drain_draws, &drain);
+    if (rc)
+        return rc;
+
+    wall = g_get_monotonic_time();
+    rc = replay(&session, &screen, events, &stats);
+
+    g_atomic_int_set(&drain.stop, TRUE);
+    pthread_join(drain_thread, NULL);
+    wall = g_get_monotonic_time() - wall;
+
+    if (rc == 0)
+        report(argv[1], events, &stats, wall);
+
+    scanner_destroy(&session.scanners[0]);
+    session.running = FALSE;
+    session_destroy(&session);
+    display_close(&session.display);
+    options_free(&session.options);
+    free_recording(events);
+    g_free(screen.pixels);
+
+    return rc;
+}
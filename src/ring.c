@@ -0,0 +1,146 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  ring.c
+**      A bounded single producer, single consumer ring of pointers.  We
+**  use one per scanner to hand draw commands to the spice worker.  The
+**  producer owns head and the consumer owns tail; each only reads the
+**  other's index, so no lock is needed.  When the ring is full, the
+**  producer flags that it is waiting and sleeps on an eventfd, which the
+**  consumer signals once it has taken an item.
+**--------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <glib.h>
+
+#include "x11spice.h"
+#include "ring.h"
+
+int ring_create(ring_t *r, guint size)
+{
+    memset(r, 0, sizeof(*r));
+    r->space_fd = -1;
+
+    if (size == 0 || (size & (size - 1)))
+        return X11SPICE_ERR_BADARGS;
+
+    r->items = calloc(size, sizeof(*r->items));
+    if (!r->items)
+        return X11SPICE_ERR_MALLOC;
+
+    r->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->space_fd == -1) {
+        free(r->items);
+        r->items = NULL;
+        return X11SPICE_ERR_MALLOC;
+    }
+
+    r->size = size;
+    return 0;
+}
+
+/* Only safe once both producer and consumer are gone */
+void ring_destroy(ring_t *r, GDestroyNotify free_item)
+{
+    void *item;
+
+    if (!r->items)
+        return;
+
+    while ((item = ring_pop(r)))
+        if (free_item)
+            free_item(item);
+
+    close(r->space_fd);
+    free(r->items);
+    r->items = NULL;
+    r->space_fd = -1;
+}
+
+guint ring_length(ring_t *r)
+{
+    return (guint) g_atomic_int_get(&r->head) - (guint) g_atomic_int_get(&r->tail);
+}
+
+static void ring_wait_for_space(ring_t *r, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = r->space_fd, .events = POLLIN };
+    uint64_t count;
+
+    if (poll(&pfd, 1, timeout_ms) > 0)
+        if (read(r->space_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            g_warning("Cannot read ring eventfd; errno %d", errno);
+}
+
+/* Called only from the producer thread.  Returns non zero if the
+   ring stayed full for timeout_ms; the caller still owns the item. */
+int ring_push(ring_t *r, void *item, int timeout_ms)
+{
+    guint head = (guint) r->head;
+
+    while (head - (guint) g_atomic_int_get(&r->tail) >= r->size) {
+        /* Flag that we are waiting before the last look; the consumer
+           moves tail before it looks at the flag */
+        g_atomic_int_set(&r->producer_waiting, TRUE);
+        if (head - (guint) g_atomic_int_get(&r->tail) < r->size)
+            break;
+
+        ring_wait_for_space(r, timeout_ms);
+        if (head - (guint) g_atomic_int_get(&r->tail) >= r->size) {
+            g_atomic_int_set(&r->producer_waiting, FALSE);
+            return X11SPICE_ERR_BUSY;
+        }
+    }
+    g_atomic_int_set(&r->producer_waiting, FALSE);
+
+    r->items[head & (r->size - 1)] = item;
+    /* The item must be visible before the new head is */
+    g_atomic_int_set(&r->head, (gint) (head + 1));
+
+    return 0;
+}
+
+/* Called only from the consumer thread */
+void *ring_pop(ring_t *r)
+{
+    guint tail = (guint) r->tail;
+    uint64_t one = 1;
+    void *item;
+
+    if (tail == (guint) g_atomic_int_get(&r->head))
+        return NULL;
+
+    item = r->items[tail & (r->size - 1)];
+    g_atomic_int_set(&r->tail, (gint) (tail + 1));
+
+    if (g_atomic_int_get(&r->producer_waiting)) {
+        g_atomic_int_set(&r->producer_waiting, FALSE);
+        if (write(r->space_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            g_warning("Cannot write ring eventfd; errno %d", errno);
+    }
+
+    return item;
+}
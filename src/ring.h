@@ -0,0 +1,61 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RING_H_
+#define RING_H_
+
+#include <glib.h>
+
+/*----------------------------------------------------------------------------
+**  Structure definitions
+**--------------------------------------------------------------------------*/
+
+/* A bounded ring of pointers for exactly one producer thread and one
+   consumer thread.  Neither side takes a lock; a full ring puts the
+   producer to sleep on an eventfd until the consumer makes room. */
+#define RING_CACHE_LINE             64
+
+typedef struct {
+    guint size;                 /* A power of 2 */
+    void **items;
+    int space_fd;
+
+    /* Written by the producer */
+    gint head;
+    char pad1[RING_CACHE_LINE - sizeof(gint)];
+
+    /* Written by the consumer */
+    gint tail;
+    char pad2[RING_CACHE_LINE - sizeof(gint)];
+
+    gint producer_waiting;
+} ring_t;
+
+/*----------------------------------------------------------------------------
+**  Prototypes
+**--------------------------------------------------------------------------*/
+int ring_create(ring_t *r, guint size);
+void ring_destroy(ring_t *r, GDestroyNotify free_item);
+
+int ring_push(ring_t *r, void *item, int timeout_ms);
+void *ring_pop(ring_t *r);
+guint ring_length(ring_t *r);
+
+#endif
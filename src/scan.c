@@ -28,6 +28,7 @@
 **--------------------------------------------------------------------------*/
 
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <glib.h>
 #include <pixman.h>
@@ -35,15 +36,13 @@
 #include "x11spice.h"
 #include "session.h"
 #include "scan.h"
+#include "trace.h"
 
 /*----------------------------------------------------------------------------
-**  We will scan over the screen by breaking it into a grid of tiles, each
-**   NUM_SCANLINES x NUM_HORIZONTAL_TILES.  We try to scan in a fashion designed
-**   to catch changes with a fairly modest set of scans; this scan pattern is
-**   taken from the x11vnc project.
+**  We try to scan in a fashion designed to catch changes with a fairly
+**   modest set of scans; this scan pattern is taken from the x11vnc project.
+**   The tile grid itself is defined in scan.h.
 **--------------------------------------------------------------------------*/
-#define NUM_SCANLINES               32
-#define NUM_HORIZONTAL_TILES        NUM_SCANLINES
 #define MAX_SCAN_FPS                30
 #define MIN_SCAN_FPS                 1
 
@@ -51,6 +50,18 @@
    copy the whole row */
 #define SCAN_ROW_THRESHOLD          (NUM_HORIZONTAL_TILES / 2)
 
+/* An area must change at video rates for this long before we treat it as
+   video, and is dropped once it has been quiet for VIDEO_IDLE_USEC */
+#define VIDEO_SUSTAIN_USEC          G_USEC_PER_SEC
+#define VIDEO_IDLE_USEC             (2 * G_USEC_PER_SEC)
+#define VIDEO_FRAME_USEC            (G_USEC_PER_SEC / MAX_SCAN_FPS)
+
+/* A video region may not grow past this share of its head */
+#define VIDEO_MAX_AREA_PERCENT      75
+
+/* While no client is connected, we only look for a report this often */
+#define IDLE_WAIT_USEC              G_USEC_PER_SEC
+
 static int scanlines[NUM_SCANLINES] = {
     0, 16, 8, 24, 4, 20, 12, 28,
     10, 26, 18, 2, 22, 6, 30, 14,
@@ -59,13 +70,63 @@ static int scanlines[NUM_SCANLINES] = {
 };
 
 
-static QXLDrawable *shm_image_to_drawable(spice_t *s, shm_image_t *shmi, int x, int y)
+/* Captures are checked for solid color in tiles of this many pixels square */
+#define SOLID_TILE_SIZE             32
+
+/* Past this many pieces, splitting a capture costs spice more than it saves */
+#define SOLID_MAX_PIECES            64
+
+/* Only images up to this size get a content hash for client side caching */
+#define CACHE_MAX_PIXELS            (256 * 256)
+
+static uint64_t hash_image_rows(shm_image_t *shmi, int top, int h)
+{
+    /* 64 bit FNV-1a, salted with the dimensions */
+    uint64_t hash = 14695981039346656037ULL;
+    uint32_t *p = ((uint32_t *) shmi->segment.shmaddr) + top * shmi->w;
+    uint32_t *end = p + h * shmi->w;
+
+    hash = (hash ^ shmi->w) * 1099511628211ULL;
+    hash = (hash ^ h) * 1099511628211ULL;
+    for (; p < end; p++)
+        hash = (hash ^ (*p & 0xffffff)) * 1099511628211ULL;
+
+    return hash;
+}
+
+/* Use the content type to steer how spice encodes this image.  Interface
+   content keeps the alpha format spice compresses losslessly with LZ/GLZ,
+   and is offered for caching, since toolbars, icons and the like repeat
+   often.  Photographic and video content is marked as plain 32 bit, which
+   makes it eligible for the lossy encoders; whether they are used at all
+   is still up to the server's image compression setting. */
+static void apply_content_hints(QXLImage *qxl_image, shm_image_t *shmi,
+                                int top, int h, content_type_t type)
+{
+    switch (type) {
+    case CONTENT_UI:
+        if (shmi->w * h <= CACHE_MAX_PIXELS) {
+            qxl_image->descriptor.id = hash_image_rows(shmi, top, h);
+            qxl_image->descriptor.flags |= QXL_IMAGE_CACHE;
+        }
+        break;
+
+    case CONTENT_PHOTO:
+    case CONTENT_VIDEO:
+        qxl_image->bitmap.format = SPICE_BITMAP_FMT_32BIT;
+        break;
+    }
+}
+
+/* Convert rows 'top' through 'top + h' of an shm image into a drawable */
+static QXLDrawable *shm_image_to_drawable(spice_t *s, shm_image_t *shmi, int x, int y,
+                                          int top, int h, content_type_t type)
 {
     QXLDrawable *drawable;
     QXLImage *qxl_image;
     int i;
 
-    drawable = calloc(1, sizeof(*drawable) + sizeof(*qxl_image));
+    drawable = slab_alloc(s->session->drawable_slab);
     if (!drawable)
         return NULL;
     qxl_image = (QXLImage *) (drawable + 1);
@@ -78,9 +139,9 @@ static QXLDrawable *shm_image_to_drawable(spice_t *s, shm_image_t *shmi, int x,
     drawable->effect = QXL_EFFECT_OPAQUE;
     drawable->clip.type = SPICE_CLIP_TYPE_NONE;
     drawable->bbox.left = x;
-    drawable->bbox.top = y;
+    drawable->bbox.top = y + top;
     drawable->bbox.right = x + shmi->w;
-    drawable->bbox.bottom = y + shmi->h;
+    drawable->bbox.bottom = y + top + h;
 
     for (i = 0; i < 3; ++i)
         drawable->surfaces_dest[i] = -1;
@@ -88,7 +149,7 @@ static QXLDrawable *shm_image_to_drawable(spice_t *s, shm_image_t *shmi, int x,
     drawable->u.copy.src_area.left = 0;
     drawable->u.copy.src_area.top = 0;
     drawable->u.copy.src_area.right = shmi->w;
-    drawable->u.copy.src_area.bottom = shmi->h;
+    drawable->u.copy.src_area.bottom = h;
     drawable->u.copy.rop_descriptor = SPICE_ROPD_OP_PUT;
 
     drawable->u.copy.src_bitmap = (uintptr_t) qxl_image;
@@ -98,25 +159,248 @@ static QXLDrawable *shm_image_to_drawable(spice_t *s, shm_image_t *shmi, int x,
 
     qxl_image->descriptor.flags = 0;
     qxl_image->descriptor.width = shmi->w;
-    qxl_image->descriptor.height = shmi->h;
+    qxl_image->descriptor.height = h;
 
     qxl_image->bitmap.format = SPICE_BITMAP_FMT_RGBA;
     qxl_image->bitmap.flags = SPICE_BITMAP_FLAGS_TOP_DOWN | QXL_BITMAP_DIRECT;
     qxl_image->bitmap.x = shmi->w;
-    qxl_image->bitmap.y = shmi->h;
+    qxl_image->bitmap.y = h;
     qxl_image->bitmap.stride = shmi->bytes_per_line;
     qxl_image->bitmap.palette = 0;
-    qxl_image->bitmap.data = (uintptr_t) shmi->segment.shmaddr;
+    qxl_image->bitmap.data =
+        (uintptr_t) shmi->segment.shmaddr + (uintptr_t) top * shmi->bytes_per_line;
+
+    apply_content_hints(qxl_image, shmi, top, h, type);
+
+    return drawable;
+}
+
+static QXLDrawable *solid_to_drawable(spice_t *s, int x, int y, int w, int h, uint32_t color)
+{
+    QXLDrawable *drawable;
+    int i;
+
+    drawable = slab_alloc(s->session->drawable_slab);
+    if (!drawable)
+        return NULL;
+
+    drawable->release_info.id = (uintptr_t) spice_create_release(s, RELEASE_DRAWABLE, drawable);
+
+    drawable->surface_id = 0;
+    drawable->type = QXL_DRAW_FILL;
+    drawable->effect = QXL_EFFECT_OPAQUE;
+    drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+    drawable->bbox.left = x;
+    drawable->bbox.top = y;
+    drawable->bbox.right = x + w;
+    drawable->bbox.bottom = y + h;
+
+    for (i = 0; i < 3; ++i)
+        drawable->surfaces_dest[i] = -1;
+
+    drawable->u.fill.brush.type = SPICE_BRUSH_TYPE_SOLID;
+    drawable->u.fill.brush.u.color = color;
+    drawable->u.fill.rop_descriptor = SPICE_ROPD_OP_PUT;
+    drawable->u.fill.mask.flags = 0;
+    drawable->u.fill.mask.pos.x = 0;
+    drawable->u.fill.mask.pos.y = 0;
+    drawable->u.fill.mask.bitmap = 0;
 
     return drawable;
 }
 
+/* The ring only blocks us if spice falls far behind; we keep waiting
+   for it unless the session is going away */
+#define DRAW_PUSH_TIMEOUT_MS        100
+
+/* A capture split into fills and a bitmap is timed only once, on the
+   drawable that completes it; 'last' marks that drawable */
+static void push_drawable(scanner_t *scanner, QXLDrawable *drawable, int last)
+{
+    session_t *session = scanner->session;
+    spice_release_t *release = (spice_release_t *) (uintptr_t) drawable->release_info.id;
+    gint64 start = trace_begin();
+
+    if (release && last) {
+        release->stamps = scanner->stamps;
+        release->stamps.at[LATENCY_DRAWABLE_QUEUED] = g_get_monotonic_time();
+    }
+
+    while (ring_push(scanner->draw_ring, drawable, DRAW_PUSH_TIMEOUT_MS)) {
+        if (!session_alive(session)) {
+            spice_free_release((spice_release_t *) (uintptr_t) drawable->release_info.id);
+            return;
+        }
+        session_wakeup_spice(session);
+    }
+    metrics_add(METRIC_DRAWABLES_QUEUED, 1);
+    if (drawable->type == QXL_DRAW_COPY)
+        metrics_add(METRIC_BYTES_PUSHED, (guint64) (drawable->bbox.right - drawable->bbox.left) *
+                    (drawable->bbox.bottom - drawable->bbox.top) * sizeof(uint32_t));
+    session_wakeup_spice(session);
+    trace_end(TRACE_PUSH_DRAWABLE, start, ring_length(scanner->draw_ring));
+}
+
+/* A rectangle of a capture, in capture coordinates, that is sent as
+   one drawable; either a fill of 'color' or a bitmap */
+typedef struct {
+    int x;
+    int y;
+    int w;
+    int h;
+    bool solid;
+    uint32_t color;
+} capture_piece_t;
+
+static bool same_piece_columns(capture_piece_t *a, capture_piece_t *b)
+{
+    return a->x == b->x && a->w == b->w && a->solid == b->solid &&
+        (!a->solid || a->color == b->color);
+}
+
+/* Large areas of one color (backgrounds, cleared windows, blank documents)
+   are common, and a fill is far cheaper for spice to handle than a bitmap.
+   We walk the capture a row of tiles at a time, turn each run of tiles of
+   one color into a fill and each run of other tiles into a bitmap, and
+   let a piece grow down while the row below has a run with the same
+   columns.  Returns the number of pieces, or 0 if the capture is best
+   sent whole, because it has no solid tile or would split too finely. */
+static int split_capture(shm_image_t *shmi, capture_piece_t *pieces)
+{
+    int cols = (shmi->w + SOLID_TILE_SIZE - 1) / SOLID_TILE_SIZE;
+    int *above = g_new(int, cols);
+    int *row = g_new(int, cols);
+    int *swap;
+    int num_above = 0;
+    int count = 0;
+    bool any_solid = false;
+    int y;
+
+    for (y = 0; y < shmi->h && count >= 0; y += SOLID_TILE_SIZE) {
+        int h = MIN(SOLID_TILE_SIZE, shmi->h - y);
+        int num_row = 0;
+        int a = 0;
+        int x = 0;
+        capture_piece_t run;
+
+        while (x < shmi->w) {
+            uint32_t color;
+            int w = MIN(SOLID_TILE_SIZE, shmi->w - x);
+
+            run.x = x;
+            run.y = y;
+            run.w = w;
+            run.h = h;
+            run.solid = display_area_is_solid(shmi, x, y, w, h, &run.color);
+            for (x += w; x < shmi->w; x += w) {
+                w = MIN(SOLID_TILE_SIZE, shmi->w - x);
+                if (display_area_is_solid(shmi, x, y, w, h, &color) != run.solid ||
+                    (run.solid && color != run.color))
+                    break;
+                run.w += w;
+            }
+            any_solid |= run.solid;
+
+            while (a < num_above && pieces[above[a]].x < run.x)
+                a++;
+            if (a < num_above && same_piece_columns(&pieces[above[a]], &run)) {
+                pieces[above[a]].h += h;
+                row[num_row++] = above[a];
+            } else if (count < SOLID_MAX_PIECES) {
+                pieces[count] = run;
+                row[num_row++] = count++;
+            } else {
+                count = -1;
+                break;
+            }
+        }
+
+        swap = above;
+        above = row;
+        row = swap;
+        num_above = num_row;
+    }
+
+    g_free(above);
+    g_free(row);
+
+    return any_solid ? MAX(count, 0) : 0;
+}
+
+/* Send each piece of a split capture as its own drawable.  The bitmap
+   pieces are copied into shm images of their own, since the capture
+   can only be handed to spice as one drawable. */
+static void push_capture_pieces(scanner_t *scanner, shm_image_t *shmi, scan_report_t *r,
+                                capture_piece_t *pieces, int count, int change_rate)
+{
+    session_t *session = scanner->session;
+    QXLDrawable *drawable;
+    shm_image_t *piece;
+    content_type_t type;
+    int i;
+    int j;
+
+    for (i = 0; i < count; i++) {
+        capture_piece_t *p = &pieces[i];
+
+        if (p->solid) {
+            drawable = solid_to_drawable(&session->spice, r->x + p->x, r->y + p->y,
+                                         p->w, p->h, p->color);
+            if (!drawable) {
+                g_debug("Unexpected failure to create fill drawable");
+                continue;
+            }
+            push_drawable(scanner, drawable, i == count - 1);
+            continue;
+        }
+
+        piece = create_shm_image(&session->display, p->w, p->h);
+        if (!piece) {
+            g_debug("Unexpected failure to create_shm_image of area %dx%d", p->w, p->h);
+            continue;
+        }
+        for (j = 0; j < p->h; j++)
+            memcpy((uint8_t *) piece->segment.shmaddr + j * piece->bytes_per_line,
+                   (uint8_t *) shmi->segment.shmaddr + (p->y + j) * shmi->bytes_per_line +
+                   p->x * sizeof(uint32_t), p->w * sizeof(uint32_t));
+
+        type = classify_image(piece, 0, p->h, change_rate);
+        if (session->options.debug_draws >= DEBUG_DRAWS_DETAIL) {
+            display_debug("classify: %dx%d @ %dx%d is %s; %d changes/sec\n",
+                          p->w, p->h, r->x + p->x, r->y + p->y,
+                          classify_name(type), change_rate);
+        }
+
+        drawable = shm_image_to_drawable(&session->spice, piece, r->x + p->x, r->y + p->y,
+                                         0, p->h, type);
+        if (!drawable) {
+            g_debug("Unexpected failure to create drawable");
+            destroy_shm_image(&session->display, piece);
+            continue;
+        }
+        push_drawable(scanner, drawable, i == count - 1);
+    }
+}
+
+/* The replay driver runs the scanner on the recording's clock */
+static gint64 scanner_now(scanner_t *scanner)
+{
+    return scanner->clock ? scanner->clock : g_get_monotonic_time();
+}
+
+/* The governor halves our scan rate at each level of throttling */
 static guint64 get_timeout(scanner_t *scanner)
 {
+    int level = governor_level(&scanner->session->governor);
+    int fps;
+
     if (scanner->session->options.full_screen_fps > 0) {
-        return G_USEC_PER_SEC / scanner->session->options.full_screen_fps;
+        fps = MAX(scanner->session->options.full_screen_fps >> level, 1);
+        return G_USEC_PER_SEC / fps;
     }
-    return G_USEC_PER_SEC / scanner->target_fps / NUM_SCANLINES;
+
+    fps = MIN(scanner->target_fps, MAX(MAX_SCAN_FPS >> level, MIN_SCAN_FPS));
+    return G_USEC_PER_SEC / fps / NUM_SCANLINES;
 }
 
 static void scan_update_fps(scanner_t *scanner, int increment)
@@ -129,9 +413,24 @@ static void scan_update_fps(scanner_t *scanner, int increment)
         scanner->target_fps = MIN_SCAN_FPS;
 }
 
-static void handle_scan_report(session_t *session, scan_report_t *r)
+static void handle_scan_report(scanner_t *scanner, scan_report_t *r, int change_rate)
 {
+    session_t *session = scanner->session;
     shm_image_t *shmi;
+    content_type_t type;
+    capture_piece_t pieces[SOLID_MAX_PIECES];
+    int count = 0;
+    gint64 start;
+
+    /* The wait is recorded as an instant, so it cannot overlap the
+       spans this thread recorded while the report sat in the queue */
+    if (r->queued)
+        trace_instant(TRACE_QUEUE_WAIT, (int) (g_get_monotonic_time() - r->queued));
+
+    memset(&scanner->stamps, 0, sizeof(scanner->stamps));
+    scanner->stamps.at[LATENCY_DAMAGE] = r->damaged;
+    scanner->stamps.at[LATENCY_QUEUED] = r->queued;
+    scanner->stamps.at[LATENCY_CAPTURE_START] = g_get_monotonic_time();
 
     shmi = create_shm_image(&session->display, r->w, r->h);
     if (!shmi) {
@@ -139,16 +438,40 @@ static void handle_scan_report(session_t *session, scan_report_t *r)
         return;
     }
 
-    if (read_shm_image(&session->display, shmi, r->x, r->y) == 0) {
+    start = trace_begin();
+    if (read_shm_image(&session->display, scanner->c, shmi, r->x, r->y) == 0) {
+        scanner->stamps.at[LATENCY_CAPTURE_DONE] = g_get_monotonic_time();
+        trace_end(TRACE_CAPTURE, start, r->w * r->h);
+        start = trace_begin();
         //save_ximage_pnm(shmi);
-        g_mutex_lock(session->lock);
         display_copy_image_into_fullscreen(&session->display, shmi, r->x, r->y);
-        g_mutex_unlock(session->lock);
 
-        QXLDrawable *drawable = shm_image_to_drawable(&session->spice, shmi, r->x, r->y);
+        /* Streaming wants a steady flow of identical frames;
+           splitting them up would defeat that. */
+        if (session->options.full_screen_fps <= 0 && r->type != VIDEO_SCAN_REPORT)
+            count = split_capture(shmi, pieces);
+
+        if (count > 0) {
+            push_capture_pieces(scanner, shmi, r, pieces, count, change_rate);
+            trace_end(TRACE_BUILD_DRAWABLE, start, count);
+            destroy_shm_image(&session->display, shmi);
+            return;
+        }
+
+        if (r->type == VIDEO_SCAN_REPORT)
+            type = CONTENT_VIDEO;
+        else
+            type = classify_image(shmi, 0, shmi->h, change_rate);
+        if (session->options.debug_draws >= DEBUG_DRAWS_DETAIL) {
+            display_debug("classify: %dx%d @ %dx%d is %s; %d changes/sec\n",
+                          r->w, r->h, r->x, r->y, classify_name(type), change_rate);
+        }
+
+        QXLDrawable *drawable = shm_image_to_drawable(&session->spice, shmi, r->x, r->y,
+                                                      0, shmi->h, type);
+        trace_end(TRACE_BUILD_DRAWABLE, start, type);
         if (drawable) {
-            g_async_queue_push(session->draw_queue, drawable);
-            spice_qxl_wakeup(&session->spice.display_sin);
+            push_drawable(scanner, drawable, TRUE);
             /* NOTE: the shmi is intentionally not freed at this point.
                The call path will take care of that once it's been
                pushed to Spice. */
@@ -163,48 +486,49 @@ static void handle_scan_report(session_t *session, scan_report_t *r)
 }
 
 
-static void free_queue_item(gpointer data)
+static void free_queue_item(scanner_t *scanner, scan_report_t *r)
 {
-    free(data);
+    slab_free(scanner->session->report_slab, r);
 }
 
-/* Note: session lock must be held by caller */
 static void push_tiles_report(scanner_t *scanner, int start_row, int start_col, int end_row,
                               int end_col)
 {
     /* Note: we do this as integer math, and so we multiply first to avoid discarding
        fractions in our calculations.  We also want to round down for our x, y, and
        round up for our width and height calculations, as doesn't hurt to send more */
-    int x = (start_col * scanner->session->display.fullscreen->w) / NUM_HORIZONTAL_TILES;
-    int w = ((end_col - start_col + 1) * scanner->session->display.fullscreen->w) /
-        NUM_HORIZONTAL_TILES;
-    if (((end_col - start_col + 1) * scanner->session->display.fullscreen->w) %
-        NUM_HORIZONTAL_TILES)
+    head_t *head = &scanner->head;
+    int x = (start_col * head->w) / NUM_HORIZONTAL_TILES;
+    int w = ((end_col - start_col + 1) * head->w) / NUM_HORIZONTAL_TILES;
+    if (((end_col - start_col + 1) * head->w) % NUM_HORIZONTAL_TILES)
         w++;
 
     int y = start_row * NUM_SCANLINES;
     int h = (end_row - start_row + 1) * NUM_SCANLINES;
 
-    if (x + w > scanner->session->display.fullscreen->w)
-        w = scanner->session->display.fullscreen->w - x;
+    if (x + w > head->w)
+        w = head->w - x;
 
-    if (y + h > scanner->session->display.fullscreen->h)
-        h = scanner->session->display.fullscreen->h - y;
+    if (y + h > head->h)
+        h = head->h - y;
 
-    scanner_push(scanner, SCANLINE_SCAN_REPORT, x, y, w, h);
+    scanner_push(scanner, SCANLINE_SCAN_REPORT, head->x + x, head->y + y, w, h);
 }
 
-static void grow_changed_tiles(scanner_t *scanner G_GNUC_UNUSED,
-                               int *tiles_changed_in_row,
-                               bool tiles_changed[][NUM_HORIZONTAL_TILES], int num_vertical_tiles)
+/* When throttled, we take whole rows sooner; fewer, larger captures
+   cost less than many small ones */
+void grow_changed_tiles(scanner_t *scanner,
+                        int *tiles_changed_in_row,
+                        bool tiles_changed[][NUM_HORIZONTAL_TILES], int num_vertical_tiles)
 {
+    int threshold = SCAN_ROW_THRESHOLD >> governor_level(&scanner->session->governor);
     int i;
     int j;
     for (i = 0; i < num_vertical_tiles; i++) {
         if (!tiles_changed_in_row[i] || tiles_changed_in_row[i] == NUM_HORIZONTAL_TILES)
             continue;
 
-        if (tiles_changed_in_row[i] > SCAN_ROW_THRESHOLD) {
+        if (tiles_changed_in_row[i] > threshold) {
             tiles_changed_in_row[i] = NUM_HORIZONTAL_TILES;
             continue;
         }
@@ -236,7 +560,7 @@ static void grow_changed_tiles(scanner_t *scanner G_GNUC_UNUSED,
 
         /* Recheck, in case our growth algorithm pushed this
            into the 'scan the whole row' category */
-        if (tiles_changed_in_row[i] > SCAN_ROW_THRESHOLD)
+        if (tiles_changed_in_row[i] > threshold)
             tiles_changed_in_row[i] = NUM_HORIZONTAL_TILES;
     }
 }
@@ -289,8 +613,8 @@ static void push_changes_in_one_row(scanner_t *scanner, int row, bool *tiles_cha
         push_tiles_report(scanner, row, start_tile, row, current_tile);
 }
 
-static void push_changed_tiles(scanner_t *scanner, int *tiles_changed_in_row,
-                               bool tiles_changed[][NUM_HORIZONTAL_TILES], int num_vertical_tiles)
+void push_changed_tiles(scanner_t *scanner, int *tiles_changed_in_row,
+                        bool tiles_changed[][NUM_HORIZONTAL_TILES], int num_vertical_tiles)
 {
     int i = 0;
 
@@ -321,10 +645,12 @@ static void scanner_periodic(scanner_t *scanner)
     int y;
     int offset;
     int rc;
+    int changed = 0;
+    gint64 start = trace_begin();
 
-    g_mutex_lock(scanner->session->lock);
-    num_vertical_tiles =
-        (scanner->session->display.fullscreen->h + NUM_SCANLINES - 1) / NUM_SCANLINES;
+    /* The mirror is locked band by band inside the display code; resizes
+       stop the scanners before they touch the head or the images */
+    num_vertical_tiles = (scanner->head.h + NUM_SCANLINES - 1) / NUM_SCANLINES;
 
     int tiles_changed_in_row[num_vertical_tiles];
     bool tiles_changed[num_vertical_tiles][NUM_HORIZONTAL_TILES];
@@ -337,51 +663,61 @@ static void scanner_periodic(scanner_t *scanner)
     }
 
     for (y = offset, i = 0; i < num_vertical_tiles; i++, y += NUM_SCANLINES) {
-        if (y >= scanner->session->display.fullscreen->h)
+        if (y >= scanner->head.h) {
+            memset(tiles_changed[i], 0, sizeof(tiles_changed[i]));
             rc = 0;
-        else
-            rc = display_find_changed_tiles(&scanner->session->display,
-                                            y, tiles_changed[i], NUM_HORIZONTAL_TILES);
-        if (rc < 0) {
-            g_mutex_unlock(scanner->session->lock);
+        } else
+            rc = display_find_changed_tiles(&scanner->session->display, scanner->c,
+                                            scanner->scanline, scanner->head.x,
+                                            scanner->head.y + y, tiles_changed[i],
+                                            NUM_HORIZONTAL_TILES);
+        if (rc < 0)
             return;
-        }
 
         tiles_changed_in_row[i] = rc;
+        changed += rc;
     }
+    metrics_add(METRIC_SCAN_CYCLES, 1);
+    metrics_add(METRIC_TILES_CHANGED, changed);
+
     grow_changed_tiles(scanner, tiles_changed_in_row, tiles_changed, num_vertical_tiles);
     push_changed_tiles(scanner, tiles_changed_in_row, tiles_changed, num_vertical_tiles);
+    trace_end(TRACE_SCAN_CYCLE, start, changed);
 
     if (scanner->session->options.debug_draws >= DEBUG_DRAWS_DETAIL) {
         display_debug("scanner_periodic done; scanline %d\n", scanner->current_scanline);
     }
-
-    g_mutex_unlock(scanner->session->lock);
 }
 
 static void scan_full_screen(scanner_t *scanner)
 {
     int num_vertical_tiles;
     int rc;
+    int i;
+    int changed = 0;
+    gint64 start = trace_begin();
 
-    g_mutex_lock(scanner->session->lock);
-    num_vertical_tiles =
-        (scanner->session->display.fullscreen->h + NUM_SCANLINES - 1) / NUM_SCANLINES;
+    scanner->full_scan_pending = FALSE;
+    scanner->last_full_scan = scanner_now(scanner);
+    num_vertical_tiles = (scanner->head.h + NUM_SCANLINES - 1) / NUM_SCANLINES;
 
     int tiles_changed_in_row[num_vertical_tiles];
     bool tiles_changed[num_vertical_tiles][NUM_HORIZONTAL_TILES];
 
-    rc = display_scan_whole_screen(&scanner->session->display,
+    rc = display_scan_whole_screen(&scanner->session->display, scanner->c, &scanner->head,
                                    num_vertical_tiles, NUM_HORIZONTAL_TILES,
                                    tiles_changed, tiles_changed_in_row);
-    if (rc < 0) {
-        g_mutex_unlock(scanner->session->lock);
+    if (rc < 0)
         return;
-    }
+
+    metrics_add(METRIC_FULLSCREEN_SCANS, 1);
+    for (i = 0; i < num_vertical_tiles; i++)
+        changed += tiles_changed_in_row[i];
+    metrics_add(METRIC_TILES_CHANGED, changed);
 
     grow_changed_tiles(scanner, tiles_changed_in_row, tiles_changed, num_vertical_tiles);
     push_changed_tiles(scanner, tiles_changed_in_row, tiles_changed, num_vertical_tiles);
-    g_mutex_unlock(scanner->session->lock);
+    trace_end(TRACE_FULLSCREEN_SCAN, start, changed);
 }
 
 #if ! GLIB_CHECK_VERSION(2, 31, 18)
@@ -394,79 +730,376 @@ static gpointer g_async_queue_timeout_pop(GAsyncQueue *queue, guint64 t)
 }
 #endif
 
+static int video_detect_enabled(scanner_t *scanner)
+{
+    return scanner->session->options.streaming_video == STREAMING_DETECT &&
+        scanner->session->options.full_screen_fps <= 0;
+}
+
+static int boxes_intersect(pixman_box16_t *a, pixman_box16_t *b)
+{
+    return a->x1 < b->x2 && b->x1 < a->x2 && a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+static void box_union(pixman_box16_t *a, pixman_box16_t *b)
+{
+    a->x1 = MIN(a->x1, b->x1);
+    a->y1 = MIN(a->y1, b->y1);
+    a->x2 = MAX(a->x2, b->x2);
+    a->y2 = MAX(a->y2, b->y2);
+}
+
+static int box_contains(pixman_box16_t *outer, pixman_box16_t *inner)
+{
+    return inner->x1 >= outer->x1 && inner->x2 <= outer->x2 &&
+        inner->y1 >= outer->y1 && inner->y2 <= outer->y2;
+}
+
+/* Returns TRUE if the union of a and b is small enough for a video region */
+static int video_union_fits(scanner_t *scanner, pixman_box16_t *a, pixman_box16_t *b)
+{
+    pixman_box16_t u = *a;
+
+    box_union(&u, b);
+    return (gint64) (u.x2 - u.x1) * (u.y2 - u.y1) * 100 <=
+        (gint64) scanner->head.w * scanner->head.h * VIDEO_MAX_AREA_PERCENT;
+}
+
+/* Fold any other regions that now overlap 'v' into it */
+static void scanner_merge_video(scanner_t *scanner, video_region_t *v)
+{
+    int i;
+
+    for (i = 0; i < MAX_VIDEO_REGIONS; i++) {
+        video_region_t *other = &scanner->video[i];
+        if (other == v || !other->active || !boxes_intersect(&v->box, &other->box) ||
+            !video_union_fits(scanner, &v->box, &other->box))
+            continue;
+
+        box_union(&v->box, &other->box);
+        v->dirty |= other->dirty;
+        v->last_change = MAX(v->last_change, other->last_change);
+        other->active = 0;
+    }
+}
+
+/* If the report touches a video region, we fold it into that region, to be
+   sent with the next frame, rather than sending it now.  A region only grows
+   for reports that are themselves changing at video rates, and only up to
+   VIDEO_MAX_AREA_PERCENT of the head; anything else is captured as usual.
+   An area that has been changing at video rates for a sustained period
+   starts a new region.  Returns 1 if the report was absorbed. */
+static int scanner_absorb_video(scanner_t *scanner, scan_report_t *r, int change_rate)
+{
+    pixman_box16_t box = { r->x, r->y, r->x + r->w, r->y + r->h };
+    video_region_t *v = NULL;
+    gint64 now = scanner_now(scanner);
+    int i;
+
+    if (!video_detect_enabled(scanner))
+        return 0;
+
+    for (i = 0; i < MAX_VIDEO_REGIONS && !v; i++)
+        if (scanner->video[i].active && boxes_intersect(&scanner->video[i].box, &box))
+            v = &scanner->video[i];
+
+    if (!v) {
+        if (change_rate < CLASSIFY_VIDEO_RATE)
+            return 0;
+
+        if (!classifier_sustained_video(&scanner->classifier, scanner->head.w, scanner->head.h,
+                                        r->x - scanner->head.x, r->y - scanner->head.y,
+                                        r->w, r->h, VIDEO_SUSTAIN_USEC, now))
+            return 0;
+
+        for (i = 0; i < MAX_VIDEO_REGIONS && !v; i++)
+            if (!scanner->video[i].active)
+                v = &scanner->video[i];
+        if (!v)
+            return 0;
+
+        v->active = 1;
+        v->box = box;
+        v->next_frame = now;
+        g_debug("video region started at %dx%d @ %dx%d", r->w, r->h, r->x, r->y);
+    } else if (!box_contains(&v->box, &box)) {
+        if (classifier_min_rate(&scanner->classifier, scanner->head.w, scanner->head.h,
+                                r->x - scanner->head.x, r->y - scanner->head.y,
+                                r->w, r->h, now) < CLASSIFY_VIDEO_RATE ||
+            !video_union_fits(scanner, &v->box, &box))
+            return 0;
+        box_union(&v->box, &box);
+    }
+
+    v->dirty = 1;
+    v->last_change = now;
+    scanner_merge_video(scanner, v);
+
+    return 1;
+}
+
+/* Returns the time, in microseconds, until the next video frame is due,
+   or -1 if there is no frame waiting to be sent */
+static gint64 scanner_video_wait(scanner_t *scanner)
+{
+    gint64 now = scanner_now(scanner);
+    gint64 wait = -1;
+    int i;
+
+    for (i = 0; i < MAX_VIDEO_REGIONS; i++) {
+        video_region_t *v = &scanner->video[i];
+        if (!v->active || !v->dirty)
+            continue;
+        if (wait == -1 || v->next_frame - now < wait)
+            wait = MAX(v->next_frame - now, 0);
+    }
+
+    return wait;
+}
+
+static void scanner_push_video_frames(scanner_t *scanner)
+{
+    gint64 now = scanner_now(scanner);
+    int i;
+
+    for (i = 0; i < MAX_VIDEO_REGIONS; i++) {
+        video_region_t *v = &scanner->video[i];
+        scan_report_t frame = {.type = VIDEO_SCAN_REPORT };
+
+        if (!v->active)
+            continue;
+
+        /* Regions that have gone quiet, or no longer fit on our
+           head, are dropped; normal scanning takes over again */
+        if (now - v->last_change > VIDEO_IDLE_USEC ||
+            v->box.x2 > scanner->head.x + (int) scanner->head.w ||
+            v->box.y2 > scanner->head.y + (int) scanner->head.h) {
+            g_debug("video region at %dx%d @ %dx%d ended", v->box.x2 - v->box.x1,
+                    v->box.y2 - v->box.y1, v->box.x1, v->box.y1);
+            if (v->dirty)
+                scanner_push(scanner, SCANLINE_SCAN_REPORT, v->box.x1, v->box.y1,
+                             v->box.x2 - v->box.x1, v->box.y2 - v->box.y1);
+            v->active = 0;
+            continue;
+        }
+
+        if (!v->dirty || now < v->next_frame)
+            continue;
+
+        frame.x = v->box.x1;
+        frame.y = v->box.y1;
+        frame.w = v->box.x2 - v->box.x1;
+        frame.h = v->box.y2 - v->box.y1;
+
+        v->dirty = 0;
+        v->next_frame = now + VIDEO_FRAME_USEC;
+        handle_scan_report(scanner, &frame, CLASSIFY_VIDEO_RATE);
+    }
+}
+
 static void scanner_push_screen(scanner_t *scanner)
 {
     scan_report_t whole_screen = {
         .type = SCANLINE_SCAN_REPORT,
-        .x = 0,.y = 0,
-        .w = scanner->session->display.width,
-        .h = scanner->session->display.height
+        .x = scanner->head.x,.y = scanner->head.y,
+        .w = scanner->head.w,
+        .h = scanner->head.h
     };
 
-    handle_scan_report(scanner->session, &whole_screen);
+    handle_scan_report(scanner, &whole_screen, 0);
+}
+
+/* How long to wait for a report before scanning on our own; video_due
+   is set if a video frame is what we would wake up for */
+guint64 scanner_next_timeout(scanner_t *scanner, int *video_due)
+{
+    guint64 timeout = get_timeout(scanner);
+    gint64 video_wait = scanner_video_wait(scanner);
+
+    *video_due = 0;
+    if (video_wait >= 0 && (guint64) video_wait < timeout) {
+        timeout = video_wait;
+        *video_due = 1;
+    }
+
+    return timeout;
+}
+
+/* When throttled, full screen scans are spaced out; requests that come
+   too soon are folded into one, made once the time is up */
+static int full_scan_allowed(scanner_t *scanner)
+{
+    int level = governor_level(&scanner->session->governor);
+
+    return level == 0 ||
+        scanner_now(scanner) - scanner->last_full_scan >= level * GOVERNOR_FULL_SCAN_USEC;
+}
+
+/* Act on report r, or on a timeout if r is NULL.  Frees r.  Returns
+   FALSE once we have been told to exit. */
+int scanner_step(scanner_t *scanner, scan_report_t *r, int video_due)
+{
+    int change_rate;
+
+    if (!r) {
+        if (video_due) {
+            scanner_push_video_frames(scanner);
+        } else if (scanner->full_scan_pending && full_scan_allowed(scanner)) {
+            scan_full_screen(scanner);
+        } else if (scanner->session->options.full_screen_fps > 0) {
+            scanner_push_screen(scanner);
+        } else {
+            scan_update_fps(scanner, -1);
+            scanner_periodic(scanner);
+        }
+        return TRUE;
+    }
+
+    if (r->type == FULLSCREEN_SCAN_REQUEST) {
+        free_queue_item(scanner, r);
+        if (full_scan_allowed(scanner))
+            scan_full_screen(scanner);
+        else
+            scanner->full_scan_pending = TRUE;
+        return TRUE;
+    }
+
+    /* A client has just connected; send it the whole screen in one go */
+    if (r->type == RESYNC_SCAN_REQUEST) {
+        free_queue_item(scanner, r);
+        scanner->full_scan_pending = FALSE;
+        scanner_push_screen(scanner);
+        return TRUE;
+    }
+
+    if (r->type == EXIT_SCAN_REPORT) {
+        free_queue_item(scanner, r);
+        return FALSE;
+    }
+
+    /* Remaining scan types affect a region of the screen */
+    scan_update_fps(scanner, 1);
+    scanner_remove_region(scanner, r);
+
+    change_rate = classifier_note_change(&scanner->classifier,
+                                         scanner->head.w, scanner->head.h,
+                                         r->x - scanner->head.x, r->y - scanner->head.y,
+                                         r->w, r->h, scanner_now(scanner));
+    if (!scanner_absorb_video(scanner, r, change_rate))
+        handle_scan_report(scanner, r, change_rate);
+    free_queue_item(scanner, r);
+
+    scanner_push_video_frames(scanner);
+    return TRUE;
 }
 
 static void *scanner_run(void *opaque)
 {
     scanner_t *scanner = (scanner_t *) opaque;
+
+    trace_thread_name("scanner %d", (int) (scanner - scanner->session->scanners));
     while (session_alive(scanner->session)) {
         scan_report_t *r;
-        r = (scan_report_t *) g_async_queue_timeout_pop(scanner->queue, get_timeout(scanner));
-        if (!r) {
-            if (scanner->session->options.full_screen_fps > 0) {
-                scanner_push_screen(scanner);
-            } else {
-                scan_update_fps(scanner, -1);
-                scanner_periodic(scanner);
-            }
-            continue;
-        }
+        int video_due;
+        guint64 timeout = scanner_next_timeout(scanner, &video_due);
 
-        if (r->type == FULLSCREEN_SCAN_REQUEST) {
-            free_queue_item(r);
-            scan_full_screen(scanner);
-            continue;
-        }
+        /* With no client, we only wake for the resync or to exit */
+        if (session_idle(scanner->session)) {
+            r = (scan_report_t *) g_async_queue_timeout_pop(scanner->queue, IDLE_WAIT_USEC);
+            if (!r)
+                continue;
+            video_due = 0;
+        } else
+            r = (scan_report_t *) g_async_queue_timeout_pop(scanner->queue, timeout);
 
-        if (r->type == EXIT_SCAN_REPORT) {
-            free_queue_item(r);
+        if (!scanner_step(scanner, r, video_due))
             break;
-        }
-
-        /* Remaining scan types affect a region of the screen */
-        scan_update_fps(scanner, 1);
-        scanner_remove_region(scanner, r);
-
-        handle_scan_report(scanner->session, r);
-        free_queue_item(r);
+        governor_charge(&scanner->session->governor, &scanner->cpu_seen);
     }
 
     return 0;
 }
 
 
-int scanner_create(scanner_t *scanner)
+/* Set up a scanner without a thread; the replay driver steps it itself */
+int scanner_init(scanner_t *scanner, head_t *head)
 {
-    scanner->queue = g_async_queue_new_full(free_queue_item);
+    display_t *d = &scanner->session->display;
+
+    scanner->head = *head;
+
+    /* Scanners capture over connections of their own, so one waiting
+       on a large image never holds up another */
+    scanner->c = NULL;
+    if (!d->source) {
+        scanner->c = xcb_connect(scanner->session->options.display, NULL);
+        if (xcb_connection_has_error(scanner->c)) {
+            g_warning("Could not open a capture connection to the display");
+            xcb_disconnect(scanner->c);
+            scanner->c = NULL;
+            return X11SPICE_ERR_NODISPLAY;
+        }
+    }
+
+    scanner->scanline = create_shm_image(d, head->w, 1);
+    if (scanner->scanline && attach_shm_image(d, scanner->c, scanner->scanline)) {
+        destroy_shm_image(d, scanner->scanline);
+        scanner->scanline = NULL;
+    }
+    if (!scanner->scanline) {
+        if (scanner->c)
+            xcb_disconnect(scanner->c);
+        scanner->c = NULL;
+        return X11SPICE_ERR_NOSHM;
+    }
+
+    scanner->queue = g_async_queue_new();
     scanner->lock = g_mutex_new();
     scanner->current_scanline = 0;
     pixman_region_init(&scanner->region);
     scanner->target_fps = MIN_SCAN_FPS;
-    return pthread_create(&scanner->thread, NULL, scanner_run, scanner);
+    classifier_init(&scanner->classifier);
+    memset(scanner->video, 0, sizeof(scanner->video));
+    scanner->threaded = FALSE;
+    scanner->clock = 0;
+    scanner->cpu_seen = 0;
+    scanner->last_full_scan = 0;
+    scanner->full_scan_pending = FALSE;
+    return 0;
 }
 
-int scanner_destroy(scanner_t *scanner)
+int scanner_create(scanner_t *scanner, head_t *head)
 {
-    void *err;
     int rc;
 
-    scanner_push(scanner, EXIT_SCAN_REPORT, 0, 0, 0, 0);
-    rc = pthread_join(scanner->thread, &err);
+    rc = scanner_init(scanner, head);
+    if (rc)
+        return rc;
+
+    rc = pthread_create(&scanner->thread, NULL, scanner_run, scanner);
     if (rc == 0)
-        rc = (int) (long) err;
+        scanner->threaded = TRUE;
+    return rc;
+}
+
+int scanner_destroy(scanner_t *scanner)
+{
+    void *err;
+    int rc = 0;
+
+    if (scanner->threaded) {
+        scanner_push(scanner, EXIT_SCAN_REPORT, 0, 0, 0, 0);
+        rc = pthread_join(scanner->thread, &err);
+        if (rc == 0)
+            rc = (int) (long) err;
+        scanner->threaded = FALSE;
+    }
 
     g_mutex_lock(scanner->lock);
     if (scanner->queue) {
+        scan_report_t *r;
+        while ((r = g_async_queue_try_pop(scanner->queue)))
+            free_queue_item(scanner, r);
         g_async_queue_unref(scanner->queue);
         scanner->queue = NULL;
     }
@@ -476,6 +1109,13 @@ int scanner_destroy(scanner_t *scanner)
     g_mutex_free(scanner->lock);
     scanner->lock = NULL;
 
+    destroy_shm_image(&scanner->session->display, scanner->scanline);
+    scanner->scanline = NULL;
+
+    if (scanner->c)
+        xcb_disconnect(scanner->c);
+    scanner->c = NULL;
+
     return rc;
 }
 
@@ -494,7 +1134,7 @@ int scanner_push(scanner_t *scanner, scan_type_t type, int x, int y, int w, int
         return X11SPICE_ERR_SHUTTING_DOWN;
     }
 
-    r = malloc(sizeof(*r));
+    r = slab_alloc(scanner->session->report_slab);
     if (!r) {
         g_mutex_unlock(scanner->lock);
         return X11SPICE_ERR_MALLOC;
@@ -505,6 +1145,9 @@ int scanner_push(scanner_t *scanner, scan_type_t type, int x, int y, int w, int
     r->y = y;
     r->w = w;
     r->h = h;
+    /* Damage reports are pushed from the event thread, as it handles the damage */
+    r->damaged = type == DAMAGE_SCAN_REPORT ? scanner->session->display.damage_time : 0;
+    r->queued = g_get_monotonic_time();
 
     if (type == SCANLINE_SCAN_REPORT || type == DAMAGE_SCAN_REPORT) {
         pixman_box16_t rect;
@@ -516,7 +1159,7 @@ int scanner_push(scanner_t *scanner, scan_type_t type, int x, int y, int w, int
         /* Optimization: if we're being notified of an area already to be
            rescanned, just discard this notice, otherwise update region and push */
         if (pixman_region_contains_rectangle(&scanner->region, &rect)) {
-            free(r);
+            free_queue_item(scanner, r);
         } else {
             pixman_region_union_rect(&scanner->region, &scanner->region, x, y, w, h);
             g_async_queue_push(scanner->queue, r);
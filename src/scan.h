@@ -23,6 +23,11 @@
 
 #include <pixman.h>
 
+#include "display.h"
+#include "classify.h"
+#include "ring.h"
+#include "latency.h"
+
 /*----------------------------------------------------------------------------
 **  Definitions and simple types
 **--------------------------------------------------------------------------*/
@@ -31,8 +36,17 @@ typedef enum {
     SCANLINE_SCAN_REPORT,
     EXIT_SCAN_REPORT,
     FULLSCREEN_SCAN_REQUEST,
+    VIDEO_SCAN_REPORT,
+    RESYNC_SCAN_REQUEST,
 } scan_type_t;
 
+#define MAX_VIDEO_REGIONS            4
+
+/* We scan over the screen by breaking each head into a grid of tiles,
+   NUM_SCANLINES rows high and NUM_HORIZONTAL_TILES across */
+#define NUM_SCANLINES               32
+#define NUM_HORIZONTAL_TILES        NUM_SCANLINES
+
 struct session_struct;
 /*----------------------------------------------------------------------------
 **  Structure definitions
@@ -44,25 +58,62 @@ typedef struct {
     int y;
     int w;
     int h;
+    gint64 damaged;             /* From damage_time, for damage reports */
+    gint64 queued;
 } scan_report_t;
 
+/* An area of the screen we have decided is showing video.  We capture
+   the whole area at a steady rate so spice can stream it. */
+typedef struct {
+    int active;
+    int dirty;
+    pixman_box16_t box;
+    gint64 last_change;
+    gint64 next_frame;
+} video_region_t;
+
+/* Each monitor gets its own scanner, which only looks at, and only
+   receives reports for, the area of the screen covered by its head */
 typedef struct {
     pthread_t thread;
     GAsyncQueue *queue;
     struct session_struct *session;
+    head_t head;
+    xcb_connection_t *c;        /* Ours alone, for captures; NULL with a source */
+    shm_image_t *scanline;      /* Attached on c */
+    ring_t *draw_ring;          /* We are its only producer */
     GMutex *lock;
     int current_scanline;
     pixman_region16_t region;
     int target_fps;
+    classifier_t classifier;
+    video_region_t video[MAX_VIDEO_REGIONS];
+    latency_stamps_t stamps;    /* Of the report being handled */
+    int threaded;
+    gint64 clock;               /* Replay time; 0 to use the real clock */
+    gint64 cpu_seen;            /* For the governor */
+    gint64 last_full_scan;
+    int full_scan_pending;      /* Put off by the governor */
 } scanner_t;
 
 
 /*----------------------------------------------------------------------------
 **  Prototypes
 **--------------------------------------------------------------------------*/
-int scanner_create(scanner_t *scanner);
+int scanner_create(scanner_t *scanner, head_t *head);
+int scanner_init(scanner_t *scanner, head_t *head);
 int scanner_destroy(scanner_t *scanner);
 
+guint64 scanner_next_timeout(scanner_t *scanner, int *video_due);
+int scanner_step(scanner_t *scanner, scan_report_t *r, int video_due);
+
 int scanner_push(scanner_t *scanner, scan_type_t type, int x, int y, int w, int h);
 
+/* Turn a grid of changed tiles into scan reports; these are normally only
+   called by the scanner itself, and are exposed for the benchmarks */
+void grow_changed_tiles(scanner_t *scanner, int *tiles_changed_in_row,
+                        bool tiles_changed[][NUM_HORIZONTAL_TILES], int num_vertical_tiles);
+void push_changed_tiles(scanner_t *scanner, int *tiles_changed_in_row,
+                        bool tiles_changed[][NUM_HORIZONTAL_TILES], int num_vertical_tiles);
+
 #endif
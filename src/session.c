@@ -29,7 +29,6 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <sched.h>
 #include <errno.h>
 
 #include <xcb/xcb.h>
@@ -43,6 +42,8 @@
 #include "x11spice.h"
 #include "session.h"
 #include "scan.h"
+#include "trace.h"
+#include "record.h"
 
 #if defined(HAVE_LIBAUDIT_H)
 #include <libaudit.h>
@@ -63,30 +64,104 @@ void free_cursor_queue_item(gpointer data)
     spice_free_release((spice_release_t *) (uintptr_t) ccmd->release_info.id);
 }
 
-void free_draw_queue_item(gpointer data)
+static void free_draw_queue_item(gpointer data)
 {
     QXLDrawable *drawable = (QXLDrawable *) data;
     spice_free_release((spice_release_t *) (uintptr_t) drawable->release_info.id);
 }
 
+/*----------------------------------------------------------------------------
+**  In flight accounting
+**      We count the commands spice has taken from us and not yet released.
+**  A resize or teardown waits on draw_cond for the spice worker to let go
+**  of the draw queue; the worker only signals it while someone waits.
+**--------------------------------------------------------------------------*/
+static void signal_draw_waiters(session_t *s)
+{
+    if (!g_atomic_int_get(&s->draws_blocked))
+        return;
+
+    g_mutex_lock(&s->draw_lock);
+    g_cond_broadcast(&s->draw_cond);
+    g_mutex_unlock(&s->draw_lock);
+}
+
+static void draw_worker_idle(session_t *s)
+{
+    g_atomic_int_set(&s->draw_command_in_progress, FALSE);
+    signal_draw_waiters(s);
+}
+
+/* Called from release_resource, on the spice worker thread */
+void session_command_released(session_t *s, int is_draw)
+{
+    g_atomic_int_add(is_draw ? &s->draws_in_flight : &s->cursors_in_flight, -1);
+    if (is_draw) {
+        metrics_add(METRIC_DRAWABLES_RELEASED, 1);
+        signal_draw_waiters(s);
+    }
+}
+
+void session_commands_in_flight(session_t *s, int *draws, int *cursors)
+{
+    *draws = g_atomic_int_get(&s->draws_in_flight);
+    *cursors = g_atomic_int_get(&s->cursors_in_flight);
+}
+
+/* Wait up to timeout_us for the spice worker to finish the draw command
+   it is working on; draws must already be blocked */
+static int wait_for_draw_worker(session_t *s, gint64 timeout_us)
+{
+    gint64 end = g_get_monotonic_time() + timeout_us;
+    int rc = 0;
+
+    g_mutex_lock(&s->draw_lock);
+    while (g_atomic_int_get(&s->draw_command_in_progress))
+        if (!g_cond_wait_until(&s->draw_cond, &s->draw_lock, end)) {
+            rc = X11SPICE_ERR_BUSY;
+            break;
+        }
+    g_mutex_unlock(&s->draw_lock);
+
+    return rc;
+}
+
 void *session_pop_draw(session_t *session)
 {
     void *ret = NULL;
+    int i;
 
     if (!session)
         return ret;
 
     if (!session->running) {
-        session->draw_command_in_progress = FALSE;
+        draw_worker_idle(session);
         return ret;
     }
 
-    if (!g_mutex_trylock(session->lock))
+    /* We mark ourselves busy before looking for a block, and flush_and_lock
+       blocks before looking for us; so one of us always sees the other */
+    g_atomic_int_set(&session->draw_command_in_progress, TRUE);
+    if (g_atomic_int_get(&session->draws_blocked)) {
+        draw_worker_idle(session);
         return ret;
+    }
 
-    ret = g_async_queue_try_pop(session->draw_queue);
-    session->draw_command_in_progress = (ret != NULL);
-    g_mutex_unlock(session->lock);
+    /* Take from each scanner's ring in turn, so a busy head cannot
+       starve the others */
+    for (i = 0; i < MAX_HEADS && !ret; i++) {
+        ret = ring_pop(&session->draw_rings[session->next_draw_ring]);
+        session->next_draw_ring = (session->next_draw_ring + 1) % MAX_HEADS;
+    }
+    if (ret) {
+        spice_release_t *release =
+            (spice_release_t *) (uintptr_t) ((QXLDrawable *) ret)->release_info.id;
+        /* Only the drawable that completes a capture is timed */
+        if (release && release->stamps.at[LATENCY_DRAWABLE_QUEUED])
+            release->stamps.at[LATENCY_POPPED] = g_get_monotonic_time();
+        trace_instant(TRACE_POP_DRAW, g_atomic_int_add(&session->draws_in_flight, 1) + 1);
+    } else
+        draw_worker_idle(session);
 
     return ret;
 }
@@ -94,29 +169,42 @@ void *session_pop_draw(session_t *session)
 int session_draw_waiting(session_t *session)
 {
     int ret = 0;
+    int i;
 
     if (!session)
         return ret;
 
     if (!session->running) {
-        session->draw_command_in_progress = FALSE;
+        draw_worker_idle(session);
         return ret;
     }
 
-    if (!g_mutex_trylock(session->lock))
+    /* A resize wakes spice again once it is done */
+    if (g_atomic_int_get(&session->draws_blocked))
         return ret;
 
-    ret = g_async_queue_length(session->draw_queue);
-    g_mutex_unlock(session->lock);
+    for (i = 0; i < MAX_HEADS; i++)
+        ret += ring_length(&session->draw_rings[i]);
     return (ret);
 }
 
 void *session_pop_cursor(session_t *session)
 {
+    void *ret;
+
     if (!session || !session->running)
         return NULL;
 
-    return g_async_queue_try_pop(session->cursor_queue);
+    g_async_queue_lock(session->cursor_queue);
+    ret = g_async_queue_try_pop_unlocked(session->cursor_queue);
+    if (ret && ret == session->queued_move)
+        session->queued_move = NULL;
+    g_async_queue_unlock(session->cursor_queue);
+
+    if (ret)
+        g_atomic_int_inc(&session->cursors_in_flight);
+
+    return ret;
 }
 
 int session_cursor_waiting(session_t *session)
@@ -127,15 +215,96 @@ int session_cursor_waiting(session_t *session)
     return g_async_queue_length(session->cursor_queue);
 }
 
+/*----------------------------------------------------------------------------
+**  Input batching
+**      Input from the client arrives on the spice core thread.  We queue
+**  it, in order, and send it to the X server with a single flush each time
+**  the core loop is about to sleep.  A motion queued right behind another
+**  motion just replaces its position, so a fast mouse does not bury the
+**  X server in stale motion; keys and buttons always keep their place.
+**--------------------------------------------------------------------------*/
+static void queue_input(session_t *s, uint8_t type, uint8_t detail, int x, int y)
+{
+    input_event_t *e;
+
+    if (type == XCB_MOTION_NOTIFY && s->input_count > 0) {
+        e = &s->input_batch[s->input_count - 1];
+        if (e->type == XCB_MOTION_NOTIFY) {
+            e->x = x;
+            e->y = y;
+            metrics_add(METRIC_INPUT_COALESCED, 1);
+            return;
+        }
+    }
+
+    if (s->input_count == MAX_INPUT_BATCH)
+        session_flush_input(s);
+
+    e = &s->input_batch[s->input_count++];
+    e->type = type;
+    e->detail = detail;
+    e->x = x;
+    e->y = y;
+    e->queued = g_get_monotonic_time();
+}
+
+/* Called on the spice core thread, once per pass through its loop */
+void session_flush_input(session_t *s)
+{
+    input_event_t *e;
+    gint64 now;
+    guint64 latency;
+    guint64 total_latency = 0;
+    gint64 start;
+    int i;
+
+    if (s->input_count == 0)
+        return;
+
+    start = trace_begin();
+    for (i = 0, e = s->input_batch; i < s->input_count; i++, e++)
+        xcb_test_fake_input(s->display.input_c, e->type, e->detail, XCB_CURRENT_TIME,
+                            e->type == XCB_KEY_PRESS || e->type == XCB_KEY_RELEASE ?
+                            XCB_NONE : s->display.root, e->x, e->y, 0);
+    xcb_flush(s->display.input_c);
+
+    /* Latency runs from when the client event reached us until it
+       has been handed to the X server */
+    now = g_get_monotonic_time();
+    for (i = 0, e = s->input_batch; i < s->input_count; i++, e++) {
+        latency = now - e->queued;
+        total_latency += latency;
+        if (latency > (guint64) g_atomic_int_get(&s->input_latency_max_us))
+            g_atomic_int_set(&s->input_latency_max_us, MIN(latency, G_MAXINT));
+    }
+    metrics_add(METRIC_INPUT_EVENTS, s->input_count);
+    metrics_add(METRIC_INPUT_BATCHES, 1);
+    metrics_add(METRIC_INPUT_LATENCY_US, total_latency);
+    trace_end(TRACE_INPUT_FLUSH, start, s->input_count);
+    s->input_count = 0;
+}
+
+static void log_input_stats(session_t *s)
+{
+    guint64 events = metrics_total(METRIC_INPUT_EVENTS);
+
+    if (events == 0)
+        return;
+
+    g_debug("input: %" G_GUINT64_FORMAT " events in %" G_GUINT64_FORMAT " batches, %"
+            G_GUINT64_FORMAT " motions coalesced; latency avg %" G_GUINT64_FORMAT " us, max %d us",
+            events, metrics_total(METRIC_INPUT_BATCHES), metrics_total(METRIC_INPUT_COALESCED),
+            metrics_total(METRIC_INPUT_LATENCY_US) / events,
+            g_atomic_int_get(&s->input_latency_max_us));
+}
+
 void session_handle_key(session_t *session, uint8_t keycode, int is_press)
 {
     if (!session->options.allow_control)
         return;
 
-    xcb_test_fake_input(session->display.c, is_press ? XCB_KEY_PRESS : XCB_KEY_RELEASE,
-                        keycode, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+    queue_input(session, is_press ? XCB_KEY_PRESS : XCB_KEY_RELEASE, keycode, 0, 0);
     g_debug("key 0x%x, press %d", keycode, is_press);
-    xcb_flush(session->display.c);
 }
 
 void session_handle_mouse_position(session_t *session, int x, int y,
@@ -144,9 +313,11 @@ void session_handle_mouse_position(session_t *session, int x, int y,
     if (!session->options.allow_control)
         return;
 
-    xcb_test_fake_input(session->display.c, XCB_MOTION_NOTIFY, 0, XCB_CURRENT_TIME,
-                        session->display.root, x, y, 0);
-    xcb_flush(session->display.c);
+    queue_input(session, XCB_MOTION_NOTIFY, 0, x, y);
+
+    /* Cached cursor shapes are placed at the last known position */
+    g_atomic_int_set(&session->display.cursor_x, x);
+    g_atomic_int_set(&session->display.cursor_y, y);
 }
 
 #define BUTTONS 5
@@ -159,8 +330,7 @@ static void session_handle_button_change(session_t *s, uint32_t buttons_state)
     for (i = 0; i < BUTTONS; i++) {
         if ((buttons_state ^ s->spice.buttons_state) & (1 << i)) {
             int action = (buttons_state & (1 << i));
-            xcb_test_fake_input(s->display.c, action ? XCB_BUTTON_PRESS : XCB_BUTTON_RELEASE,
-                                i + 1, XCB_CURRENT_TIME, s->display.root, 0, 0, 0);
+            queue_input(s, action ? XCB_BUTTON_PRESS : XCB_BUTTON_RELEASE, i + 1, 0, 0);
         }
     }
     s->spice.buttons_state = buttons_state;
@@ -201,17 +371,192 @@ static void cleanup_process(int pid)
     killpg(pid, SIGKILL);
 }
 
+static void stop_scanners(session_t *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_scanners; i++)
+        scanner_destroy(&s->scanners[i]);
+    s->num_scanners = 0;
+}
+
+static int start_scanners(session_t *s)
+{
+    int rc;
+    int i;
+
+    for (i = 0; i < s->display.num_heads; i++) {
+        s->scanners[i].session = s;
+        s->scanners[i].draw_ring = &s->draw_rings[i];
+        rc = scanner_create(&s->scanners[i], &s->display.heads[i]);
+        if (rc) {
+            stop_scanners(s);
+            return rc;
+        }
+        s->num_scanners++;
+    }
+
+    return 0;
+}
+
+/* Hand a report to every scanner whose head it touches, clipped to that head */
+void session_push_scan(session_t *s, scan_type_t type, int x, int y, int w, int h)
+{
+    int i;
+
+    /* The resync on connect will pick up anything we miss while idle */
+    if (session_idle(s))
+        return;
+
+    record_scan(type, x, y, w, h);
+
+    for (i = 0; i < s->num_scanners; i++) {
+        head_t *head = &s->scanners[i].head;
+        int x1, y1, x2, y2;
+
+        if (type != DAMAGE_SCAN_REPORT && type != SCANLINE_SCAN_REPORT) {
+            scanner_push(&s->scanners[i], type, x, y, w, h);
+            continue;
+        }
+
+        x1 = MAX(x, head->x);
+        y1 = MAX(y, head->y);
+        x2 = MIN(x + w, head->x + (int) head->w);
+        y2 = MIN(y + h, head->y + (int) head->h);
+        if (x1 < x2 && y1 < y2)
+            scanner_push(&s->scanners[i], type, x1, y1, x2 - x1, y2 - y1);
+    }
+}
+
+/* Poll the pointer position, so that warps and drags done by local
+   applications reach the client without waiting for a shape change */
+static void *track_pointer(void *opaque)
+{
+    session_t *s = (session_t *) opaque;
+    display_t *d = &s->display;
+    xcb_query_pointer_reply_t *reply;
+    gulong interval = G_USEC_PER_SEC / s->options.cursor_fps;
+
+    while (session_alive(s)) {
+        g_usleep(interval);
+
+        reply = xcb_query_pointer_reply(d->pointer_c, xcb_query_pointer(d->pointer_c, d->root),
+                                        NULL);
+        if (!reply)
+            continue;
+
+        if (reply->same_screen &&
+            (reply->root_x != g_atomic_int_get(&d->cursor_x) ||
+             reply->root_y != g_atomic_int_get(&d->cursor_y))) {
+            g_atomic_int_set(&d->cursor_x, reply->root_x);
+            g_atomic_int_set(&d->cursor_y, reply->root_y);
+            session_push_cursor_move(s, reply->root_x, reply->root_y);
+        }
+        free(reply);
+    }
+
+    return NULL;
+}
+
+/* Values for the metrics socket that are read rather than counted */
+static const struct {
+    const char *name;
+    double percent;
+} quantiles[] = {
+    {"0.5", 50},
+    {"0.99", 99},
+};
+
+static void write_slab_stats(GString *out, slab_t *slab)
+{
+    slab_stats_t stats;
+
+    slab_get_stats(slab, &stats);
+    g_string_append_printf(out, "slab_allocs_total{slab=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                           slab->name, stats.allocs);
+    g_string_append_printf(out, "slab_frees_total{slab=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                           slab->name, stats.frees);
+    g_string_append_printf(out, "slab_refills_total{slab=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                           slab->name, stats.refills);
+    g_string_append_printf(out, "slab_returns_total{slab=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                           slab->name, stats.returns);
+    g_string_append_printf(out, "slab_objects{slab=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                           slab->name, stats.objects);
+    g_string_append_printf(out, "slab_chunks{slab=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                           slab->name, stats.chunks);
+}
+
+static void write_gauges(GString *out, void *data)
+{
+    session_t *s = (session_t *) data;
+    guint64 cycles;
+    guint64 lookups;
+    guint depth = 0;
+    int i;
+
+    g_mutex_lock(&s->scanner_lock);
+    for (i = 0; i < s->num_scanners; i++) {
+        g_string_append_printf(out, "scan_fps{head=\"%d\"} %d\n", i,
+                               g_atomic_int_get(&s->scanners[i].target_fps));
+        depth += ring_length(&s->draw_rings[i]);
+    }
+    g_mutex_unlock(&s->scanner_lock);
+    g_string_append_printf(out, "draw_queue_depth %u\n", depth);
+    g_string_append_printf(out, "draws_in_flight %d\n", g_atomic_int_get(&s->draws_in_flight));
+    g_string_append_printf(out, "cursor_queue_depth %d\n", g_async_queue_length(s->cursor_queue));
+    g_string_append_printf(out, "damage_trusted %d\n", display_trust_damage(&s->display));
+    g_string_append_printf(out, "idle %d\n", session_idle(s));
+    g_string_append_printf(out, "input_latency_max_us %d\n",
+                           g_atomic_int_get(&s->input_latency_max_us));
+
+    write_slab_stats(out, s->drawable_slab);
+    write_slab_stats(out, s->release_slab);
+    write_slab_stats(out, s->report_slab);
+
+    cycles = metrics_total(METRIC_SCAN_CYCLES) + metrics_total(METRIC_FULLSCREEN_SCANS);
+    g_string_append_printf(out, "tiles_changed_per_cycle %.2f\n",
+                           cycles ? (double) metrics_total(METRIC_TILES_CHANGED) / cycles : 0.0);
+    lookups = metrics_total(METRIC_SHM_CACHE_LOOKUPS);
+    g_string_append_printf(out, "shm_cache_hit_rate %.3f\n",
+                           lookups ? (double) metrics_total(METRIC_SHM_CACHE_HITS) / lookups : 0.0);
+
+    if (s->governor.budget > 0) {
+        g_string_append_printf(out, "governor_cpu_percent %d\n",
+                               governor_cpu_percent(&s->governor));
+        g_string_append_printf(out, "governor_level %d\n", governor_level(&s->governor));
+    }
+
+    /* Over the life of the session; a screen capture, and damage to release */
+    for (i = 0; i < G_N_ELEMENTS(quantiles); i++) {
+        g_string_append_printf(out, "capture_latency_us{quantile=\"%s\"} %" G_GINT64_FORMAT "\n",
+                               quantiles[i].name,
+                               latency_percentile(&s->latency.hist[LATENCY_CAPTURE_DONE],
+                                                  quantiles[i].percent));
+        g_string_append_printf(out, "update_latency_us{quantile=\"%s\"} %" G_GINT64_FORMAT "\n",
+                               quantiles[i].name,
+                               latency_percentile(&s->latency.hist[0], quantiles[i].percent));
+    }
+}
+
 int session_start(session_t *s)
 {
     int rc = 0;
 
     s->spice.session = s;
     s->display.session = s;
-    s->scanner.session = s;
+    s->num_scanners = 0;
 
     s->running = TRUE;
 
-    rc = scanner_create(&s->scanner);
+    /* The spice core thread is not started until after us, so no client
+       can be attached yet; the connect event will end the idle period */
+    g_atomic_int_set(&s->idle, TRUE);
+
+    rc = spice_send_monitors_config(&s->spice, s->display.num_heads, s->display.heads);
+    if (rc)
+        goto end;
+
+    rc = start_scanners(s);
     if (rc)
         goto end;
 
@@ -219,6 +564,16 @@ int session_start(session_t *s)
     if (rc)
         return rc;
 
+    if (s->options.cursor_fps > 0) {
+        rc = pthread_create(&s->pointer_thread, NULL, track_pointer, s);
+        if (rc)
+            goto end;
+        s->pointer_thread_started = TRUE;
+    }
+
+    if (s->options.metrics_socket)
+        if (metrics_server_start(&s->metrics, s->options.metrics_socket, write_gauges, s))
+            g_warning("Continuing without a metrics socket");
 
 end:
     global_session = s;
@@ -227,16 +582,21 @@ end:
     return rc;
 }
 
+/* Take the resize lock, stop spice taking draw commands, and wait for
+   it to finish with the one it has */
 static void flush_and_lock(session_t *s)
 {
-    while (1) {
-        g_mutex_lock(s->lock);
-        if (!s->draw_command_in_progress)
-            break;
+    g_mutex_lock(s->lock);
+    g_atomic_int_set(&s->draws_blocked, TRUE);
+    if (wait_for_draw_worker(s, FLUSH_TIMEOUT_US))
+        g_warning("Spice worker still busy after %d ms; continuing",
+                  (int) (FLUSH_TIMEOUT_US / 1000));
+}
 
-        g_mutex_unlock(s->lock);
-        sched_yield();
-    }
+static void unlock_draws(session_t *s)
+{
+    g_atomic_int_set(&s->draws_blocked, FALSE);
+    g_mutex_unlock(s->lock);
 }
 
 void session_end(session_t *s)
@@ -245,9 +605,19 @@ void session_end(session_t *s)
     s->running = 0;
     global_session = NULL;
 
+    log_input_stats(s);
+
+    metrics_server_stop(&s->metrics);
+
+    if (s->pointer_thread_started)
+        pthread_join(s->pointer_thread, NULL);
+    s->pointer_thread_started = FALSE;
+
     display_stop_event_thread(&s->display);
 
-    scanner_destroy(&s->scanner);
+    g_mutex_lock(&s->scanner_lock);
+    stop_scanners(s);
+    g_mutex_unlock(&s->scanner_lock);
 
     display_destroy_screen_images(&s->display);
 
@@ -289,16 +659,38 @@ static void end_audit(session_t *s)
 int session_create(session_t *s)
 {
     int rc = 0;
+    int i;
 
 #if ! GLIB_CHECK_VERSION(2, 32, 0)
     g_thread_init(NULL);
 #endif
 
+    s->drawable_slab = slab_create("drawable", sizeof(QXLDrawable) + sizeof(QXLImage));
+    s->release_slab = slab_create("release", sizeof(spice_release_t));
+    s->report_slab = slab_create("scan report", sizeof(scan_report_t));
+    if (!s->drawable_slab || !s->release_slab || !s->report_slab)
+        return X11SPICE_ERR_MALLOC;
+
+    for (i = 0; i < MAX_HEADS; i++) {
+        rc = ring_create(&s->draw_rings[i], DRAW_RING_SIZE);
+        if (rc)
+            return rc;
+    }
+    s->next_draw_ring = 0;
+
+    latency_init(&s->latency);
+    governor_init(&s->governor, s->options.cpu_budget);
+
     s->cursor_queue = g_async_queue_new_full(free_cursor_queue_item);
-    s->draw_queue = g_async_queue_new_full(free_draw_queue_item);
     s->lock = g_mutex_new();
+    g_mutex_init(&s->draw_lock);
+    g_cond_init(&s->draw_cond);
+    g_mutex_init(&s->scanner_lock);
+
+    s->input_latency_max_us = 0;
 
     s->connected = FALSE;
+    s->idle = FALSE;
     s->connect_pid = 0;
     s->disconnect_pid = 0;
 
@@ -310,18 +702,39 @@ int session_create(session_t *s)
 
 void session_destroy(session_t *s)
 {
+    int i;
+    int draws, cursors;
+
     flush_and_lock(s);
 
+    session_commands_in_flight(s, &draws, &cursors);
+    if (draws || cursors)
+        g_debug("spice did not release %d draw and %d cursor commands", draws, cursors);
+
     if (s->cursor_queue)
         g_async_queue_unref(s->cursor_queue);
-    if (s->draw_queue)
-        g_async_queue_unref(s->draw_queue);
     s->cursor_queue = NULL;
-    s->draw_queue = NULL;
+    s->queued_move = NULL;
 
-    g_mutex_unlock(s->lock);
+    /* The scanners and the spice worker are gone by now */
+    for (i = 0; i < MAX_HEADS; i++)
+        ring_destroy(&s->draw_rings[i], free_draw_queue_item);
+
+    unlock_draws(s);
     g_mutex_free(s->lock);
     s->lock = NULL;
+    g_mutex_clear(&s->draw_lock);
+    g_cond_clear(&s->draw_cond);
+    g_mutex_clear(&s->scanner_lock);
+    governor_destroy(&s->governor);
+
+    slab_log_stats(s->drawable_slab);
+    slab_log_stats(s->release_slab);
+    slab_log_stats(s->report_slab);
+    slab_destroy(s->drawable_slab);
+    slab_destroy(s->release_slab);
+    slab_destroy(s->report_slab);
+    s->drawable_slab = s->release_slab = s->report_slab = NULL;
 
     if (s->connect_pid)
         cleanup_process(s->connect_pid);
@@ -336,33 +749,89 @@ void session_destroy(session_t *s)
 }
 
 /* Important note - this is meant to be called from
-    a thread context *other* than the spice worker thread */
-int session_recreate_primary(session_t *s)
+    a thread context *other* than the spice worker thread.
+    *kept is cleared if the old content could not be carried over,
+    in which case the whole screen must be captured again. */
+int session_recreate_primary(session_t *s, int *kept)
 {
     int rc;
+    shm_image_t *f;
 
     flush_and_lock(s);
     spice_destroy_primary(&s->spice);
-    display_destroy_screen_images(&s->display);
 
-    rc = display_create_screen_images(&s->display);
+    /* Carry over what is on screen, so the client keeps its picture
+       and we only need to capture the newly exposed areas */
+    *kept = TRUE;
+    rc = display_resize_screen_images(&s->display);
+    if (rc) {
+        g_warning("Could not resize screen images; recreating them");
+        *kept = FALSE;
+        display_destroy_screen_images(&s->display);
+        rc = display_create_screen_images(&s->display);
+    }
+
     if (rc == 0) {
-        shm_image_t *f = s->display.primary;
-        rc = spice_create_primary(&s->spice, f->w, f->h, f->bytes_per_line, f->segment.shmaddr);
+        f = s->display.primary;
+        rc = spice_create_primary(&s->spice, f->w, f->h, f->bytes_per_line, f->segment.shmaddr,
+                                  *kept);
     }
 
-    g_mutex_unlock(s->lock);
+    unlock_draws(s);
+    if (session_draw_waiting(s) > 0)
+        spice_qxl_wakeup(&s->spice.display_sin);
     return rc;
 }
 
+/* Called from the event thread when the screen size or the
+   monitor layout may have changed */
 void session_handle_resize(session_t *s)
 {
-    if (s->display.width == s->spice.width && s->display.height == s->spice.height)
+    int resized;
+    int relayout;
+    int kept;
+    int rc;
+    int old_w = s->spice.width;
+    int old_h = s->spice.height;
+    int w = s->display.width;
+    int h = s->display.height;
+
+    resized = w != old_w || h != old_h;
+    relayout = display_query_heads(&s->display);
+    if (!resized && !relayout)
         return;
 
-    g_debug("resizing from %dx%d to %dx%d",
-            s->spice.width, s->spice.height, s->display.width, s->display.height);
-    session_recreate_primary(s);
+    /* Scanners are tied to a head; stop them before the images they
+       scan into are replaced.  Other threads that walk the scanners,
+       such as the connect handler, wait until we are done. */
+    g_mutex_lock(&s->scanner_lock);
+    stop_scanners(s);
+
+    if (resized) {
+        g_debug("resizing from %dx%d to %dx%d", old_w, old_h, w, h);
+        record_screen(w, h);
+        /* With nothing carried over, the whole screen is newly exposed */
+        if (session_recreate_primary(s, &kept) || !kept)
+            old_w = old_h = 0;
+    }
+    spice_send_monitors_config(&s->spice, s->display.num_heads, s->display.heads);
+
+    rc = start_scanners(s);
+    g_mutex_unlock(&s->scanner_lock);
+    if (rc)
+        return;
+
+    /* The area common to the old and new size is unchanged; only scan
+       what has been uncovered.  The periodic scan catches the rest. */
+    if (!resized) {
+        session_push_scan(s, FULLSCREEN_SCAN_REQUEST, 0, 0, 0, 0);
+        return;
+    }
+
+    if (w > old_w)
+        session_push_scan(s, SCANLINE_SCAN_REPORT, old_w, 0, w - old_w, MIN(h, old_h));
+    if (h > old_h)
+        session_push_scan(s, SCANLINE_SCAN_REPORT, 0, old_h, w, h - old_h);
 }
 
 int session_alive(session_t *s)
@@ -370,20 +839,36 @@ int session_alive(session_t *s)
     return s->running;
 }
 
+int session_idle(session_t *s)
+{
+    return g_atomic_int_get(&s->idle);
+}
+
+/* The replay driver runs us with no spice server to wake */
+void session_wakeup_spice(session_t *s)
+{
+    if (s->spice.server)
+        spice_qxl_wakeup(&s->spice.display_sin);
+}
+
 int session_push_cursor_image(session_t *s,
                               int x, int y, int w, int h, int xhot, int yhot,
-                              int imglen, uint8_t *imgdata)
+                              uint64_t unique, int imglen, uint8_t *imgdata)
 {
     QXLCursorCmd *ccmd;
     QXLCursor *cursor;
 
+    record_cursor_image(x, y, w, h, xhot, yhot, imglen, imgdata);
+
     ccmd = calloc(1, sizeof(*ccmd) + sizeof(*cursor) + imglen);
     if (!ccmd)
         return X11SPICE_ERR_MALLOC;;
 
     cursor = (QXLCursor *) (ccmd + 1);
 
-    cursor->header.unique = 0;
+    /* With a unique id, spice marks the shape CACHE_ME the first time it
+       sends it, and only names it from the client cache afterwards */
+    cursor->header.unique = unique;
     cursor->header.type = SPICE_CURSOR_TYPE_ALPHA;
     cursor->header.width = w;
     cursor->header.height = h;
@@ -407,56 +892,89 @@ int session_push_cursor_image(session_t *s,
 
     ccmd->release_info.id = (uintptr_t) spice_create_release(&s->spice, RELEASE_MEMORY, ccmd);
 
-    g_async_queue_push(s->cursor_queue, ccmd);
-    spice_qxl_wakeup(&s->spice.display_sin);
+    /* A move queued before this set must not absorb later positions */
+    g_async_queue_lock(s->cursor_queue);
+    g_async_queue_push_unlocked(s->cursor_queue, ccmd);
+    s->queued_move = NULL;
+    g_async_queue_unlock(s->cursor_queue);
+    session_wakeup_spice(s);
 
     return 0;
 }
 
-int session_get_one_led(session_t *session, const char *name)
+/* If spice has not yet taken the last move we queued, we just update
+   its position; the client only cares where the pointer is now. */
+int session_push_cursor_move(session_t *s, int x, int y)
 {
-    int ret;
-    xcb_intern_atom_cookie_t atom_cookie;
-    xcb_intern_atom_reply_t *atom_reply;
-    xcb_xkb_get_named_indicator_cookie_t indicator_cookie;
-    xcb_xkb_get_named_indicator_reply_t *indicator_reply;
-    xcb_generic_error_t *error;
+    QXLCursorCmd *ccmd;
+
+    record_cursor_move(x, y);
 
-    atom_cookie = xcb_intern_atom(session->display.c, 0, strlen(name), name);
-    atom_reply = xcb_intern_atom_reply(session->display.c, atom_cookie, &error);
-    if (error) {
-        g_warning("Could not get atom; type %d; code %d; major %d; minor %d",
-                  error->response_type, error->error_code, error->major_code, error->minor_code);
+    g_async_queue_lock(s->cursor_queue);
+    if (s->queued_move) {
+        s->queued_move->u.position.x = x;
+        s->queued_move->u.position.y = y;
+        g_async_queue_unlock(s->cursor_queue);
         return 0;
     }
 
-    indicator_cookie = xcb_xkb_get_named_indicator(session->display.c,
-                                                   XCB_XKB_ID_USE_CORE_KBD,
-                                                   XCB_XKB_LED_CLASS_DFLT_XI_CLASS,
-                                                   XCB_XKB_ID_DFLT_XI_ID, atom_reply->atom);
-    free(atom_reply);
-
-    indicator_reply =
-        xcb_xkb_get_named_indicator_reply(session->display.c, indicator_cookie, &error);
-    if (error) {
-        g_warning("Could not get indicator; type %d; code %d; major %d; minor %d",
-                  error->response_type, error->error_code, error->major_code, error->minor_code);
-        return 0;
+    ccmd = calloc(1, sizeof(*ccmd));
+    if (!ccmd) {
+        g_async_queue_unlock(s->cursor_queue);
+        return X11SPICE_ERR_MALLOC;
     }
 
-    ret = indicator_reply->on;
-    free(indicator_reply);
-    return ret;
+    ccmd->type = QXL_CURSOR_MOVE;
+    ccmd->u.position.x = x;
+    ccmd->u.position.y = y;
+    ccmd->release_info.id = (uintptr_t) spice_create_release(&s->spice, RELEASE_MEMORY, ccmd);
+
+    g_async_queue_push_unlocked(s->cursor_queue, ccmd);
+    s->queued_move = ccmd;
+    g_async_queue_unlock(s->cursor_queue);
+    session_wakeup_spice(s);
+
+    return 0;
 }
 
-void session_disconnect_client(session_t *session)
+/* The event thread keeps the LED state current; this costs nothing */
+int session_get_leds(session_t *session)
 {
+    return g_atomic_int_get(&session->display.leds);
+}
+
+static gboolean push_leds(gpointer data)
+{
+    session_t *session = (session_t *) data;
+
+    spice_server_kbd_leds(&session->spice.keyboard_sin, session_get_leds(session));
+    return FALSE;
+}
+
+/* Called from the event thread when the LEDs change */
+void session_handle_leds(session_t *session)
+{
+    spice_invoke(&session->spice, push_leds, session);
+}
+
+static gboolean disconnect_client(gpointer data)
+{
+    session_t *session = (session_t *) data;
+
     /* TODO: This is using a side effect of set_ticket that is not intentional.
        It would be better to ask for a deliberate method of achieving this result.  */
     g_debug("client disconnect");
     spice_server_set_ticket(session->spice.server, session->options.spice_password, 0, 0, TRUE);
     if (!session->options.spice_password || session->options.disable_ticketing)
         spice_server_set_noauth(session->spice.server);
+
+    return FALSE;
+}
+
+/* Called from the gui thread */
+void session_disconnect_client(session_t *session)
+{
+    spice_invoke(&session->spice, disconnect_client, session);
 }
 
 static void invoke_on_connect(session_t *session, const char *from)
@@ -494,6 +1012,23 @@ static void invoke_on_disconnect(session_t *session)
     }
 }
 
+/* Nothing was captured while we were idle, so bring the mirror and the
+   primary up to date with a single capture of each head */
+static void resume_capture(session_t *s)
+{
+    int i;
+
+    if (!g_atomic_int_compare_and_exchange(&s->idle, TRUE, FALSE))
+        return;
+
+    g_debug("Client connected; resuming capture");
+    record_scan(RESYNC_SCAN_REQUEST, 0, 0, 0, 0);
+    g_mutex_lock(&s->scanner_lock);
+    for (i = 0; i < s->num_scanners; i++)
+        scanner_push(&s->scanners[i], RESYNC_SCAN_REQUEST, 0, 0, 0, 0);
+    g_mutex_unlock(&s->scanner_lock);
+}
+
 void session_remote_connected(const char *from)
 {
 #define GUI_FROM_PREFIX "Connection from "
@@ -502,6 +1037,7 @@ void session_remote_connected(const char *from)
         return;
 
     global_session->connected = TRUE;
+    resume_capture(global_session);
 
     from_string = calloc(1, strlen(from) + strlen(GUI_FROM_PREFIX) + 1);
     if (from_string) {
@@ -526,6 +1062,8 @@ void session_remote_disconnected(void)
         return;
 
     global_session->connected = FALSE;
+    g_atomic_int_set(&global_session->idle, TRUE);
+    g_debug("No client connected; capture is idle");
     if (global_session->options.on_disconnect)
         invoke_on_disconnect(global_session);
     gui_remote_disconnected(&global_session->gui);
@@ -27,20 +27,47 @@
 #include "agent.h"
 #include "gui.h"
 #include "scan.h"
+#include "slab.h"
+#include "ring.h"
+#include "metrics.h"
+#include "governor.h"
+
+/*----------------------------------------------------------------------------
+**  constants
+**--------------------------------------------------------------------------*/
+#define DRAW_RING_SIZE              1024
+
+/* How long a resize or teardown waits for the spice worker */
+#define FLUSH_TIMEOUT_US            G_USEC_PER_SEC
+
+#define MAX_INPUT_BATCH             64
 
 /*----------------------------------------------------------------------------
 **  Structure definitions
 **--------------------------------------------------------------------------*/
+
+/* An XTEST event waiting to be sent */
+typedef struct {
+    uint8_t type;
+    uint8_t detail;
+    int x;
+    int y;
+    gint64 queued;
+} input_event_t;
+
 typedef struct session_struct {
     options_t options;
     display_t display;
     spice_t spice;
     agent_t agent;
     gui_t gui;
-    scanner_t scanner;
+    scanner_t scanners[MAX_HEADS];
+    int num_scanners;
+    GMutex scanner_lock;        /* Held by a resize while it replaces the scanners */
     int running;
 
     int connected;
+    gint idle;                  /* Not capturing, as no client is connected */
     int connect_pid;
     int disconnect_pid;
 
@@ -48,11 +75,41 @@ typedef struct session_struct {
     int audit_id;
 #endif
 
+    /* Serializes resizes and teardown; the scanners and the spice
+       worker do not take it */
     GMutex *lock;
-    int draw_command_in_progress;
+    gint draws_blocked;
+    gint draw_command_in_progress;
+    GMutex draw_lock;
+    GCond draw_cond;
+
+    /* Commands spice has taken and not yet released */
+    gint draws_in_flight;
+    gint cursors_in_flight;
 
     GAsyncQueue *cursor_queue;
-    GAsyncQueue *draw_queue;
+    QXLCursorCmd *queued_move;  /* still in cursor_queue; guarded by its lock */
+
+    pthread_t pointer_thread;
+    int pointer_thread_started;
+
+    /* One ring per scanner carries its draw commands to the spice worker */
+    ring_t draw_rings[MAX_HEADS];
+    int next_draw_ring;
+
+    /* Only touched on the spice core thread */
+    input_event_t input_batch[MAX_INPUT_BATCH];
+    int input_count;
+    gint input_latency_max_us;  /* Read by the metrics thread */
+
+    latency_t latency;
+    metrics_server_t metrics;
+    governor_t governor;
+
+    /* Fixed size objects created for every capture come from these */
+    slab_t *drawable_slab;
+    slab_t *release_slab;
+    slab_t *report_slab;
 } session_t;
 
 /*----------------------------------------------------------------------------
@@ -63,25 +120,34 @@ void session_destroy(session_t *s);
 int session_start(session_t *s);
 void session_end(session_t *s);
 int session_alive(session_t *s);
+int session_idle(session_t *s);
+void session_wakeup_spice(session_t *s);
 
 void session_handle_resize(session_t *s);
+void session_push_scan(session_t *s, scan_type_t type, int x, int y, int w, int h);
 
 void *session_pop_draw(session_t *session);
 int session_draw_waiting(session_t *session);
 
+void session_command_released(session_t *s, int is_draw);
+void session_commands_in_flight(session_t *s, int *draws, int *cursors);
+
 void *session_pop_cursor(session_t *session);
 int session_cursor_waiting(session_t *session);
 
+void session_flush_input(session_t *s);
 void session_handle_key(session_t *session, uint8_t keycode, int is_press);
 void session_handle_mouse_position(session_t *session, int x, int y, uint32_t buttons_state);
 void session_handle_mouse_buttons(session_t *session, uint32_t buttons_state);
 void session_handle_mouse_wheel(session_t *session, int wheel_motion, uint32_t buttons_state);
 
-int session_get_one_led(session_t *session, const char *name);
+int session_get_leds(session_t *session);
+void session_handle_leds(session_t *session);
 
 int session_push_cursor_image(session_t *s,
                               int x, int y, int w, int h, int xhot, int yhot,
-                              int imglen, uint8_t *imgdata);
+                              uint64_t unique, int imglen, uint8_t *imgdata);
+int session_push_cursor_move(session_t *s, int x, int y);
 
 void session_remote_connected(const char *from);
 void session_remote_disconnected(void);
@@ -0,0 +1,324 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  slab.c
+**      A simple allocator for the small, fixed size objects we create for
+**  every capture and release.  Objects are carved out of larger chunks and
+**  recycled through free lists rather than returned to malloc.  Each thread
+**  keeps a small cache of free objects per slab; only when that cache runs
+**  dry, or grows too large, do we take the slab lock and move a batch of
+**  objects to or from the shared pool.  This suits our pattern well, where
+**  the scanner threads allocate and the spice worker thread frees.
+**--------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "slab.h"
+
+/* Objects are moved between a thread and the shared pool in batches */
+#define SLAB_BATCH                  32
+
+/* Each malloc provides this many objects */
+#define SLAB_CHUNK_OBJECTS          128
+
+/* A thread can cache objects for this many slabs at once */
+#define SLAB_THREAD_CACHES          8
+
+/* Live slabs, so a thread cache can tell if its slab still exists */
+#define SLAB_MAX_SLABS              32
+
+#define SLAB_ALIGN                  16
+#define SLAB_ROUND(n)               (((n) + SLAB_ALIGN - 1) & ~((size_t) SLAB_ALIGN - 1))
+
+typedef struct {
+    guint serial;
+    void *head;
+    int count;
+    guint64 allocs;
+    guint64 frees;
+} slab_cache_t;
+
+typedef struct {
+    slab_cache_t caches[SLAB_THREAD_CACHES];
+} slab_thread_t;
+
+static void slab_thread_exit(gpointer data);
+
+static GPrivate thread_caches = G_PRIVATE_INIT(slab_thread_exit);
+
+static GMutex registry_lock;
+static slab_t *registry[SLAB_MAX_SLABS];
+static guint next_serial = 1;
+
+/* Move up to 'count' objects from a thread cache to the slab free list,
+   along with the counts the thread has gathered.  Slab lock must be held. */
+static void slab_take_locked(slab_t *slab, slab_cache_t *c, int count)
+{
+    while (c->head && count-- > 0) {
+        void *p = c->head;
+        c->head = *(void **) p;
+        c->count--;
+        *(void **) p = slab->free_list;
+        slab->free_list = p;
+    }
+
+    slab->stats.allocs += c->allocs;
+    slab->stats.frees += c->frees;
+    c->allocs = c->frees = 0;
+}
+
+/* Hand everything in a cache back, if its slab still exists; otherwise
+   the memory is gone already, and we just forget about it */
+static void slab_flush_cache(slab_cache_t *c)
+{
+    int i;
+
+    if (!c->serial)
+        return;
+
+    g_mutex_lock(&registry_lock);
+    for (i = 0; i < SLAB_MAX_SLABS; i++) {
+        slab_t *slab = registry[i];
+        if (slab && slab->serial == c->serial) {
+            g_mutex_lock(&slab->lock);
+            slab_take_locked(slab, c, c->count);
+            slab->stats.returns++;
+            g_mutex_unlock(&slab->lock);
+            break;
+        }
+    }
+    g_mutex_unlock(&registry_lock);
+
+    memset(c, 0, sizeof(*c));
+}
+
+static void slab_thread_exit(gpointer data)
+{
+    slab_thread_t *t = (slab_thread_t *) data;
+    int i;
+
+    for (i = 0; i < SLAB_THREAD_CACHES; i++)
+        slab_flush_cache(&t->caches[i]);
+
+    g_free(t);
+}
+
+static slab_cache_t *slab_thread_cache(slab_t *slab)
+{
+    slab_thread_t *t = g_private_get(&thread_caches);
+    slab_cache_t *unused = NULL;
+    int i;
+
+    if (!t) {
+        t = g_new0(slab_thread_t, 1);
+        g_private_set(&thread_caches, t);
+    }
+
+    for (i = 0; i < SLAB_THREAD_CACHES; i++) {
+        if (t->caches[i].serial == slab->serial)
+            return &t->caches[i];
+        if (!unused && !t->caches[i].serial)
+            unused = &t->caches[i];
+    }
+
+    /* Out of slots; the first one gives way */
+    if (!unused) {
+        unused = &t->caches[0];
+        slab_flush_cache(unused);
+    }
+
+    unused->serial = slab->serial;
+    return unused;
+}
+
+/* Slab lock must be held */
+static int slab_grow_locked(slab_t *slab)
+{
+    size_t header = SLAB_ROUND(sizeof(void *));
+    char *chunk;
+    int i;
+
+    chunk = malloc(header + SLAB_CHUNK_OBJECTS * slab->size);
+    if (!chunk)
+        return 0;
+
+    *(void **) chunk = slab->chunks;
+    slab->chunks = chunk;
+
+    for (i = SLAB_CHUNK_OBJECTS - 1; i >= 0; i--) {
+        void *p = chunk + header + i * slab->size;
+        *(void **) p = slab->free_list;
+        slab->free_list = p;
+    }
+
+    slab->stats.chunks++;
+    slab->stats.objects += SLAB_CHUNK_OBJECTS;
+    return 1;
+}
+
+static void slab_refill(slab_t *slab, slab_cache_t *c)
+{
+    int i;
+
+    g_mutex_lock(&slab->lock);
+
+    slab->stats.allocs += c->allocs;
+    slab->stats.frees += c->frees;
+    c->allocs = c->frees = 0;
+
+    if (slab->free_list || slab_grow_locked(slab)) {
+        for (i = 0; i < SLAB_BATCH && slab->free_list; i++) {
+            void *p = slab->free_list;
+            slab->free_list = *(void **) p;
+            *(void **) p = c->head;
+            c->head = p;
+            c->count++;
+        }
+        slab->stats.refills++;
+    }
+
+    g_mutex_unlock(&slab->lock);
+}
+
+slab_t *slab_create(const char *name, size_t size)
+{
+    slab_t *slab;
+    int i;
+
+    slab = calloc(1, sizeof(*slab));
+    if (!slab)
+        return NULL;
+
+    slab->name = name;
+    slab->size = SLAB_ROUND(MAX(size, sizeof(void *)));
+    g_mutex_init(&slab->lock);
+
+    g_mutex_lock(&registry_lock);
+    for (i = 0; i < SLAB_MAX_SLABS; i++)
+        if (!registry[i])
+            break;
+    if (i < SLAB_MAX_SLABS) {
+        slab->serial = next_serial++;
+        registry[i] = slab;
+    }
+    g_mutex_unlock(&registry_lock);
+
+    if (i == SLAB_MAX_SLABS) {
+        g_warning("Too many slabs; cannot create %s", name);
+        g_mutex_clear(&slab->lock);
+        free(slab);
+        return NULL;
+    }
+
+    return slab;
+}
+
+/* Any objects still cached by other threads are simply abandoned; callers
+   must only do this once they are done with the slab. */
+void slab_destroy(slab_t *slab)
+{
+    void *chunk;
+    int i;
+
+    if (!slab)
+        return;
+
+    g_mutex_lock(&registry_lock);
+    for (i = 0; i < SLAB_MAX_SLABS; i++)
+        if (registry[i] == slab)
+            registry[i] = NULL;
+    g_mutex_unlock(&registry_lock);
+
+    while ((chunk = slab->chunks)) {
+        slab->chunks = *(void **) chunk;
+        free(chunk);
+    }
+
+    g_mutex_clear(&slab->lock);
+    free(slab);
+}
+
+/* Returns a zeroed object, or NULL if we are out of memory */
+void *slab_alloc(slab_t *slab)
+{
+    slab_cache_t *c = slab_thread_cache(slab);
+    void *p;
+
+    if (!c->head)
+        slab_refill(slab, c);
+
+    p = c->head;
+    if (!p)
+        return NULL;
+
+    c->head = *(void **) p;
+    c->count--;
+    c->allocs++;
+
+    memset(p, 0, slab->size);
+    return p;
+}
+
+void slab_free(slab_t *slab, void *p)
+{
+    slab_cache_t *c;
+
+    if (!p)
+        return;
+
+    c = slab_thread_cache(slab);
+    *(void **) p = c->head;
+    c->head = p;
+    c->count++;
+    c->frees++;
+
+    /* A thread that only frees would otherwise hoard everything */
+    if (c->count >= 2 * SLAB_BATCH) {
+        g_mutex_lock(&slab->lock);
+        slab_take_locked(slab, c, SLAB_BATCH);
+        slab->stats.returns++;
+        g_mutex_unlock(&slab->lock);
+    }
+}
+
+/* The counts lag by whatever the threads have not yet handed back */
+void slab_get_stats(slab_t *slab, slab_stats_t *stats)
+{
+    g_mutex_lock(&slab->lock);
+    *stats = slab->stats;
+    g_mutex_unlock(&slab->lock);
+}
+
+void slab_log_stats(slab_t *slab)
+{
+    slab_stats_t stats;
+
+    if (!slab)
+        return;
+
+    slab_get_stats(slab, &stats);
+    g_debug("slab %s: %" G_GUINT64_FORMAT " allocs, %" G_GUINT64_FORMAT " frees, %"
+            G_GUINT64_FORMAT " refills, %" G_GUINT64_FORMAT " returns, %" G_GUINT64_FORMAT
+            " objects in %" G_GUINT64_FORMAT " chunks", slab->name, stats.allocs, stats.frees,
+            stats.refills, stats.returns, stats.objects, stats.chunks);
+}
@@ -0,0 +1,61 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <glib.h>
+
+/*----------------------------------------------------------------------------
+**  Structure definitions
+**--------------------------------------------------------------------------*/
+typedef struct {
+    guint64 allocs;
+    guint64 frees;
+    guint64 refills;            /* Batches handed from the shared pool to a thread */
+    guint64 returns;            /* Batches handed back by a thread */
+    guint64 chunks;             /* Calls to malloc */
+    guint64 objects;            /* Objects carved out of those chunks */
+} slab_stats_t;
+
+typedef struct slab_struct {
+    const char *name;
+    size_t size;
+    guint serial;
+
+    GMutex lock;
+    void *free_list;
+    void *chunks;
+    slab_stats_t stats;
+} slab_t;
+
+/*----------------------------------------------------------------------------
+**  Prototypes
+**--------------------------------------------------------------------------*/
+slab_t *slab_create(const char *name, size_t size);
+void slab_destroy(slab_t *slab);
+
+void *slab_alloc(slab_t *slab);
+void slab_free(slab_t *slab, void *p);
+
+void slab_get_stats(slab_t *slab, slab_stats_t *stats);
+void slab_log_stats(slab_t *slab);
+
+#endif
@@ -42,138 +42,7 @@
 #include "display.h"
 #include "session.h"
 #include "listen.h"
-
-struct SpiceTimer {
-    SpiceTimerFunc func;
-    void *opaque;
-    GSource *source;
-};
-
-static SpiceTimer *timer_add(SpiceTimerFunc func, void *opaque)
-{
-    SpiceTimer *timer = (SpiceTimer *) calloc(1, sizeof(SpiceTimer));
-
-    timer->func = func;
-    timer->opaque = opaque;
-
-    return timer;
-}
-
-static gboolean timer_func(gpointer user_data)
-{
-    SpiceTimer *timer = user_data;
-
-    timer->func(timer->opaque);
-    /* timer might be free after func(), don't touch */
-
-    return FALSE;
-}
-
-static void timer_cancel(SpiceTimer *timer)
-{
-    if (timer->source) {
-        g_source_destroy(timer->source);
-        g_source_unref(timer->source);
-        timer->source = NULL;
-    }
-}
-
-static void timer_start(SpiceTimer *timer, uint32_t ms)
-{
-    timer_cancel(timer);
-
-    timer->source = g_timeout_source_new(ms);
-
-    g_source_set_callback(timer->source, timer_func, timer, NULL);
-
-    g_source_attach(timer->source, g_main_context_default());
-
-}
-
-static void timer_remove(SpiceTimer *timer)
-{
-    timer_cancel(timer);
-    free(timer);
-}
-
-struct SpiceWatch {
-    void *opaque;
-    GSource *source;
-    GIOChannel *channel;
-    SpiceWatchFunc func;
-};
-
-static GIOCondition spice_event_to_giocondition(int event_mask)
-{
-    GIOCondition condition = 0;
-
-    if (event_mask & SPICE_WATCH_EVENT_READ)
-        condition |= G_IO_IN;
-    if (event_mask & SPICE_WATCH_EVENT_WRITE)
-        condition |= G_IO_OUT;
-
-    return condition;
-}
-
-static int giocondition_to_spice_event(GIOCondition condition)
-{
-    int event = 0;
-
-    if (condition & G_IO_IN)
-        event |= SPICE_WATCH_EVENT_READ;
-    if (condition & G_IO_OUT)
-        event |= SPICE_WATCH_EVENT_WRITE;
-
-    return event;
-}
-
-static gboolean watch_func(GIOChannel *source, GIOCondition condition, gpointer data)
-{
-    SpiceWatch *watch = data;
-    int fd = g_io_channel_unix_get_fd(source);
-
-    watch->func(fd, giocondition_to_spice_event(condition), watch->opaque);
-
-    return TRUE;
-}
-
-static void watch_update_mask(SpiceWatch *watch, int event_mask)
-{
-    if (watch->source) {
-        g_source_destroy(watch->source);
-        g_source_unref(watch->source);
-        watch->source = NULL;
-    }
-
-    if (!event_mask)
-        return;
-
-    watch->source = g_io_create_watch(watch->channel, spice_event_to_giocondition(event_mask));
-    g_source_set_callback(watch->source, (GSourceFunc) watch_func, watch, NULL);
-    g_source_attach(watch->source, g_main_context_default());
-}
-
-static SpiceWatch *watch_add(int fd, int event_mask, SpiceWatchFunc func, void *opaque)
-{
-    SpiceWatch *watch;
-
-    watch = calloc(1, sizeof(SpiceWatch));
-    watch->channel = g_io_channel_unix_new(fd);
-    watch->func = func;
-    watch->opaque = opaque;
-
-    watch_update_mask(watch, event_mask);
-
-    return watch;
-}
-
-static void watch_remove(SpiceWatch *watch)
-{
-    watch_update_mask(watch, 0);
-
-    g_io_channel_unref(watch->channel);
-    free(watch);
-}
+#include "trace.h"
 
 static void channel_event(int event, SpiceChannelEventInfo *info)
 {
@@ -223,7 +92,10 @@ static void attach_worker(QXLInstance *qin, QXLWorker *qxl_worker G_GNUC_UNUSED)
 static void set_compression_level(QXLInstance *qin, int level)
 {
     spice_t *s = SPICE_CONTAINEROF(qin, spice_t, display_sin);
-    // TODO - set_compression_level is unused
+
+    /* The server only ever passes its own default here, never what a
+       client prefers, so there is nothing for us to act on */
+    g_debug("compression level %d", level);
     s->compression_level = level;
 }
 
@@ -240,9 +112,8 @@ static void get_init_info(QXLInstance *qin G_GNUC_UNUSED, QXLDevInitInfo *info)
     info->num_memslots_groups = 1;
     info->memslot_id_bits = 1;
     info->memslot_gen_bits = 1;
+    /* Multiple monitors are heads on the single primary surface */
     info->n_surfaces = 1;
-
-    /* TODO - it would be useful to think through surface count a bit here */
 }
 
 
@@ -251,6 +122,7 @@ static int get_command(QXLInstance *qin, struct QXLCommandExt *cmd)
     spice_t *s = SPICE_CONTAINEROF(qin, spice_t, display_sin);
     QXLDrawable *drawable;
 
+    trace_thread_name("spice worker");
     drawable = session_pop_draw(s->session);
     if (!drawable)
         return 0;
@@ -274,9 +146,21 @@ static int req_cmd_notification(QXLInstance *qin)
     return 1;
 }
 
-static void release_resource(QXLInstance *qin G_GNUC_UNUSED, struct QXLReleaseInfoExt release_info)
+static void release_resource(QXLInstance *qin, struct QXLReleaseInfoExt release_info)
 {
-    spice_free_release((spice_release_t *) (uintptr_t) release_info.info->id);
+    spice_t *s = SPICE_CONTAINEROF(qin, spice_t, display_sin);
+    spice_release_t *r = (spice_release_t *) (uintptr_t) release_info.info->id;
+
+    /* Cursor commands are the only ones we release as plain memory */
+    if (r) {
+        trace_instant(TRACE_RELEASE, r->type);
+        session_command_released(s->session, r->type != RELEASE_MEMORY);
+        if (r->stamps.at[LATENCY_POPPED]) {
+            r->stamps.at[LATENCY_RELEASED] = g_get_monotonic_time();
+            latency_record_stamps(&s->session->latency, &r->stamps);
+        }
+    }
+    spice_free_release(r);
 }
 
 static int get_cursor_command(QXLInstance *qin, struct QXLCommandExt *cmd)
@@ -393,16 +277,8 @@ static void kbd_push_key(SpiceKbdInstance *sin, uint8_t frag)
 static uint8_t kbd_get_leds(SpiceKbdInstance *sin)
 {
     spice_t *s = SPICE_CONTAINEROF(sin, spice_t, keyboard_sin);
-    uint8_t ret = 0;
-
-    if (session_get_one_led(s->session, "Caps Lock"))
-        ret |= SPICE_KEYBOARD_MODIFIER_FLAGS_CAPS_LOCK;
-    if (session_get_one_led(s->session, "Scroll Lock"))
-        ret |= SPICE_KEYBOARD_MODIFIER_FLAGS_SCROLL_LOCK;
-    if (session_get_one_led(s->session, "Num Lock"))
-        ret |= SPICE_KEYBOARD_MODIFIER_FLAGS_NUM_LOCK;
 
-    return ret;
+    return session_get_leds(s->session);
 }
 
 void tablet_set_logical_size(SpiceTabletInstance *tablet G_GNUC_UNUSED, int width, int height)
@@ -428,28 +304,37 @@ void tablet_buttons(SpiceTabletInstance *tablet, uint32_t buttons_state)
     session_handle_mouse_buttons(s->session, buttons_state);
 }
 
-static int send_monitors_config(spice_t *s, int w, int h)
+/* Every head is a window onto the one primary surface, which
+   covers the whole X screen */
+int spice_send_monitors_config(spice_t *s, int num_heads, head_t *heads)
 {
     spice_release_t *release;
+    int i;
 
-    QXLMonitorsConfig *monitors = calloc(1, sizeof(QXLMonitorsConfig) + sizeof(QXLHead));
+    QXLMonitorsConfig *monitors = calloc(1, sizeof(QXLMonitorsConfig) +
+                                         num_heads * sizeof(QXLHead));
     if (!monitors)
         return X11SPICE_ERR_MALLOC;
     release = spice_create_release(s, RELEASE_MEMORY, monitors);
 
-    monitors->count = 1;
-    monitors->max_allowed = 1;
-    monitors->heads[0].id = 0;
-    monitors->heads[0].surface_id = 0;
-    monitors->heads[0].width = w;
-    monitors->heads[0].height = h;
+    monitors->count = num_heads;
+    monitors->max_allowed = MAX_HEADS;
+    for (i = 0; i < num_heads; i++) {
+        monitors->heads[i].id = i;
+        monitors->heads[i].surface_id = 0;
+        monitors->heads[i].x = heads[i].x;
+        monitors->heads[i].y = heads[i].y;
+        monitors->heads[i].width = heads[i].w;
+        monitors->heads[i].height = heads[i].h;
+    }
 
     spice_qxl_monitors_config_async(&s->display_sin, (uintptr_t) monitors, 0, (uintptr_t) release);
 
     return 0;
 }
 
-int spice_create_primary(spice_t *s, int w, int h, int bytes_per_line, void *shmaddr)
+int spice_create_primary(spice_t *s, int w, int h, int bytes_per_line, void *shmaddr,
+                         int keep_data)
 {
     QXLDevSurfaceCreate surface = { };
 
@@ -458,7 +343,9 @@ int spice_create_primary(spice_t *s, int w, int h, int bytes_per_line, void *shm
 
     surface.stride = -1 * bytes_per_line;
     surface.type = QXL_SURF_TYPE_PRIMARY;
-    surface.flags = 0;
+    /* With KEEP_DATA, spice sends the surface as it stands to the
+       client, instead of treating it as blank */
+    surface.flags = keep_data ? QXL_SURF_FLAG_KEEP_DATA : 0;
     surface.group_id = 0;
     surface.mouse_mode = TRUE;
 
@@ -474,7 +361,7 @@ int spice_create_primary(spice_t *s, int w, int h, int bytes_per_line, void *shm
 
     spice_qxl_create_primary_surface(&s->display_sin, 0, &surface);
 
-    return send_monitors_config(s, w, h);
+    return 0;
 }
 
 void spice_destroy_primary(spice_t *s)
@@ -486,21 +373,6 @@ void initialize_spice_instance(spice_t *s)
 {
     static int id = 0;
 
-    static SpiceCoreInterface core = {
-        .base = {
-                 .major_version = SPICE_INTERFACE_CORE_MAJOR,
-                 .minor_version = SPICE_INTERFACE_CORE_MINOR,
-                 },
-        .timer_add = timer_add,
-        .timer_start = timer_start,
-        .timer_cancel = timer_cancel,
-        .timer_remove = timer_remove,
-        .watch_add = watch_add,
-        .watch_update_mask = watch_update_mask,
-        .watch_remove = watch_remove,
-        .channel_event = channel_event
-    };
-
     static const QXLInterface display_sif = {
         .base = {
                  .type = SPICE_INTERFACE_QXL,
@@ -548,7 +420,8 @@ void initialize_spice_instance(spice_t *s)
         .buttons = tablet_buttons,
     };
 
-    s->core = &core;
+    s->core = &s->core_loop.iface;
+    s->core->channel_event = channel_event;
     s->display_sin.base.sif = &display_sif.base;
     s->display_sin.id = id++;
 
@@ -570,6 +443,13 @@ static void set_options(spice_t *s, options_t *options)
 
     if (options->full_screen_fps > 0)
         spice_server_set_streaming_video(s->server, SPICE_STREAM_VIDEO_ALL);
+    else if (options->streaming_video == STREAMING_OFF)
+        spice_server_set_streaming_video(s->server, SPICE_STREAM_VIDEO_OFF);
+    else if (options->streaming_video == STREAMING_ALL)
+        spice_server_set_streaming_video(s->server, SPICE_STREAM_VIDEO_ALL);
+    else if (options->streaming_video == STREAMING_FILTER ||
+             options->streaming_video == STREAMING_DETECT)
+        spice_server_set_streaming_video(s->server, SPICE_STREAM_VIDEO_FILTER);
 
     spice_server_set_exit_on_disconnect(s->server, options->exit_on_disconnect);
 
@@ -619,12 +499,34 @@ static int try_listen(spice_t *s, options_t *options)
     return 0;
 }
 
+/* Run func on the spice core thread; this is how other threads must
+   call into the spice server, apart from the thread safe qxl calls */
+void spice_invoke(spice_t *s, GSourceFunc func, gpointer data)
+{
+    core_invoke(&s->core_loop, func, data);
+}
+
+/* Input handlers queue their XTEST events; send them before we sleep */
+static void flush_input(void *data)
+{
+    spice_t *s = (spice_t *) data;
+
+    trace_thread_name("spice core");
+    if (s->session && session_alive(s->session))
+        session_flush_input(s->session);
+}
+
 int spice_start(spice_t *s, options_t *options, shm_image_t *primary)
 {
     int rc;
 
     memset(s, 0, sizeof(*s));
 
+    rc = core_create(&s->core_loop, options->core_backend);
+    if (rc)
+        return rc;
+    core_set_flush_func(&s->core_loop, flush_input, s);
+
     s->server = spice_server_new();
     if (!s->server)
         return X11SPICE_ERR_SPICE_INIT_FAILED;
@@ -662,16 +564,31 @@ int spice_start(spice_t *s, options_t *options, shm_image_t *primary)
         return X11SPICE_ERR_SPICE_INIT_FAILED;
     }
 
+    spice_qxl_set_max_monitors(&s->display_sin, MAX_HEADS);
+
     spice_server_vm_start(s->server);
 
-    rc = spice_create_primary(s, primary->w, primary->h,
-                              primary->bytes_per_line, primary->segment.shmaddr);
+    return spice_create_primary(s, primary->w, primary->h,
+                                primary->bytes_per_line, primary->segment.shmaddr, FALSE);
+}
+
+/* From here on, the spice server belongs to the core thread; everything
+   a client can reach, session and agent included, must be set up first */
+int spice_start_core(spice_t *s)
+{
+    return core_start(&s->core_loop);
+}
 
-    return rc;
+/* After this, the spice server may be used from the calling thread */
+void spice_stop_core(spice_t *s)
+{
+    core_stop(&s->core_loop);
 }
 
 void spice_end(spice_t *s)
 {
+    spice_stop_core(s);
+
     spice_server_remove_interface(&s->tablet_sin.base);
     spice_server_remove_interface(&s->keyboard_sin.base);
 
@@ -680,15 +597,17 @@ void spice_end(spice_t *s)
 
     spice_server_destroy(s->server);
 
+    core_destroy(&s->core_loop);
 }
 
 spice_release_t *spice_create_release(spice_t *s, release_type_t type, void *data)
 {
-    spice_release_t *r = malloc(sizeof(*r));
+    spice_release_t *r = slab_alloc(s->session->release_slab);
     if (r) {
         r->s = s;
         r->type = type;
         r->data = data;
+        memset(&r->stamps, 0, sizeof(r->stamps));
     }
 
     return r;
@@ -696,18 +615,30 @@ spice_release_t *spice_create_release(spice_t *s, release_type_t type, void *dat
 
 void spice_free_release(spice_release_t *r)
 {
+    session_t *session;
+    shm_image_t *shmi;
+
     if (!r)
         return;
 
+    session = r->s->session;
+
     switch (r->type) {
     case RELEASE_SHMI:
-        destroy_shm_image(&r->s->session->display, (shm_image_t *) r->data);
+        shmi = (shm_image_t *) r->data;
+        slab_free(session->drawable_slab, shmi->drawable_ptr);
+        shmi->drawable_ptr = NULL;
+        destroy_shm_image(&session->display, shmi);
         break;
 
     case RELEASE_MEMORY:
         free(r->data);
         break;
+
+    case RELEASE_DRAWABLE:
+        slab_free(session->drawable_slab, r->data);
+        break;
     }
 
-    free(r);
+    slab_free(session->release_slab, r);
 }
@@ -0,0 +1,523 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  bench.c
+**      End to end benchmarks.  These run only in perf mode (-m perf);
+**  each one starts x11spice on a dummy X server, with a spice client on a
+**  second one, runs a workload for a fixed time and compares the x11spice
+**  metrics from before and after it.  x11spice captures nothing while no
+**  client is connected, so workloads are skipped if spicy is not available.
+**
+**  A frame here is a drawable pushed to spice.  Results are appended to
+**  run/bench.json (or $X11SPICE_BENCH_OUT), one JSON object per line.  If
+**  $X11SPICE_BENCH_BASELINE names an earlier results file, a workload
+**  fails if it has become worse than its baseline by more than
+**  $X11SPICE_BENCH_TOLERANCE percent.
+**
+**  The latency workload uses spice_latency, when it is built, as the
+**  client; it adds its own result line, for frames as the client saw them.
+**--------------------------------------------------------------------------*/
+
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "xdummy.h"
+
+#include "tests.h"
+#include "util.h"
+#include "xcbtest.h"
+#include "x11spice_test.h"
+
+#define BENCH_DEFAULT_SECONDS       10
+#define BENCH_DEFAULT_TOLERANCE     20
+
+/* Time for x11spice to settle after start, and to catch up after a workload */
+#define BENCH_SETTLE_USEC           (2 * G_USEC_PER_SEC)
+#define BENCH_DRAIN_USEC            (G_USEC_PER_SEC / 2)
+
+#define VIDEO_WIDTH                 640
+#define VIDEO_HEIGHT                360
+#define VIDEO_FPS                   30
+#define TYPING_CPS                  15
+
+typedef struct {
+    const char *name;
+    const char *command;        /* A program to run, with display and seconds */
+    int (*run)(const char *display, int seconds);
+    int client;                 /* Runs spice_latency, which is its own client */
+} bench_workload_t;
+
+typedef struct {
+    double cpu_seconds;
+    double frames;
+    double bytes_pushed;
+    double bytes_captured;
+    double capture_p50_us;
+    double capture_p99_us;
+    double update_p99_us;
+} bench_sample_t;
+
+typedef struct {
+    xdummy_t xserver;
+    int pid;
+} bench_client_t;
+
+static int play_video(const char *display, int seconds)
+{
+    return xcbtest_play_video(display, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_FPS, seconds);
+}
+
+static int type_text(const char *display, int seconds)
+{
+    return xcbtest_type_text(display, TYPING_CPS, seconds);
+}
+
+static const bench_workload_t workloads[] = {
+    {"bench_scroll", "x11perf -display %s -time %d -repeat 1 -scroll500", NULL},
+    {"bench_copy", "x11perf -display %s -time %d -repeat 1 -copywinwin500 -copypixwin500", NULL},
+    {"bench_video", NULL, play_video},
+    {"bench_typing", NULL, type_text},
+    {"bench_latency", NULL, NULL, TRUE},
+};
+
+static int env_int(const char *name, int def)
+{
+    char *p = getenv(name);
+
+    return p && *p ? atoi(p) : def;
+}
+
+static int have_program(const char *name)
+{
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "which %s >/dev/null 2>&1", name);
+    return system(buf) == 0;
+}
+
+static gchar *results_path(void)
+{
+    char *env = getenv("X11SPICE_BENCH_OUT");
+
+    if (env && *env)
+        return g_strdup(env);
+    return g_test_build_filename(G_TEST_BUILT, "run", "bench.json", NULL);
+}
+
+static char *fetch_metrics(const char *path)
+{
+    struct sockaddr_un addr;
+    GString *out;
+    char buf[4096];
+    ssize_t len;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return NULL;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        close(fd);
+        return NULL;
+    }
+
+    out = g_string_new(NULL);
+    while ((len = read(fd, buf, sizeof(buf))) != 0) {
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0)
+            break;
+        g_string_append_len(out, buf, len);
+    }
+    close(fd);
+
+    return g_string_free(out, FALSE);
+}
+
+static double metric_value(const char *text, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p;
+
+    for (p = text; p && *p; p = strchr(p, '\n') ? strchr(p, '\n') + 1 : NULL)
+        if (strncmp(p, name, len) == 0 && p[len] == ' ')
+            return g_ascii_strtod(p + len + 1, NULL);
+
+    return 0;
+}
+
+/* User plus system time, from /proc/pid/stat */
+static double cpu_seconds(int pid)
+{
+    unsigned long utime = 0;
+    unsigned long stime = 0;
+    gchar *path;
+    gchar *contents = NULL;
+    char *p;
+
+    path = g_strdup_printf("/proc/%d/stat", pid);
+    if (g_file_get_contents(path, &contents, NULL, NULL) && (p = strrchr(contents, ')')))
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    g_free(contents);
+    g_free(path);
+
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static int take_sample(x11spice_server_t *server, const char *socket_path,
+                       bench_sample_t *sample)
+{
+    char *text = fetch_metrics(socket_path);
+
+    if (!text) {
+        g_warning("Could not read metrics from %s", socket_path);
+        return -1;
+    }
+
+    sample->cpu_seconds = cpu_seconds(server->pid);
+    sample->frames = metric_value(text, "drawables_queued_total");
+    sample->bytes_pushed = metric_value(text, "bytes_pushed_total");
+    sample->bytes_captured = metric_value(text, "bytes_captured_total");
+    sample->capture_p50_us = metric_value(text, "capture_latency_us{quantile=\"0.5\"}");
+    sample->capture_p99_us = metric_value(text, "capture_latency_us{quantile=\"0.99\"}");
+    sample->update_p99_us = metric_value(text, "update_latency_us{quantile=\"0.99\"}");
+    g_free(text);
+
+    return 0;
+}
+
+static int start_client(bench_client_t *client, x11spice_server_t *server, const char *name)
+{
+    char buf[4096];
+    gchar *client_name;
+    gchar *out;
+
+    client->pid = 0;
+    client->xserver.running = FALSE;
+    if (!have_program("spicy")) {
+        g_message("spicy not available");
+        return -1;
+    }
+
+    client_name = g_strdup_printf("client_%s", name);
+    start_server(&client->xserver, client_name);
+    g_free(client_name);
+    if (!client->xserver.running) {
+        g_message("Could not start client X server");
+        return -1;
+    }
+
+    snprintf(buf, sizeof(buf), "spicy --display :%s --uri=%s%s", client->xserver.display,
+             strncmp(server->uri, "spice://", 8) ? "spice://" : "", server->uri);
+    out = g_test_build_filename(G_TEST_BUILT, "run", name, "spicy.out", NULL);
+    if (spawn_command(buf, out, &client->pid))
+        client->pid = 0;
+    g_free(out);
+    return client->pid > 0 ? 0 : -1;
+}
+
+static void stop_client(bench_client_t *client)
+{
+    if (client->pid > 0 && still_alive(client->pid)) {
+        kill(client->pid, SIGTERM);
+        waitpid(client->pid, NULL, 0);
+    }
+
+    if (client->xserver.running)
+        stop_server(&client->xserver, "client_server");
+}
+
+static double json_number(const char *line, const char *field)
+{
+    gchar *key = g_strdup_printf("\"%s\":", field);
+    const char *p = strstr(line, key);
+    double value = p ? g_ascii_strtod(p + strlen(key), NULL) : 0;
+
+    g_free(key);
+    return value;
+}
+
+/* spice_latency stops by itself; we keep the JSON line it writes */
+static int run_client(const bench_workload_t *w, x11spice_server_t *server,
+                      const char *display, int seconds)
+{
+    char buf[4096];
+    gchar *program;
+    gchar *out;
+    gchar *contents = NULL;
+    gchar *path;
+    gchar **lines;
+    FILE *fp;
+    int pid;
+    int rc;
+    int i;
+
+    program = g_test_build_filename(G_TEST_BUILT, "spice_latency", NULL);
+    snprintf(buf, sizeof(buf), "%s %s%s %s %d", program,
+             strncmp(server->uri, "spice://", 8) ? "spice://" : "", server->uri, display, seconds);
+    g_free(program);
+
+    out = g_test_build_filename(G_TEST_BUILT, "run", w->name, "workload.out", NULL);
+    rc = spawn_command(buf, out, &pid);
+    if (rc == 0) {
+        waitpid(pid, &rc, 0);
+        if (!WIFEXITED(rc) || WEXITSTATUS(rc))
+            g_warning("spice_latency failed; see %s", out);
+    }
+
+    path = results_path();
+    fp = fopen(path, "a");
+    if (fp && g_file_get_contents(out, &contents, NULL, NULL)) {
+        lines = g_strsplit(contents, "\n", -1);
+        for (i = 0; lines[i]; i++)
+            if (lines[i][0] == '{') {
+                fprintf(fp, "%s\n", lines[i]);
+                g_test_minimized_result(json_number(lines[i], "latency_p99_us"),
+                                        "%s: %.0f us p99 damage to client latency", w->name,
+                                        json_number(lines[i], "latency_p99_us"));
+            }
+        g_strfreev(lines);
+    }
+    if (fp)
+        fclose(fp);
+    g_free(contents);
+    g_free(path);
+    g_free(out);
+
+    return rc;
+}
+
+static int run_workload(const bench_workload_t *w, x11spice_server_t *server,
+                        const char *display, int seconds)
+{
+    char buf[4096];
+    gchar *out;
+    int pid;
+    int rc;
+
+    if (w->client)
+        return run_client(w, server, display, seconds);
+
+    if (w->run)
+        return w->run(display, seconds);
+
+    snprintf(buf, sizeof(buf), w->command, display, seconds);
+    out = g_test_build_filename(G_TEST_BUILT, "run", w->name, "workload.out", NULL);
+    rc = spawn_command(buf, out, &pid);
+    g_free(out);
+    if (rc)
+        return rc;
+
+    /* x11perf would run on past our time; it is stopped once we have our sample */
+    g_usleep((gulong) seconds * G_USEC_PER_SEC);
+    if (still_alive(pid))
+        kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    return 0;
+}
+
+static void write_result(const char *name, double seconds, bench_sample_t *before,
+                         bench_sample_t *after)
+{
+    double frames = after->frames - before->frames;
+    double cpu = after->cpu_seconds - before->cpu_seconds;
+    gchar *path = results_path();
+    FILE *fp;
+
+    fp = fopen(path, "a");
+    if (!fp) {
+        g_warning("Could not open %s", path);
+        g_test_fail();
+        g_free(path);
+        return;
+    }
+
+    fprintf(fp, "{\"workload\":\"%s\",\"seconds\":%.3f,\"frames\":%.0f,\"fps\":%.2f,"
+            "\"bytes_pushed\":%.0f,\"bytes_captured\":%.0f,\"cpu_ms_per_frame\":%.3f,"
+            "\"capture_p50_us\":%.0f,\"capture_p99_us\":%.0f,\"update_p99_us\":%.0f}\n",
+            name, seconds, frames, frames / seconds,
+            after->bytes_pushed - before->bytes_pushed,
+            after->bytes_captured - before->bytes_captured,
+            frames > 0 ? cpu * 1000.0 / frames : 0.0,
+            after->capture_p50_us, after->capture_p99_us, after->update_p99_us);
+    fclose(fp);
+    g_free(path);
+
+    g_test_maximized_result(frames / seconds, "%s: %.2f frames per second", name,
+                            frames / seconds);
+    if (frames > 0)
+        g_test_minimized_result(cpu * 1000.0 / frames, "%s: %.3f ms cpu per frame", name,
+                                cpu * 1000.0 / frames);
+}
+
+/* Compare 'field' in the two results; 'higher' says if a higher value is better */
+static void check_field(const char *name, const char *baseline, const char *result,
+                        const char *field, int higher, int tolerance)
+{
+    double was = json_number(baseline, field);
+    double now = json_number(result, field);
+
+    if (was <= 0)
+        return;
+
+    if ((higher && now < was * (100 - tolerance) / 100) ||
+        (!higher && now > was * (100 + tolerance) / 100)) {
+        g_warning("%s: %s is %.3f; the baseline is %.3f", name, field, now, was);
+        g_test_fail();
+    }
+}
+
+static void check_baseline(const char *name)
+{
+    char *baseline = getenv("X11SPICE_BENCH_BASELINE");
+    int tolerance = env_int("X11SPICE_BENCH_TOLERANCE", BENCH_DEFAULT_TOLERANCE);
+    gchar *key = g_strdup_printf("\"workload\":\"%s\"", name);
+    gchar *path;
+    gchar *was = NULL;
+    gchar *now = NULL;
+    gchar **lines;
+    int i;
+
+    if (!baseline || !*baseline) {
+        g_free(key);
+        return;
+    }
+
+    /* The last result for this workload in each file is the one we want */
+    path = results_path();
+    if (g_file_get_contents(baseline, &was, NULL, NULL) &&
+        g_file_get_contents(path, &now, NULL, NULL)) {
+        const char *was_line = NULL;
+        const char *now_line = NULL;
+
+        lines = g_strsplit(was, "\n", -1);
+        for (i = 0; lines[i]; i++)
+            if (strstr(lines[i], key))
+                was_line = lines[i];
+        if (was_line) {
+            gchar **now_lines = g_strsplit(now, "\n", -1);
+            for (i = 0; now_lines[i]; i++)
+                if (strstr(now_lines[i], key))
+                    now_line = now_lines[i];
+            if (now_line) {
+                check_field(name, was_line, now_line, "fps", TRUE, tolerance);
+                check_field(name, was_line, now_line, "cpu_ms_per_frame", FALSE, tolerance);
+                check_field(name, was_line, now_line, "capture_p99_us", FALSE, tolerance);
+                check_field(name, was_line, now_line, "latency_p99_us", FALSE, tolerance);
+            }
+            g_strfreev(now_lines);
+        } else
+            g_message("%s has no baseline for %s", baseline, name);
+        g_strfreev(lines);
+    } else {
+        g_warning("Could not read the baseline %s or the results %s", baseline, path);
+        g_test_fail();
+    }
+
+    g_free(was);
+    g_free(now);
+    g_free(path);
+    g_free(key);
+}
+
+void test_bench(xdummy_t *xdummy, gconstpointer user_data)
+{
+    test_t test = { };
+    x11spice_server_t server;
+    bench_client_t client;
+    bench_sample_t before, after;
+    const bench_workload_t *w = NULL;
+    int seconds = env_int("X11SPICE_BENCH_SECONDS", BENCH_DEFAULT_SECONDS);
+    char display[64];
+    gint64 start;
+    gint64 elapsed;
+    gchar *socket_path;
+    int rc;
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(workloads); i++)
+        if (strcmp(workloads[i].name, user_data) == 0)
+            w = &workloads[i];
+    if (!w) {
+        g_warning("No workload named %s", (char *) user_data);
+        g_test_fail();
+        return;
+    }
+
+    if (w->command && !have_program("x11perf")) {
+        g_test_skip("x11perf not available");
+        return;
+    }
+
+    socket_path = g_strdup_printf("%s/x11spice-bench-%d.sock", g_get_tmp_dir(), getpid());
+    test.metrics_socket = socket_path;
+    rc = test_common_start(&test, &server, xdummy, user_data);
+    if (rc) {
+        g_free(socket_path);
+        return;
+    }
+
+    memset(&client, 0, sizeof(client));
+    if (!w->client && start_client(&client, &server, user_data)) {
+        stop_client(&client);
+        test_common_stop(&test, &server);
+        unlink(socket_path);
+        g_free(socket_path);
+        g_test_skip("No spice client; x11spice would be idle");
+        return;
+    }
+    g_usleep(BENCH_SETTLE_USEC);
+
+    snprintf(display, sizeof(display), ":%s", xdummy->display);
+    if (take_sample(&server, socket_path, &before) == 0) {
+        g_message("Running workload %s for %d seconds", w->name, seconds);
+        start = g_get_monotonic_time();
+        rc = run_workload(w, &server, display, seconds);
+        elapsed = g_get_monotonic_time() - start;
+        g_usleep(BENCH_DRAIN_USEC);
+
+        if (rc) {
+            g_warning("Workload %s failed", w->name);
+            g_test_fail();
+        } else if (take_sample(&server, socket_path, &after) == 0) {
+            write_result(w->name, (double) elapsed / G_USEC_PER_SEC, &before, &after);
+            check_baseline(w->name);
+            if (w->client)
+                check_baseline("spice_latency");
+        } else
+            g_test_fail();
+    } else
+        g_test_fail();
+
+    stop_client(&client);
+    test_common_stop(&test, &server);
+    unlink(socket_path);
+    g_free(socket_path);
+}
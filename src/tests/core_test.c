@@ -0,0 +1,130 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include "core.h"
+
+/* Send TOTAL_BYTES through a socket pair in MESSAGE_BYTES messages, the
+   way spice does: write interest is turned on when a message is queued,
+   and off again once it has been written.  We then report how much work
+   the core backend did per megabyte. */
+#define TOTAL_BYTES         (32 * 1024 * 1024)
+#define MESSAGE_BYTES       (64 * 1024)
+#define CHUNK_BYTES         (16 * 1024)
+
+typedef struct {
+    core_t core;
+    int fds[2];
+    SpiceWatch *watch;
+    SpiceTimer *timer;
+    int pending;
+    long sent;
+    char buf[CHUNK_BYTES];
+} bench_t;
+
+static void queue_message(void *opaque)
+{
+    bench_t *b = (bench_t *) opaque;
+
+    b->pending = MESSAGE_BYTES;
+    b->core.iface.watch_update_mask(b->watch, SPICE_WATCH_EVENT_WRITE);
+}
+
+static void on_writable(int fd, int event G_GNUC_UNUSED, void *opaque)
+{
+    bench_t *b = (bench_t *) opaque;
+    ssize_t rc;
+
+    while (b->pending > 0) {
+        rc = write(fd, b->buf, MIN(b->pending, CHUNK_BYTES));
+        if (rc < 0) {
+            assert(errno == EAGAIN);
+            return;
+        }
+        b->pending -= rc;
+        b->sent += rc;
+    }
+
+    b->core.iface.watch_update_mask(b->watch, 0);
+    if (b->sent < TOTAL_BYTES)
+        b->core.iface.timer_start(b->timer, 0);
+}
+
+static void *drain(void *opaque)
+{
+    bench_t *b = (bench_t *) opaque;
+    char buf[CHUNK_BYTES];
+    long total = 0;
+    ssize_t rc;
+
+    while (total < TOTAL_BYTES) {
+        rc = read(b->fds[1], buf, sizeof(buf));
+        assert(rc > 0);
+        total += rc;
+    }
+
+    return NULL;
+}
+
+static void run(core_backend_t backend, const char *name, core_stats_t *stats)
+{
+    bench_t *b = calloc(1, sizeof(*b));
+    pthread_t reader;
+    double mb = TOTAL_BYTES / (1024.0 * 1024.0);
+    int rc;
+
+    assert(b);
+    rc = core_create(&b->core, backend);
+    assert(rc == 0);
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, b->fds);
+    assert(rc == 0);
+    rc = fcntl(b->fds[0], F_SETFL, O_NONBLOCK);
+    assert(rc == 0);
+
+    b->watch = b->core.iface.watch_add(b->fds[0], 0, on_writable, b);
+    b->timer = b->core.iface.timer_add(queue_message, b);
+    assert(b->watch && b->timer);
+    b->core.iface.timer_start(b->timer, 0);
+
+    rc = pthread_create(&reader, NULL, drain, b);
+    assert(rc == 0);
+    rc = core_start(&b->core);
+    assert(rc == 0);
+    pthread_join(reader, NULL);
+    core_stop(&b->core);
+
+    core_get_stats(&b->core, stats);
+    printf("%-6s per MB: %6.1f allocations, %6.1f registrations, %6.1f wakeups, "
+           "%6.1f dispatches\n", name, stats->allocations / mb, stats->registrations / mb,
+           stats->wakeups / mb, stats->dispatches / mb);
+
+    b->core.iface.watch_remove(b->watch);
+    b->core.iface.timer_remove(b->timer);
+    core_destroy(&b->core);
+    close(b->fds[0]);
+    close(b->fds[1]);
+    free(b);
+}
+
+int main(int argc G_GNUC_UNUSED, char **argv G_GNUC_UNUSED)
+{
+    core_stats_t glib_stats;
+    core_stats_t epoll_stats;
+
+    run(CORE_GLIB, "glib", &glib_stats);
+    run(CORE_EPOLL, "epoll", &epoll_stats);
+
+    /* The point of the epoll backend; it must not lose here */
+    assert(epoll_stats.allocations < glib_stats.allocations);
+    assert(epoll_stats.registrations < glib_stats.registrations);
+
+    return 0;
+}
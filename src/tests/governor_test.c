@@ -0,0 +1,61 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "governor.h"
+
+/* CPU time, in ns, for a given share of one core over a whole window */
+#define SHARE(percent)              ((gint64) GOVERNOR_PERIOD_USEC * 10 * (percent))
+
+int main(int argc G_GNUC_UNUSED, char **argv G_GNUC_UNUSED)
+{
+    governor_t g;
+    gint64 now = G_USEC_PER_SEC;
+    gint64 seen = 0;
+    int i;
+
+    /* With no budget, nothing is ever throttled */
+    governor_init(&g, 0);
+    governor_account(&g, SHARE(100), now);
+    governor_account(&g, SHARE(100), now + GOVERNOR_PERIOD_USEC);
+    assert(governor_level(&g) == 0);
+    governor_charge(&g, &seen);
+    assert(seen == 0);
+    governor_destroy(&g);
+
+    governor_init(&g, 15);
+
+    /* Nothing changes until a window has passed */
+    governor_account(&g, SHARE(50), now);
+    assert(governor_level(&g) == 0);
+    now += GOVERNOR_PERIOD_USEC;
+    governor_account(&g, 0, now);
+    assert(governor_level(&g) == 1);
+    assert(governor_cpu_percent(&g) == 50);
+
+    /* Staying over budget throttles a step a window, up to the limit */
+    for (i = 0; i < GOVERNOR_MAX_LEVEL + 2; i++) {
+        now += GOVERNOR_PERIOD_USEC;
+        governor_account(&g, SHARE(40), now);
+    }
+    assert(governor_level(&g) == GOVERNOR_MAX_LEVEL);
+
+    /* Just under budget holds the level; well under it eases off */
+    now += GOVERNOR_PERIOD_USEC;
+    governor_account(&g, SHARE(14), now);
+    assert(governor_level(&g) == GOVERNOR_MAX_LEVEL);
+    for (i = 0; i < GOVERNOR_MAX_LEVEL; i++) {
+        now += GOVERNOR_PERIOD_USEC;
+        governor_account(&g, SHARE(5), now);
+    }
+    assert(governor_level(&g) == 0);
+
+    /* Threads charge their own CPU time */
+    governor_charge(&g, &seen);
+    assert(seen > 0);
+
+    governor_destroy(&g);
+    return 0;
+}
@@ -44,6 +44,22 @@ int main(int argc, char *argv[])
     g_test_add("/x11spice/piglit1", xdummy_t, "piglit1", start_server, test_script, stop_server);
 #endif
 
+    /* End to end benchmarks; run with -m perf */
+    if (g_test_perf()) {
+        g_test_add("/x11spice/bench/scroll", xdummy_t, "bench_scroll", start_server, test_bench,
+                   stop_server);
+        g_test_add("/x11spice/bench/copy", xdummy_t, "bench_copy", start_server, test_bench,
+                   stop_server);
+        g_test_add("/x11spice/bench/video", xdummy_t, "bench_video", start_server, test_bench,
+                   stop_server);
+        g_test_add("/x11spice/bench/typing", xdummy_t, "bench_typing", start_server, test_bench,
+                   stop_server);
+#if defined(HAVE_SPICE_CLIENT)
+        g_test_add("/x11spice/bench/latency", xdummy_t, "bench_latency", start_server, test_bench,
+                   stop_server);
+#endif
+    }
+
     g_log_set_always_fatal(G_LOG_LEVEL_ERROR);
 
     return g_test_run();
@@ -0,0 +1,107 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+
+#include "x11spice.h"
+#include "metrics.h"
+
+#define THREADS                     4
+#define ADDS                        100000
+
+static void *count(void *opaque G_GNUC_UNUSED)
+{
+    int i;
+
+    for (i = 0; i < ADDS; i++)
+        metrics_add(METRIC_TILES_CHANGED, 2);
+
+    return NULL;
+}
+
+static void gauges(GString *out, void *data)
+{
+    g_string_append_printf(out, "test_gauge %d\n", *(int *) data);
+}
+
+static char *fetch(const char *path)
+{
+    struct sockaddr_un addr;
+    GString *out = g_string_new(NULL);
+    char buf[256];
+    ssize_t len;
+    int fd;
+    int rc;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    rc = connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+    assert(rc == 0);
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+        g_string_append_len(out, buf, len);
+    close(fd);
+
+    return g_string_free(out, FALSE);
+}
+
+int main(int argc G_GNUC_UNUSED, char **argv G_GNUC_UNUSED)
+{
+    pthread_t threads[THREADS];
+    metrics_server_t server;
+    int gauge = 42;
+    char *path;
+    char *text;
+    int rc;
+    int i;
+
+    /* Counts from threads that have exited are kept */
+    for (i = 0; i < THREADS; i++) {
+        rc = pthread_create(&threads[i], NULL, count, NULL);
+        assert(rc == 0);
+    }
+    for (i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+    metrics_add(METRIC_TILES_CHANGED, 1);
+    assert(metrics_total(METRIC_TILES_CHANGED) == THREADS * ADDS * 2 + 1);
+    assert(metrics_total(METRIC_SCAN_CYCLES) == 0);
+
+    path = g_strdup_printf("%s/x11spice-metrics-test-%d", g_get_tmp_dir(), getpid());
+    rc = metrics_server_start(&server, path, gauges, &gauge);
+    assert(rc == 0);
+
+    /* Each connection gets a fresh snapshot */
+    text = fetch(path);
+    assert(strstr(text, "tiles_changed_total 800001\n"));
+    assert(strstr(text, "test_gauge 42\n"));
+    g_free(text);
+
+    metrics_add(METRIC_SCAN_CYCLES, 3);
+    text = fetch(path);
+    assert(strstr(text, "scan_cycles_total 3\n"));
+    g_free(text);
+
+    metrics_server_stop(&server);
+    assert(access(path, F_OK) != 0);
+
+    /* Anything at the path that is not a socket is left alone */
+    rc = g_file_set_contents(path, "keep", -1, NULL);
+    assert(rc);
+    rc = metrics_server_start(&server, path, gauges, &gauge);
+    assert(rc != 0);
+    metrics_server_stop(&server);
+    assert(access(path, F_OK) == 0);
+    unlink(path);
+
+    g_free(path);
+    return 0;
+}
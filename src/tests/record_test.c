@@ -0,0 +1,70 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <glib.h>
+
+#include "x11spice.h"
+#include "record.h"
+
+#define W                           8
+#define H                           4
+
+static void expect(record_reader_t *r, record_type_t type, int x, int y, int w, int h)
+{
+    int more = record_reader_next(r);
+
+    assert(more);
+    assert(r->event.type == type);
+    assert(r->event.x == x && r->event.y == y && r->event.w == w && r->event.h == h);
+}
+
+int main(int argc G_GNUC_UNUSED, char **argv G_GNUC_UNUSED)
+{
+    uint32_t pixels[W * H];
+    record_reader_t r;
+    char *path;
+    int rc;
+
+    path = g_strdup_printf("%s/x11spice-record-test-%d", g_get_tmp_dir(), getpid());
+
+    /* Nothing is written, or crashes, when we are not recording */
+    record_scan(0, 0, 0, W, H);
+
+    rc = record_open(path, W, H);
+    assert(rc == 0);
+    record_scan(1, 1, 2, 3, 1);
+
+    /* Only the rows that changed since the last capture are kept */
+    memset(pixels, 0, sizeof(pixels));
+    pixels[W * 2 + 1] = 0xff00ff;
+    record_capture((uint8_t *) pixels, W * sizeof(uint32_t), 0, 0, W, H);
+    record_capture((uint8_t *) pixels, W * sizeof(uint32_t), 0, 0, W, H);
+    pixels[W * 1 + 1] = 0x00ff00;
+    pixels[W * 3 + 1] = 0x00ff00;
+    record_capture((uint8_t *) pixels, W * sizeof(uint32_t), 0, 0, W, H);
+
+    record_cursor_move(5, 6);
+    record_close();
+
+    rc = record_reader_open(&r, path);
+    assert(rc == 0);
+    expect(&r, RECORD_SCREEN, 0, 0, W, H);
+    expect(&r, RECORD_SCAN, 1, 2, 3, 1);
+    assert(r.event.detail == 1);
+    expect(&r, RECORD_PIXELS, 0, 2, W, 1);
+    assert(((uint32_t *) r.data)[1] == 0xff00ff);
+    expect(&r, RECORD_PIXELS, 0, 1, W, 3);
+    assert(((uint32_t *) r.data)[1] == 0x00ff00);
+    assert(((uint32_t *) r.data)[W + 1] == 0xff00ff);
+    expect(&r, RECORD_CURSOR_MOVE, 5, 6, 0, 0);
+    rc = record_reader_next(&r);
+    assert(!rc);
+    record_reader_close(&r);
+
+    unlink(path);
+    g_free(path);
+    return 0;
+}
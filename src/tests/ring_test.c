@@ -0,0 +1,72 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "x11spice.h"
+#include "ring.h"
+
+/* A small ring forces the producer to wait on the consumer often */
+#define RING_SIZE                   8
+#define ITEMS                       200000
+
+static void *produce(void *opaque)
+{
+    ring_t *r = (ring_t *) opaque;
+    uintptr_t i;
+
+    for (i = 1; i <= ITEMS; i++)
+        while (ring_push(r, (void *) i, 1000))
+            ;
+
+    return NULL;
+}
+
+int main(int argc G_GNUC_UNUSED, char **argv G_GNUC_UNUSED)
+{
+    ring_t r;
+    pthread_t producer;
+    uintptr_t expected = 1;
+    void *item;
+    int rc;
+    int i;
+
+    rc = ring_create(&r, 6);
+    assert(rc == X11SPICE_ERR_BADARGS);
+    rc = ring_create(&r, RING_SIZE);
+    assert(rc == 0);
+
+    /* A full ring refuses more, and hands items back in order */
+    for (i = 1; i <= RING_SIZE; i++) {
+        rc = ring_push(&r, (void *) (uintptr_t) i, 0);
+        assert(rc == 0);
+    }
+    assert(ring_length(&r) == RING_SIZE);
+    rc = ring_push(&r, (void *) 1, 0);
+    assert(rc == X11SPICE_ERR_BUSY);
+    for (i = 1; i <= RING_SIZE; i++) {
+        item = ring_pop(&r);
+        assert(item == (void *) (uintptr_t) i);
+    }
+    item = ring_pop(&r);
+    assert(item == NULL);
+
+    /* Nothing is lost or reordered across threads */
+    rc = pthread_create(&producer, NULL, produce, &r);
+    assert(rc == 0);
+    while (expected <= ITEMS) {
+        item = ring_pop(&r);
+        if (!item)
+            continue;
+        assert(item == (void *) expected);
+        expected++;
+    }
+    pthread_join(producer, NULL);
+    assert(ring_length(&r) == 0);
+
+    ring_destroy(&r, NULL);
+    return 0;
+}
@@ -0,0 +1,428 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  scan_bench.c
+**      Microbenchmarks for the code that finds and reports screen changes.
+**  The screen is a synthetic frame in memory, read through a display
+**  source, so no X server is needed.  Each case compares a 'before' frame,
+**  held in the fullscreen mirror, with an 'after' frame that has had one
+**  of a few typical kinds of change applied to it.
+**
+**  Results are written one JSON object per line, so runs can be kept and
+**  compared to catch regressions.  Run with 'make bench'.
+**--------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "x11spice.h"
+#include "session.h"
+#include "scan.h"
+
+/* Each case runs for at least this long, and at least MIN_OPS times */
+#define DEFAULT_CASE_USEC           (G_USEC_PER_SEC / 5)
+#define MIN_OPS                     3
+
+#define GLYPH_W                     8
+#define GLYPH_H                     16
+#define TYPED_GLYPHS                40
+#define SCROLL_ROWS                 GLYPH_H
+
+#define MAX_RECTS                   TYPED_GLYPHS
+
+typedef struct {
+    int w;
+    int h;
+} bench_size_t;
+
+static const bench_size_t sizes[] = {
+    {640, 480},
+    {1024, 768},
+    {1920, 1080},
+    {2560, 1440},
+    {3840, 2160},
+    {7680, 4320},
+};
+
+typedef enum {
+    PATTERN_TYPING,
+    PATTERN_SCROLLING,
+    PATTERN_VIDEO,
+    PATTERN_FULLSCREEN,
+    PATTERNS
+} bench_pattern_t;
+
+static const char *pattern_names[PATTERNS] = {
+    "typing",
+    "scrolling",
+    "video",
+    "fullscreen",
+};
+
+typedef struct {
+    int x;
+    int y;
+    int w;
+    int h;
+} bench_rect_t;
+
+typedef struct {
+    session_t *session;
+    uint32_t *before;
+    uint32_t *after;
+    int w;
+    int h;
+    bench_pattern_t pattern;
+    bench_rect_t rects[MAX_RECTS];      /* What the pattern changed */
+    int num_rects;
+    gint64 case_usec;
+} bench_t;
+
+typedef void (*bench_op_t)(bench_t *b, void *data);
+
+static int read_frame(void *data, shm_image_t *shmi, int x, int y)
+{
+    bench_t *b = (bench_t *) data;
+    unsigned int row;
+
+    if (x < 0 || y < 0 || x + shmi->w > b->w || y + shmi->h > b->h)
+        return -1;
+
+    for (row = 0; row < shmi->h; row++)
+        memcpy((uint8_t *) shmi->segment.shmaddr + row * shmi->bytes_per_line,
+               b->after + (size_t) (y + row) * b->w + x, shmi->w * sizeof(uint32_t));
+
+    return 0;
+}
+
+static uint32_t noise(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 8) & 0xffffff;
+}
+
+/* A plain background with a window of 'text' on it */
+static void paint_desktop(uint32_t *p, int w, int h)
+{
+    int x, y;
+
+    for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++) {
+            uint32_t cell = (x / GLYPH_W) * 2654435761u + (y / GLYPH_H) * 40503u;
+            if (x < w / 8 || x >= w * 7 / 8 || y < h / 8 || y >= h * 7 / 8)
+                p[y * w + x] = 0x336699;
+            else if ((cell >> 7) & 1 && ((x ^ y ^ (cell >> 11)) & 3))
+                p[y * w + x] = 0x000000;
+            else
+                p[y * w + x] = 0xffffff;
+        }
+}
+
+static void add_rect(bench_t *b, int x, int y, int w, int h)
+{
+    bench_rect_t *r = &b->rects[b->num_rects++];
+
+    r->x = x;
+    r->y = y;
+    r->w = w;
+    r->h = h;
+}
+
+static void apply_pattern(bench_t *b)
+{
+    uint32_t seed = 1;
+    int x, y, i;
+    int wx = b->w / 8;
+    int ww = b->w * 7 / 8 - wx;
+    int wy = b->h / 8;
+    int wh = b->h * 7 / 8 - wy;
+
+    memcpy(b->after, b->before, sizeof(*b->after) * b->w * b->h);
+    b->num_rects = 0;
+
+    switch (b->pattern) {
+    case PATTERN_TYPING:
+        /* A line of new glyphs, each its own small change */
+        y = b->h / 3;
+        for (i = 0; i < TYPED_GLYPHS && wx + (i + 1) * GLYPH_W <= wx + ww; i++) {
+            int gx = wx + i * GLYPH_W;
+            int row;
+            for (row = 0; row < GLYPH_H; row++)
+                for (x = gx; x < gx + GLYPH_W; x++)
+                    b->after[(y + row) * b->w + x] ^= 0xffffff;
+            add_rect(b, gx, y, GLYPH_W, GLYPH_H);
+        }
+        break;
+
+    case PATTERN_SCROLLING:
+        /* The window content moves up a line, with a new line at the bottom */
+        for (y = wy; y < wy + wh - SCROLL_ROWS; y++)
+            memcpy(b->after + y * b->w + wx, b->before + (y + SCROLL_ROWS) * b->w + wx,
+                   sizeof(*b->after) * ww);
+        for (; y < wy + wh; y++)
+            for (x = wx; x < wx + ww; x++)
+                b->after[y * b->w + x] = noise(&seed) & 1 ? 0xffffff : 0x000000;
+        add_rect(b, wx, wy, ww, wh);
+        break;
+
+    case PATTERN_VIDEO:
+        /* A 720p player, or as much of one as will fit, in the middle */
+        ww = MIN(1280, b->w / 2);
+        wh = MIN(720, b->h / 2);
+        wx = (b->w - ww) / 2;
+        wy = (b->h - wh) / 2;
+        for (y = wy; y < wy + wh; y++)
+            for (x = wx; x < wx + ww; x++)
+                b->after[y * b->w + x] = noise(&seed);
+        add_rect(b, wx, wy, ww, wh);
+        break;
+
+    case PATTERN_FULLSCREEN:
+        for (i = 0; i < b->w * b->h; i++)
+            b->after[i] ^= 0x00ffffff;
+        add_rect(b, 0, 0, b->w, b->h);
+        break;
+
+    case PATTERNS:
+        break;
+    }
+}
+
+/* Put the 'before' frame back in the mirror, and drop any pending reports */
+static void reset(bench_t *b)
+{
+    scanner_t *scanner = &b->session->scanners[0];
+    scan_report_t *r;
+
+    memcpy(b->session->display.fullscreen->segment.shmaddr, b->before,
+           sizeof(*b->before) * b->w * b->h);
+
+    while ((r = g_async_queue_try_pop(scanner->queue)))
+        slab_free(b->session->report_slab, r);
+    pixman_region_clear(&scanner->region);
+}
+
+static void run(bench_t *b, const char *name, bench_op_t op, void *data)
+{
+    gint64 start, elapsed;
+    guint64 ops = 0;
+
+    reset(b);
+    start = g_get_monotonic_time();
+    do {
+        op(b, data);
+        ops++;
+        elapsed = g_get_monotonic_time() - start;
+    } while (elapsed < b->case_usec || ops < MIN_OPS);
+
+    printf("{\"bench\":\"%s\",\"width\":%d,\"height\":%d,\"pattern\":\"%s\","
+           "\"ops\":%" G_GUINT64_FORMAT ",\"ns_per_op\":%.1f}\n",
+           name, b->w, b->h, pattern_names[b->pattern], ops, elapsed * 1000.0 / ops);
+    fflush(stdout);
+}
+
+/* One pass of the periodic scan: a line from each row of tiles */
+static void find_changed_tiles(bench_t *b, void *data)
+{
+    scanner_t *scanner = &b->session->scanners[0];
+    int *offset = (int *) data;
+    bool tiles[NUM_HORIZONTAL_TILES];
+    int y;
+
+    for (y = *offset; y < b->h; y += NUM_SCANLINES)
+        display_find_changed_tiles(&b->session->display, scanner->c, scanner->scanline, 0, y,
+                                   tiles, NUM_HORIZONTAL_TILES);
+    *offset = (*offset + 1) % NUM_SCANLINES;
+}
+
+static void scan_whole_screen(bench_t *b, void *data G_GNUC_UNUSED)
+{
+    scanner_t *scanner = &b->session->scanners[0];
+    int num_vertical_tiles = (b->h + NUM_SCANLINES - 1) / NUM_SCANLINES;
+    int tiles_changed_in_row[num_vertical_tiles];
+    bool tiles[num_vertical_tiles][NUM_HORIZONTAL_TILES];
+
+    display_scan_whole_screen(&b->session->display, scanner->c, &scanner->head,
+                              num_vertical_tiles, NUM_HORIZONTAL_TILES, tiles,
+                              tiles_changed_in_row);
+}
+
+typedef struct {
+    int num_vertical_tiles;
+    int *tiles_changed_in_row;
+    bool (*tiles)[NUM_HORIZONTAL_TILES];
+} bench_tiles_t;
+
+/* Growing and pushing the tiles found by a full screen scan, then taking
+   the reports back off the queue, as the scanner would */
+static void grow_and_push(bench_t *b, void *data)
+{
+    bench_tiles_t *found = (bench_tiles_t *) data;
+    scanner_t *scanner = &b->session->scanners[0];
+    int n = found->num_vertical_tiles;
+    int tiles_changed_in_row[n];
+    bool tiles[n][NUM_HORIZONTAL_TILES];
+    scan_report_t *r;
+
+    memcpy(tiles_changed_in_row, found->tiles_changed_in_row, sizeof(tiles_changed_in_row));
+    memcpy(tiles, found->tiles, sizeof(tiles));
+
+    grow_changed_tiles(scanner, tiles_changed_in_row, tiles, n);
+    push_changed_tiles(scanner, tiles_changed_in_row, tiles, n);
+
+    while ((r = g_async_queue_try_pop(scanner->queue)))
+        slab_free(b->session->report_slab, r);
+    pixman_region_clear(&scanner->region);
+}
+
+/* Copying captured changes into the mirror */
+static void copy_into_fullscreen(bench_t *b, void *data)
+{
+    shm_image_t **images = (shm_image_t **) data;
+    int i;
+
+    for (i = 0; i < b->num_rects; i++)
+        display_copy_image_into_fullscreen(&b->session->display, images[i],
+                                           b->rects[i].x, b->rects[i].y);
+}
+
+/* Every capture gets its image from, and returns it to, the shm cache */
+static void shm_cache(bench_t *b, void *data G_GNUC_UNUSED)
+{
+    shm_image_t *shmi;
+    int i;
+
+    for (i = 0; i < b->num_rects; i++) {
+        shmi = create_shm_image(&b->session->display, b->rects[i].w, b->rects[i].h);
+        if (shmi)
+            destroy_shm_image(&b->session->display, shmi);
+    }
+}
+
+static void bench_pattern(bench_t *b)
+{
+    scanner_t *scanner = &b->session->scanners[0];
+    shm_image_t *images[MAX_RECTS];
+    bench_tiles_t found;
+    int offset = 0;
+    int i;
+
+    apply_pattern(b);
+
+    run(b, "find_changed_tiles", find_changed_tiles, &offset);
+    run(b, "scan_whole_screen", scan_whole_screen, NULL);
+
+    found.num_vertical_tiles = (b->h + NUM_SCANLINES - 1) / NUM_SCANLINES;
+    found.tiles_changed_in_row = g_new(int, found.num_vertical_tiles);
+    found.tiles = g_malloc(sizeof(*found.tiles) * found.num_vertical_tiles);
+    reset(b);
+    display_scan_whole_screen(&b->session->display, scanner->c, &scanner->head,
+                              found.num_vertical_tiles, NUM_HORIZONTAL_TILES, found.tiles,
+                              found.tiles_changed_in_row);
+    run(b, "grow_push_changed_tiles", grow_and_push, &found);
+    g_free(found.tiles_changed_in_row);
+    g_free(found.tiles);
+
+    run(b, "shm_cache_get_add", shm_cache, NULL);
+
+    for (i = 0; i < b->num_rects; i++) {
+        images[i] = create_shm_image(&b->session->display, b->rects[i].w, b->rects[i].h);
+        if (!images[i] || read_shm_image(&b->session->display, scanner->c, images[i],
+                                         b->rects[i].x, b->rects[i].y)) {
+            fprintf(stderr, "Error: cannot capture %dx%d\n", b->rects[i].w, b->rects[i].h);
+            exit(X11SPICE_ERR_NOSHM);
+        }
+    }
+    run(b, "copy_image_into_fullscreen", copy_into_fullscreen, images);
+    for (i = 0; i < b->num_rects; i++)
+        destroy_shm_image(&b->session->display, images[i]);
+}
+
+static int bench_size(bench_t *b, const bench_size_t *size)
+{
+    session_t session = { };
+    display_source_t source = {.read_image = read_frame,.data = b };
+    scanner_t *scanner = &session.scanners[0];
+    int rc;
+
+    b->session = &session;
+    b->w = size->w;
+    b->h = size->h;
+    b->before = g_new(uint32_t, (gsize) b->w * b->h);
+    b->after = g_new(uint32_t, (gsize) b->w * b->h);
+    paint_desktop(b->before, b->w, b->h);
+
+    options_init(&session.options);
+    rc = session_create(&session);
+    if (rc)
+        return rc;
+
+    rc = display_open_source(&session.display, &session, &source, b->w, b->h);
+    if (rc)
+        return rc;
+
+    scanner->session = &session;
+    scanner->draw_ring = &session.draw_rings[0];
+    session.num_scanners = 1;
+    rc = scanner_init(scanner, &session.display.heads[0]);
+    if (rc)
+        return rc;
+
+    for (b->pattern = 0; b->pattern < PATTERNS; b->pattern++)
+        bench_pattern(b);
+
+    reset(b);
+    scanner_destroy(scanner);
+    session.num_scanners = 0;
+    session_destroy(&session);
+    display_close(&session.display);
+    options_free(&session.options);
+    g_free(b->before);
+    g_free(b->after);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_t b = { };
+    int i;
+    int rc;
+
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [milliseconds per case]\n", argv[0]);
+        return X11SPICE_ERR_BADARGS;
+    }
+
+    b.case_usec = argc > 1 ? atoi(argv[1]) * 1000 : DEFAULT_CASE_USEC;
+
+    for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+        rc = bench_size(&b, &sizes[i]);
+        if (rc) {
+            fprintf(stderr, "Error: cannot set up a %dx%d screen\n", sizes[i].w, sizes[i].h);
+            return rc;
+        }
+    }
+
+    return 0;
+}
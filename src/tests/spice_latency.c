@@ -0,0 +1,201 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  spice_latency.c
+**      A headless spice client that measures how long screen updates take
+**  to get from the X server to a client.  It connects to x11spice, paints
+**  frame stamps on the X display at a fixed rate, and reads them back out
+**  of its copy of the primary surface as the draws arrive.  The stamps
+**  hold the time they were painted, so the difference is the full damage
+**  to client latency; stamps we never see are dropped frames.
+**
+**  The painter and this client must share a host, and so a clock.  The
+**  result is written to stdout as a single JSON object.
+**--------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <spice-client.h>
+
+#include "stamp.h"
+#include "xcbtest.h"
+
+#define DEFAULT_SECONDS             10
+#define STAMP_FPS                   60
+
+/* Time to connect before we start painting, and to catch up after */
+#define STARTUP_SECONDS             1
+#define DRAIN_SECONDS               1
+
+typedef struct {
+    const char *display;
+    int seconds;
+    pthread_t painter;
+    int painter_started;
+    uint32_t painted;
+    uint32_t last_seq;
+    guint received;
+    GArray *latencies;
+    GMainLoop *loop;
+} latency_state_t;
+
+static void invalidate(SpiceChannel *channel, gint x, gint y, gint w, gint h, gpointer data)
+{
+    latency_state_t *state = (latency_state_t *) data;
+    gint64 now = g_get_monotonic_time();
+    SpiceDisplayPrimary primary;
+    uint32_t seq;
+    int64_t usec;
+    gint64 latency;
+
+    if (x >= STAMP_X + STAMP_WIDTH || y >= STAMP_Y + STAMP_HEIGHT ||
+        x + w <= STAMP_X || y + h <= STAMP_Y)
+        return;
+
+    if (!spice_display_channel_get_primary(channel, 0, &primary) ||
+        primary.width < STAMP_X + STAMP_WIDTH || primary.height < STAMP_Y + STAMP_HEIGHT)
+        return;
+
+    if (stamp_decode((uint32_t *) (primary.data + STAMP_Y * primary.stride) + STAMP_X,
+                     primary.stride / sizeof(uint32_t), &seq, &usec))
+        return;
+
+    /* A stamp is only counted the first time we see it */
+    if (seq <= state->last_seq)
+        return;
+
+    state->last_seq = seq;
+    state->received++;
+    latency = now - usec;
+    g_array_append_val(state->latencies, latency);
+}
+
+static void channel_new(SpiceSession *session G_GNUC_UNUSED, SpiceChannel *channel,
+                        gpointer data)
+{
+    if (!SPICE_IS_DISPLAY_CHANNEL(channel))
+        return;
+
+    g_signal_connect(channel, "display-invalidate", G_CALLBACK(invalidate), data);
+    spice_channel_connect(channel);
+}
+
+static void *paint(void *opaque)
+{
+    latency_state_t *state = (latency_state_t *) opaque;
+
+    if (xcbtest_paint_stamps(state->display, STAMP_FPS, state->seconds, &state->painted))
+        fprintf(stderr, "Error: cannot paint on %s\n", state->display);
+
+    return NULL;
+}
+
+static gboolean start_painter(gpointer data)
+{
+    latency_state_t *state = (latency_state_t *) data;
+
+    if (pthread_create(&state->painter, NULL, paint, state) == 0)
+        state->painter_started = TRUE;
+
+    return FALSE;
+}
+
+static gboolean stop(gpointer data)
+{
+    g_main_loop_quit(((latency_state_t *) data)->loop);
+    return FALSE;
+}
+
+static int compare_latency(gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64 *) a;
+    gint64 y = *(const gint64 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static gint64 percentile(GArray *sorted, double percent)
+{
+    if (sorted->len == 0)
+        return 0;
+
+    return g_array_index(sorted, gint64, (guint) ((sorted->len - 1) * percent / 100));
+}
+
+static void report(latency_state_t *state)
+{
+    g_array_sort(state->latencies, compare_latency);
+
+    printf("{\"workload\":\"spice_latency\",\"seconds\":%d,\"painted\":%u,\"received\":%u,"
+           "\"dropped\":%u,\"fps\":%.2f,\"latency_p50_us\":%" G_GINT64_FORMAT
+           ",\"latency_p90_us\":%" G_GINT64_FORMAT ",\"latency_p99_us\":%" G_GINT64_FORMAT
+           ",\"latency_max_us\":%" G_GINT64_FORMAT "}\n",
+           state->seconds, state->painted, state->received,
+           state->painted > state->received ? state->painted - state->received : 0,
+           (double) state->received / state->seconds,
+           percentile(state->latencies, 50), percentile(state->latencies, 90),
+           percentile(state->latencies, 99), percentile(state->latencies, 100));
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    latency_state_t state = { };
+    SpiceSession *session;
+
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "Usage: %s spice-uri x-display [seconds]\n", argv[0]);
+        return 2;
+    }
+
+    state.display = argv[2];
+    state.seconds = argc > 3 ? atoi(argv[3]) : DEFAULT_SECONDS;
+    if (state.seconds <= 0)
+        state.seconds = DEFAULT_SECONDS;
+    state.latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+    state.loop = g_main_loop_new(NULL, FALSE);
+
+    session = spice_session_new();
+    g_object_set(session, "uri", argv[1], NULL);
+    g_signal_connect(session, "channel-new", G_CALLBACK(channel_new), &state);
+    if (!spice_session_connect(session)) {
+        fprintf(stderr, "Error: cannot connect to %s\n", argv[1]);
+        return 1;
+    }
+
+    g_timeout_add_seconds(STARTUP_SECONDS, start_painter, &state);
+    g_timeout_add_seconds(STARTUP_SECONDS + state.seconds + DRAIN_SECONDS, stop, &state);
+    g_main_loop_run(state.loop);
+
+    if (state.painter_started)
+        pthread_join(state.painter, NULL);
+    spice_session_disconnect(session);
+    g_object_unref(session);
+
+    report(&state);
+
+    g_main_loop_unref(state.loop);
+    g_array_free(state.latencies, TRUE);
+
+    return state.received > 0 ? 0 : 1;
+}
@@ -0,0 +1,92 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  stamp.c
+**      Paints and reads back the frame stamps used to measure how long
+**  screen updates take to reach a spice client.  Strides are in pixels.
+**--------------------------------------------------------------------------*/
+
+#include <time.h>
+
+#include "stamp.h"
+
+#define STAMP_BITS                  (STAMP_COLUMNS * STAMP_ROWS)
+
+static uint32_t check_word(uint32_t seq, uint64_t usec)
+{
+    return ~(seq ^ (uint32_t) usec ^ (uint32_t) (usec >> 32));
+}
+
+static int get_bit(const uint32_t *words, int bit)
+{
+    return (words[bit / 32] >> (bit % 32)) & 1;
+}
+
+void stamp_encode(uint32_t *pixels, int stride, uint32_t seq, int64_t usec)
+{
+    uint32_t words[STAMP_BITS / 32];
+    int bit, x, y;
+
+    words[0] = seq;
+    words[1] = (uint32_t) usec;
+    words[2] = (uint32_t) ((uint64_t) usec >> 32);
+    words[3] = check_word(seq, usec);
+
+    for (bit = 0; bit < STAMP_BITS; bit++) {
+        uint32_t color = get_bit(words, bit) ? 0xffffff : 0x000000;
+        uint32_t *cell = pixels + (bit / STAMP_COLUMNS) * STAMP_CELL * stride +
+            (bit % STAMP_COLUMNS) * STAMP_CELL;
+
+        for (y = 0; y < STAMP_CELL; y++)
+            for (x = 0; x < STAMP_CELL; x++)
+                cell[y * stride + x] = color;
+    }
+}
+
+/* Returns 0 if 'pixels' hold a whole, valid stamp */
+int stamp_decode(const uint32_t *pixels, int stride, uint32_t *seq, int64_t *usec)
+{
+    uint32_t words[STAMP_BITS / 32] = { 0 };
+    int bit;
+
+    for (bit = 0; bit < STAMP_BITS; bit++) {
+        const uint32_t *center = pixels +
+            ((bit / STAMP_COLUMNS) * STAMP_CELL + STAMP_CELL / 2) * stride +
+            (bit % STAMP_COLUMNS) * STAMP_CELL + STAMP_CELL / 2;
+
+        /* Judge by the green channel, which survives compression best */
+        if (((*center >> 8) & 0xff) >= 0x80)
+            words[bit / 32] |= 1u << (bit % 32);
+    }
+
+    *seq = words[0];
+    *usec = (int64_t) (((uint64_t) words[2] << 32) | words[1]);
+    return words[3] == check_word(*seq, *usec) ? 0 : -1;
+}
+
+/* The same clock as g_get_monotonic_time() */
+int64_t stamp_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
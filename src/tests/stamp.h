@@ -0,0 +1,48 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STAMP_H_
+#define STAMP_H_
+
+#include <stdint.h>
+
+/*----------------------------------------------------------------------------
+**  Definitions and simple types
+**--------------------------------------------------------------------------*/
+
+/* A stamp is a frame number and the CLOCK_MONOTONIC time it was painted,
+   with a check word, drawn as a block of black and white cells.  The cells
+   are big enough to survive lossy compression on the way to the client. */
+#define STAMP_CELL                  8
+#define STAMP_COLUMNS               64
+#define STAMP_ROWS                  2
+#define STAMP_WIDTH                 (STAMP_CELL * STAMP_COLUMNS)
+#define STAMP_HEIGHT                (STAMP_CELL * STAMP_ROWS)
+#define STAMP_X                     0
+#define STAMP_Y                     0
+
+/*----------------------------------------------------------------------------
+**  Prototypes
+**--------------------------------------------------------------------------*/
+void stamp_encode(uint32_t *pixels, int stride, uint32_t seq, int64_t usec);
+int stamp_decode(const uint32_t *pixels, int stride, uint32_t *seq, int64_t *usec);
+int64_t stamp_now(void);
+
+#endif
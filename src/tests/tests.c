@@ -30,8 +30,8 @@
 #include "xcbtest.h"
 #include "x11spice_test.h"
 
-static int test_common_start(test_t *test, x11spice_server_t *server,
-                             xdummy_t *xserver, gconstpointer user_data)
+int test_common_start(test_t *test, x11spice_server_t *server,
+                      xdummy_t *xserver, gconstpointer user_data)
 {
     int rc;
 
@@ -61,7 +61,7 @@ static int test_common_start(test_t *test, x11spice_server_t *server,
     return 0;
 }
 
-static void test_common_stop(test_t *test G_GNUC_UNUSED, x11spice_server_t *server)
+void test_common_stop(test_t *test G_GNUC_UNUSED, x11spice_server_t *server)
 {
     x11spice_stop(server);
 }
@@ -34,6 +34,7 @@ typedef struct {
     const gchar *logfile;
     const gchar *name;
     int never_trust_damage;
+    const gchar *metrics_socket;
 } test_t;
 
 
@@ -44,5 +45,6 @@ void test_basic(xdummy_t *server, gconstpointer user_data);
 void test_resize(xdummy_t *server, gconstpointer user_data);
 void test_tallscreen(xdummy_t *server, gconstpointer user_data);
 void test_script(xdummy_t *xdummy, gconstpointer user_data);
+void test_bench(xdummy_t *xdummy, gconstpointer user_data);
 
 #endif
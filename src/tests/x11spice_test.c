@@ -121,6 +121,8 @@ int x11spice_start(x11spice_server_t *server, test_t *test)
         fwrite(config_data, 1, strlen(config_data), fp);
         if (test->never_trust_damage)
             fprintf(fp, "trust-damage=never\n");
+        if (test->metrics_socket)
+            fprintf(fp, "metrics-socket=%s\n", test->metrics_socket);
         fclose(fp);
     }
 
@@ -47,4 +47,9 @@ typedef struct {
 int x11spice_start(x11spice_server_t *server, test_t *test);
 void x11spice_stop(x11spice_server_t *server);
 
+/* In tests.c; these start and stop x11spice for a test or benchmark */
+int test_common_start(test_t *test, x11spice_server_t *server,
+                      xdummy_t *xserver, gconstpointer user_data);
+void test_common_stop(test_t *test, x11spice_server_t *server);
+
 #endif
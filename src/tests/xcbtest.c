@@ -22,9 +22,16 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include <xcb/xcb.h>
 
+#include "stamp.h"
+
+/* The cell size of the 'fixed' font */
+#define TEXT_CHAR_WIDTH     6
+#define TEXT_LINE_HEIGHT    13
+
 
 static void lookup_color(xcb_connection_t *c, xcb_screen_t *screen, const char *color,
                          uint32_t *pixel)
@@ -165,3 +172,175 @@ int xcbtest_draw_at_bottom(const char *display)
 
     return 0;
 }
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void sleep_until(double when)
+{
+    double delay = when - now_seconds();
+    struct timespec ts;
+
+    if (delay <= 0)
+        return;
+
+    ts.tv_sec = (time_t) delay;
+    ts.tv_nsec = (long) ((delay - ts.tv_sec) * 1000000000.0);
+    nanosleep(&ts, NULL);
+}
+
+/* Paint w x h frames of noise in the middle of the screen, at fps, for
+   'seconds'.  Each frame goes in bands, to stay under the request limit. */
+#define VIDEO_BAND_ROWS     32
+int xcbtest_play_video(const char *display, int w, int h, int fps, int seconds)
+{
+    xcb_connection_t *c;
+    xcb_screen_t *screen;
+    xcb_gcontext_t gc;
+    uint32_t *band;
+    uint32_t seed = 1;
+    double start, next;
+    int x, y, row, rows;
+    int i;
+
+    c = xcb_connect(display, NULL);
+    if (xcb_connection_has_error(c))
+        return 1;
+
+    screen = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+    if (w > screen->width_in_pixels)
+        w = screen->width_in_pixels;
+    if (h > screen->height_in_pixels)
+        h = screen->height_in_pixels;
+    x = (screen->width_in_pixels - w) / 2;
+    y = (screen->height_in_pixels - h) / 2;
+
+    gc = xcb_generate_id(c);
+    xcb_create_gc(c, gc, screen->root, 0, NULL);
+
+    band = malloc(w * VIDEO_BAND_ROWS * sizeof(*band));
+    if (!band) {
+        xcb_disconnect(c);
+        return 1;
+    }
+
+    start = next = now_seconds();
+    while (next < start + seconds) {
+        for (row = 0; row < h; row += rows) {
+            rows = h - row < VIDEO_BAND_ROWS ? h - row : VIDEO_BAND_ROWS;
+            for (i = 0; i < w * rows; i++) {
+                seed = seed * 1103515245 + 12345;
+                band[i] = (seed >> 8) & 0xffffff;
+            }
+            xcb_put_image(c, XCB_IMAGE_FORMAT_Z_PIXMAP, screen->root, gc, w, rows,
+                          x, y + row, 0, screen->root_depth,
+                          w * rows * sizeof(*band), (uint8_t *) band);
+        }
+        free(xcb_get_input_focus_reply(c, xcb_get_input_focus(c), NULL));
+
+        next += 1.0 / fps;
+        sleep_until(next);
+    }
+
+    free(band);
+    xcb_disconnect(c);
+
+    return 0;
+}
+
+/* Draw text in the fixed font a character at a time, at 'cps' characters
+   a second, for 'seconds' */
+int xcbtest_type_text(const char *display, int cps, int seconds)
+{
+    static const char text[] = "The quick brown fox jumps over the lazy dog. ";
+    xcb_connection_t *c;
+    xcb_screen_t *screen;
+    xcb_gcontext_t gc;
+    xcb_font_t font;
+    uint32_t values[3];
+    double start, next;
+    int x, y;
+    int i = 0;
+
+    c = xcb_connect(display, NULL);
+    if (xcb_connection_has_error(c))
+        return 1;
+
+    screen = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+
+    font = xcb_generate_id(c);
+    xcb_open_font(c, font, strlen("fixed"), "fixed");
+
+    gc = xcb_generate_id(c);
+    values[0] = screen->black_pixel;
+    values[1] = screen->white_pixel;
+    values[2] = font;
+    xcb_create_gc(c, gc, screen->root, XCB_GC_FOREGROUND | XCB_GC_BACKGROUND | XCB_GC_FONT,
+                  values);
+    xcb_close_font(c, font);
+
+    x = 0;
+    y = TEXT_LINE_HEIGHT;
+    start = next = now_seconds();
+    while (next < start + seconds) {
+        xcb_image_text_8(c, 1, screen->root, gc, x, y, &text[i++ % (sizeof(text) - 1)]);
+        xcb_flush(c);
+
+        x += TEXT_CHAR_WIDTH;
+        if (x + TEXT_CHAR_WIDTH > screen->width_in_pixels) {
+            x = 0;
+            y += TEXT_LINE_HEIGHT;
+            if (y > screen->height_in_pixels)
+                y = TEXT_LINE_HEIGHT;
+        }
+
+        next += 1.0 / cps;
+        sleep_until(next);
+    }
+
+    xcb_disconnect(c);
+
+    return 0;
+}
+
+/* Paint a new frame stamp in the top left of the screen, at fps, for
+   'seconds'.  The number of frames painted is returned in 'painted'. */
+int xcbtest_paint_stamps(const char *display, int fps, int seconds, uint32_t *painted)
+{
+    xcb_connection_t *c;
+    xcb_screen_t *screen;
+    xcb_gcontext_t gc;
+    uint32_t pixels[STAMP_WIDTH * STAMP_HEIGHT];
+    double start, next;
+
+    *painted = 0;
+
+    c = xcb_connect(display, NULL);
+    if (xcb_connection_has_error(c))
+        return 1;
+
+    screen = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+    gc = xcb_generate_id(c);
+    xcb_create_gc(c, gc, screen->root, 0, NULL);
+
+    start = next = now_seconds();
+    while (next < start + seconds) {
+        stamp_encode(pixels, STAMP_WIDTH, *painted + 1, stamp_now());
+        xcb_put_image(c, XCB_IMAGE_FORMAT_Z_PIXMAP, screen->root, gc, STAMP_WIDTH, STAMP_HEIGHT,
+                      STAMP_X, STAMP_Y, 0, screen->root_depth, sizeof(pixels), (uint8_t *) pixels);
+        xcb_flush(c);
+        (*painted)++;
+
+        next += 1.0 / fps;
+        sleep_until(next);
+    }
+
+    xcb_disconnect(c);
+
+    return 0;
+}
@@ -21,11 +21,15 @@
 #ifndef XCBTEST_H_
 #define XCBTEST_H_
 
+#include <stdint.h>
 
 /*----------------------------------------------------------------------------
 **  Prototypes
 **--------------------------------------------------------------------------*/
 int xcbtest_draw_grid(const char *display);
 int xcbtest_draw_at_bottom(const char *display);
+int xcbtest_play_video(const char *display, int w, int h, int fps, int seconds);
+int xcbtest_type_text(const char *display, int cps, int seconds);
+int xcbtest_paint_stamps(const char *display, int fps, int seconds, uint32_t *painted);
 
 #endif
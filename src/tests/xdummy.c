@@ -243,6 +243,12 @@ static void configure_xorg_parameters(xdummy_t *server, gconstpointer user_data)
         server->vmode = "3840 2160";
     }
 
+    if (strlen(user_data) > 6 && memcmp(user_data, "bench_", 6) == 0) {
+        server->desired_vram = ((1920 * 1080 * 4) + 1023) / 1024;
+        server->modes = "\"1920x1080\"";
+        server->vmode = "1920 1080";
+    }
+
     if (strlen(user_data) > 7 && memcmp(user_data, "client_", 7) == 0) {
         server->desired_vram = ((1280 * 1024 * 4) + 1023) / 1024;
         server->modes = "\"1280x1024\"";
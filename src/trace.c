@@ -0,0 +1,294 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*----------------------------------------------------------------------------
+**  trace.c
+**      Timeline tracing of the draw pipeline, written as Chrome trace
+**  event JSON, which chrome://tracing and the Perfetto UI both load.
+**  Each thread appends fixed size binary records to its own chunk; a
+**  full chunk is handed to a writer thread, which does all formatting
+**  and file I/O.  So a traced thread pays for a clock read and a store,
+**  and never for a write or a flush.  When tracing is off, every call
+**  returns after testing one flag.
+**--------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "x11spice.h"
+#include "trace.h"
+
+typedef struct {
+    gint64 start;
+    gint64 dur;                 /* -1 for an instant */
+    gint arg;
+    guint16 point;
+} trace_record_t;
+
+typedef struct {
+    int tid;
+    char name[TRACE_THREAD_NAME_LEN];
+    int count;
+    trace_record_t records[TRACE_CHUNK_RECORDS];
+} trace_chunk_t;
+
+typedef struct trace_thread_struct {
+    int tid;
+    int named;
+    char name[TRACE_THREAD_NAME_LEN];
+    trace_chunk_t *chunk;
+    struct trace_thread_struct *next;
+} trace_thread_t;
+
+static const char *point_names[TRACE_POINTS] = {
+    "scan cycle",
+    "fullscreen scan",
+    "queue wait",
+    "capture",
+    "build drawable",
+    "push drawable",
+    "x event",
+    "damage",
+    "pop draw",
+    "release",
+    "input flush",
+    "gui status",
+};
+
+static void trace_thread_exit(gpointer data);
+
+static GPrivate thread_trace = G_PRIVATE_INIT(trace_thread_exit);
+
+/* Set before the traced threads start, and cleared once they are done */
+static int trace_on;
+
+static GMutex registry_lock;
+static trace_thread_t *registry;
+static gint next_tid;
+
+static FILE *trace_fp;
+static GAsyncQueue *full_chunks;
+static pthread_t writer_thread;
+static gint64 trace_epoch;
+
+/* Pushed to the writer to tell it to stop */
+static trace_chunk_t end_of_trace;
+
+static void hand_off(trace_thread_t *t)
+{
+    if (t->chunk && t->chunk->count > 0) {
+        g_strlcpy(t->chunk->name, t->name, sizeof(t->chunk->name));
+        g_async_queue_push(full_chunks, t->chunk);
+    } else
+        g_free(t->chunk);
+    t->chunk = NULL;
+}
+
+static void trace_thread_exit(gpointer data)
+{
+    trace_thread_t *t = (trace_thread_t *) data;
+    trace_thread_t **p;
+
+    g_mutex_lock(&registry_lock);
+    for (p = &registry; *p; p = &(*p)->next)
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    if (full_chunks)
+        hand_off(t);
+    g_mutex_unlock(&registry_lock);
+
+    g_free(t->chunk);
+    g_free(t);
+}
+
+static trace_thread_t *trace_thread(void)
+{
+    trace_thread_t *t = g_private_get(&thread_trace);
+
+    if (G_UNLIKELY(!t)) {
+        t = g_new0(trace_thread_t, 1);
+        t->tid = g_atomic_int_add(&next_tid, 1) + 1;
+        g_snprintf(t->name, sizeof(t->name), "thread %d", t->tid);
+        g_private_set(&thread_trace, t);
+
+        g_mutex_lock(&registry_lock);
+        t->next = registry;
+        registry = t;
+        g_mutex_unlock(&registry_lock);
+    }
+
+    return t;
+}
+
+static void trace_record(trace_point_t point, gint64 start, gint64 dur, int arg)
+{
+    trace_thread_t *t = trace_thread();
+    trace_record_t *r;
+
+    if (G_UNLIKELY(!t->chunk)) {
+        t->chunk = g_new(trace_chunk_t, 1);
+        t->chunk->tid = t->tid;
+        t->chunk->count = 0;
+    }
+
+    r = &t->chunk->records[t->chunk->count++];
+    r->start = start;
+    r->dur = dur;
+    r->arg = arg;
+    r->point = point;
+
+    if (t->chunk->count == TRACE_CHUNK_RECORDS)
+        hand_off(t);
+}
+
+static void write_chunk(trace_chunk_t *c, int *first)
+{
+    int i;
+
+    fprintf(trace_fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s\"}}", *first ? "" : ",\n", getpid(), c->tid, c->name);
+    *first = FALSE;
+
+    for (i = 0; i < c->count; i++) {
+        trace_record_t *r = &c->records[i];
+        fprintf(trace_fp, ",\n{\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%" G_GINT64_FORMAT,
+                point_names[r->point], getpid(), c->tid, r->start - trace_epoch);
+        if (r->dur >= 0)
+            fprintf(trace_fp, ",\"ph\":\"X\",\"dur\":%" G_GINT64_FORMAT, r->dur);
+        else
+            fprintf(trace_fp, ",\"ph\":\"i\",\"s\":\"t\"");
+        fprintf(trace_fp, ",\"args\":{\"n\":%d}}", r->arg);
+    }
+}
+
+static void *trace_writer(void *opaque G_GNUC_UNUSED)
+{
+    trace_chunk_t *c;
+    int first = TRUE;
+
+    fprintf(trace_fp, "{\"traceEvents\":[\n");
+    while ((c = g_async_queue_pop(full_chunks)) != &end_of_trace) {
+        write_chunk(c, &first);
+        g_free(c);
+    }
+    fprintf(trace_fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    return NULL;
+}
+
+int trace_open(const char *path)
+{
+    trace_fp = fopen(path, "w");
+    if (!trace_fp) {
+        g_warning("Could not open trace file %s", path);
+        return X11SPICE_ERR_OPEN;
+    }
+
+    full_chunks = g_async_queue_new();
+    trace_epoch = g_get_monotonic_time();
+
+    if (pthread_create(&writer_thread, NULL, trace_writer, NULL)) {
+        g_async_queue_unref(full_chunks);
+        full_chunks = NULL;
+        fclose(trace_fp);
+        trace_fp = NULL;
+        return X11SPICE_ERR_OPEN;
+    }
+
+    trace_on = TRUE;
+    g_message("Writing trace events to %s", path);
+    return 0;
+}
+
+/* Call once the traced threads have stopped; anything a thread records
+   after this is dropped */
+void trace_close(void)
+{
+    trace_thread_t *t;
+
+    if (!trace_fp)
+        return;
+
+    trace_on = FALSE;
+
+    g_mutex_lock(&registry_lock);
+    for (t = registry; t; t = t->next)
+        hand_off(t);
+    g_mutex_unlock(&registry_lock);
+
+    g_async_queue_push(full_chunks, &end_of_trace);
+    pthread_join(writer_thread, NULL);
+
+    g_mutex_lock(&registry_lock);
+    g_async_queue_unref(full_chunks);
+    full_chunks = NULL;
+    g_mutex_unlock(&registry_lock);
+
+    fclose(trace_fp);
+    trace_fp = NULL;
+}
+
+/* Only the first name given sticks, so callers that cannot tell when
+   their thread starts may call this every time */
+void trace_thread_name(const char *fmt, ...)
+{
+    trace_thread_t *t;
+    va_list ap;
+
+    if (!trace_on)
+        return;
+
+    t = trace_thread();
+    if (t->named)
+        return;
+    t->named = TRUE;
+
+    va_start(ap, fmt);
+    g_vsnprintf(t->name, sizeof(t->name), fmt, ap);
+    va_end(ap);
+}
+
+gint64 trace_begin(void)
+{
+    return trace_on ? g_get_monotonic_time() : 0;
+}
+
+void trace_end(trace_point_t point, gint64 start, int arg)
+{
+    if (!trace_on || !start)
+        return;
+
+    trace_record(point, start, g_get_monotonic_time() - start, arg);
+}
+
+void trace_instant(trace_point_t point, int arg)
+{
+    if (!trace_on)
+        return;
+
+    trace_record(point, g_get_monotonic_time(), -1, arg);
+}
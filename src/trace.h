@@ -0,0 +1,61 @@
+/*
+    Copyright (C) 2016  Jeremy White <jwhite@codeweavers.com>
+    All rights reserved.
+
+    This file is part of x11spice
+
+    x11spice is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    x11spice is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with x11spice.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <glib.h>
+
+/*----------------------------------------------------------------------------
+**  Definitions and simple types
+**--------------------------------------------------------------------------*/
+typedef enum {
+    TRACE_SCAN_CYCLE,
+    TRACE_FULLSCREEN_SCAN,
+    TRACE_QUEUE_WAIT,
+    TRACE_CAPTURE,
+    TRACE_BUILD_DRAWABLE,
+    TRACE_PUSH_DRAWABLE,
+    TRACE_X_EVENT,
+    TRACE_DAMAGE,
+    TRACE_POP_DRAW,
+    TRACE_RELEASE,
+    TRACE_INPUT_FLUSH,
+    TRACE_GUI_STATUS,
+    TRACE_POINTS
+} trace_point_t;
+
+/* Records are buffered per thread and handed to the writer this many at a time */
+#define TRACE_CHUNK_RECORDS         4096
+#define TRACE_THREAD_NAME_LEN       32
+
+/*----------------------------------------------------------------------------
+**  Prototypes
+**--------------------------------------------------------------------------*/
+int trace_open(const char *path);
+void trace_close(void);
+
+void trace_thread_name(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+gint64 trace_begin(void);
+void trace_end(trace_point_t point, gint64 start, int arg);
+void trace_instant(trace_point_t point, int arg);
+
+#endif